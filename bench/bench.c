@@ -0,0 +1,158 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * latency histograms and the report format shared by the benchmarks.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+static inline int bucket_of(uint64_t v)
+{
+	int msb;
+
+	if (v < (1 << BENCH_SUB_BITS))
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+
+	return ((msb - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+		((v >> (msb - BENCH_SUB_BITS)) & ((1 << BENCH_SUB_BITS) - 1));
+}
+
+/* the largest value of a bucket */
+static inline uint64_t bucket_max(int b)
+{
+	int shift = (b >> BENCH_SUB_BITS) - 1;
+	uint64_t sub = b & ((1 << BENCH_SUB_BITS) - 1);
+
+	if (b < (1 << BENCH_SUB_BITS))
+		return b;
+
+	return (((1 << BENCH_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void bench_hist_init(struct bench_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+	h->start = UINT64_MAX;
+}
+
+void bench_hist_add(struct bench_hist *h, uint64_t nsec)
+{
+	h->buckets[bucket_of(nsec)]++;
+	h->count++;
+
+	if (nsec < h->min)
+		h->min = nsec;
+	if (nsec > h->max)
+		h->max = nsec;
+}
+
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	int i;
+
+	for (i = 0; i < BENCH_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->errors += src->errors;
+
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	if (src->start < dst->start)
+		dst->start = src->start;
+	if (src->end > dst->end)
+		dst->end = src->end;
+}
+
+/* the latency @p (0..1) of the operations are within */
+uint64_t bench_hist_percentile(const struct bench_hist *h, double p)
+{
+	int i;
+	uint64_t seen = 0;
+	uint64_t rank = (uint64_t) (p * h->count + 0.5);
+
+	if (h->count == 0)
+		return 0;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < BENCH_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return bucket_max(i) < h->max ? bucket_max(i) : h->max;
+	}
+
+	return h->max;
+}
+
+void bench_gate_init(struct bench_gate *g)
+{
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	g->state = 0;
+}
+
+void bench_gate_destroy(struct bench_gate *g)
+{
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->lock);
+}
+
+/* returns 0 once the gate opens, or -1 if the workload is called off */
+int bench_gate_wait(struct bench_gate *g)
+{
+	int state;
+
+	pthread_mutex_lock(&g->lock);
+	while (g->state == 0)
+		pthread_cond_wait(&g->cond, &g->lock);
+	state = g->state;
+	pthread_mutex_unlock(&g->lock);
+
+	return state > 0 ? 0 : -1;
+}
+
+void bench_gate_open(struct bench_gate *g, int run)
+{
+	pthread_mutex_lock(&g->lock);
+	g->state = run ? 1 : -1;
+	pthread_cond_broadcast(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+}
+
+void bench_report_header(FILE *fp)
+{
+	fprintf(fp, "%-12s %4s %10s %12s %9s %9s %9s %9s %10s %7s\n",
+		"# workload", "thr", "ops", "ops/s", "MiB/s", "p50(us)",
+		"p99(us)", "p999(us)", "max(us)", "errors");
+}
+
+void bench_report(FILE *fp, const char *name, int threads,
+		const struct bench_hist *h, uint64_t bytes)
+{
+	double sec = h->end > h->start ? (h->end - h->start) / 1e9 : 0;
+	char mbs[16] = "-";
+
+	if (bytes && sec > 0)
+		snprintf(mbs, sizeof(mbs), "%.1f", bytes / sec / (1 << 20));
+
+	fprintf(fp, "%-12s %4d %10llu %12.1f %9s %9.1f %9.1f %9.1f %10.1f %7llu\n",
+		name, threads, (unsigned long long) h->count,
+		sec > 0 ? h->count / sec : 0.0, mbs,
+		bench_hist_percentile(h, 0.50) / 1e3,
+		bench_hist_percentile(h, 0.99) / 1e3,
+		bench_hist_percentile(h, 0.999) / 1e3,
+		h->max / 1e3, (unsigned long long) h->errors);
+	fflush(fp);
+}
@@ -0,0 +1,76 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/**
+ * latency histogram, implemented at bench.c: buckets of 1/16 of a power of
+ * two (about 6% wide) from 1 nsec up, so that percentiles of runs with
+ * different numbers of operations can be compared.
+ */
+
+#define BENCH_SUB_BITS		4
+#define BENCH_BUCKETS		((64 - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS)
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t min;
+	uint64_t max;
+	uint64_t start;		/* of the first operation, bench_now() */
+	uint64_t end;		/* of the last one */
+	uint64_t buckets[BENCH_BUCKETS];
+};
+
+void bench_hist_init(struct bench_hist *h);
+
+void bench_hist_add(struct bench_hist *h, uint64_t nsec);
+
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src);
+
+uint64_t bench_hist_percentile(const struct bench_hist *h, double p);
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * the start of the worker threads of a workload: they wait until all of them
+ * are created and run together, or return if one of them could not be.
+ */
+
+struct bench_gate {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;		/* 0: closed, 1: open, -1: called off */
+};
+
+void bench_gate_init(struct bench_gate *g);
+
+void bench_gate_destroy(struct bench_gate *g);
+
+int bench_gate_wait(struct bench_gate *g);
+
+void bench_gate_open(struct bench_gate *g, int run);
+
+/**
+ * report lines, one per workload, with the same columns for every tool:
+ * throughput over the wall-clock time of the workload, from the first start
+ * to the last end of its threads, and latencies in usec. @bytes is the data
+ * moved (0 for metadata workloads).
+ */
+
+void bench_report_header(FILE *fp);
+
+void bench_report(FILE *fp, const char *name, int threads,
+		const struct bench_hist *h, uint64_t bytes);
+
+#endif	/* _BENCH_H_ */
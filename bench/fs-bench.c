@@ -0,0 +1,356 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * fs-bench: file system workloads on a directory, usually an xattrfs mount
+ * (see run-bench.sh), or its base directory for the cost of the passthrough.
+ * each thread works in a directory of its own, and the workloads run one
+ * after another on the files the previous ones left.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "bench.h"
+
+#define BENCH_NAME		"user.bench"
+
+enum {
+	W_CREATE = 0,
+	W_SETXATTR,
+	W_GETXATTR,
+	W_LISTXATTR,
+	W_REMOVEXATTR,
+	W_READDIR,
+	W_SEQ_WRITE,
+	W_SEQ_READ,
+	W_RAND_WRITE,
+	W_RAND_READ,
+	W_UNLINK,
+
+	N_WORKLOADS
+};
+
+static const char *workloads[] = {
+	"create", "setxattr", "getxattr", "listxattr", "removexattr",
+	"readdir+stat", "seq-write", "seq-read", "rand-write", "rand-read",
+	"unlink",
+};
+
+static struct {
+	const char *dir;
+	int threads;
+	long files;
+	size_t value;
+	size_t block;
+	size_t size;			/* of the data file of a thread */
+	struct bench_gate gate;
+} b = {
+	.threads = 4,
+	.files = 1000,
+	.value = 64,
+	.block = 4096,
+	.size = 64 << 20,
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int workload;
+	unsigned int seed;
+	char *buf;
+	struct bench_hist hist;
+};
+
+static inline void timed(struct worker *w, uint64_t start, int failed)
+{
+	bench_hist_add(&w->hist, bench_now() - start);
+	if (failed)
+		w->hist.errors++;
+}
+
+static void file_path(struct worker *w, long i, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/t%d/f%ld", b.dir, w->id, i);
+}
+
+static void xattr_ops(struct worker *w)
+{
+	long i;
+	uint64_t t;
+	int ret = 0;
+	char path[PATH_MAX];
+
+	for (i = 0; i < b.files; i++) {
+		file_path(w, i, path);
+
+		t = bench_now();
+		switch (w->workload) {
+		case W_CREATE:
+			ret = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+			if (ret >= 0)
+				ret = close(ret);
+			break;
+		case W_SETXATTR:
+			ret = setxattr(path, BENCH_NAME, w->buf, b.value, 0);
+			break;
+		case W_GETXATTR:
+			ret = getxattr(path, BENCH_NAME, w->buf, b.value) !=
+				(ssize_t) b.value;
+			break;
+		case W_LISTXATTR:
+			ret = listxattr(path, w->buf, b.block) <= 0;
+			break;
+		case W_REMOVEXATTR:
+			ret = removexattr(path, BENCH_NAME);
+			break;
+		case W_UNLINK:
+			ret = unlink(path);
+			break;
+		}
+		timed(w, t, ret != 0);
+	}
+}
+
+/* an operation is a directory entry and its stat */
+static void readdir_stat(struct worker *w)
+{
+	uint64_t t;
+	int ret;
+	DIR *dp;
+	struct dirent *de;
+	struct stat sb;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/t%d", b.dir, w->id);
+
+	dp = opendir(path);
+	if (!dp) {
+		w->hist.errors++;
+		return;
+	}
+
+	for (;;) {
+		t = bench_now();
+		de = readdir(dp);
+		if (!de)
+			break;
+
+		ret = fstatat(dirfd(dp), de->d_name, &sb, AT_SYMLINK_NOFOLLOW);
+		timed(w, t, ret != 0);
+	}
+
+	closedir(dp);
+}
+
+/* an operation is a block */
+static void data_ops(struct worker *w)
+{
+	long i, n = b.size / b.block;
+	uint64_t t;
+	ssize_t ret;
+	off_t off;
+	int fd;
+	int wr = w->workload == W_SEQ_WRITE || w->workload == W_RAND_WRITE;
+	int rnd = w->workload == W_RAND_WRITE || w->workload == W_RAND_READ;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/t%d/data", b.dir, w->id);
+
+	fd = open(path, wr ? O_CREAT | O_WRONLY : O_RDONLY, 0644);
+	if (fd < 0) {
+		w->hist.errors++;
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		off = (rnd ? rand_r(&w->seed) % n : i) * (off_t) b.block;
+
+		t = bench_now();
+		ret = wr ? pwrite(fd, w->buf, b.block, off)
+			 : pread(fd, w->buf, b.block, off);
+		timed(w, t, ret != (ssize_t) b.block);
+	}
+
+	/* the data is on the file system, not only in the page cache */
+	if (wr && fsync(fd))
+		w->hist.errors++;
+
+	close(fd);
+
+	if (w->workload == W_RAND_READ)
+		unlink(path);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	bench_hist_init(&w->hist);
+	if (bench_gate_wait(&b.gate))
+		return NULL;
+
+	w->hist.start = bench_now();
+	switch (w->workload) {
+	case W_READDIR:
+		readdir_stat(w);
+		break;
+	case W_SEQ_WRITE:
+	case W_SEQ_READ:
+	case W_RAND_WRITE:
+	case W_RAND_READ:
+		data_ops(w);
+		break;
+	default:
+		xattr_ops(w);
+		break;
+	}
+	w->hist.end = bench_now();
+
+	return NULL;
+}
+
+static int run_workload(struct worker *workers, int workload)
+{
+	int i, n;
+	uint64_t bytes = 0;
+	struct bench_hist total;
+
+	bench_hist_init(&total);
+	bench_gate_init(&b.gate);
+
+	for (n = 0; n < b.threads; n++) {
+		workers[n].workload = workload;
+		if (pthread_create(&workers[n].thread, NULL, worker_main,
+				   &workers[n]))
+			break;
+	}
+
+	/* the threads that were created return without a run */
+	bench_gate_open(&b.gate, n == b.threads);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(workers[i].thread, NULL);
+		bench_hist_merge(&total, &workers[i].hist);
+	}
+
+	bench_gate_destroy(&b.gate);
+
+	if (n < b.threads)
+		return -1;
+
+	if (workload >= W_SEQ_WRITE && workload <= W_RAND_READ)
+		bytes = total.count * b.block;
+
+	bench_report(stdout, workloads[workload], b.threads, &total, bytes);
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [OPTIONS].. <dir>\n\n"
+	       "  -t N     threads (4)\n"
+	       "  -n N     files per thread (1000)\n"
+	       "  -v B     xattr value size (64)\n"
+	       "  -b B     I/O block size (4096)\n"
+	       "  -s MB    data file size per thread (64)\n"
+	       "  -l NAME  label of the report\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int op, i;
+	int ret = 1;
+	const char *label = NULL;
+	char path[PATH_MAX];
+	struct worker *workers;
+
+	while ((op = getopt(argc, argv, "t:n:v:b:s:l:h")) != -1) {
+		switch (op) {
+		case 't':
+			b.threads = atoi(optarg);
+			break;
+		case 'n':
+			b.files = atol(optarg);
+			break;
+		case 'v':
+			b.value = atol(optarg);
+			break;
+		case 'b':
+			b.block = atol(optarg);
+			break;
+		case 's':
+			b.size = (size_t) atol(optarg) << 20;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return op == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1 || b.threads <= 0 || b.files <= 0 ||
+	    b.value == 0 || b.block < b.value + 64 || b.size < b.block) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	b.dir = argv[optind];
+
+	workers = calloc(b.threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < b.threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].buf = malloc(b.block);
+		if (!workers[i].buf) {
+			perror("malloc");
+			goto out;
+		}
+		memset(workers[i].buf, 'a' + i % 26, b.block);
+
+		snprintf(path, sizeof(path), "%s/t%d", b.dir, i);
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			perror(path);
+			goto out;
+		}
+	}
+
+	printf("# fs-bench: %s%sthreads=%d files=%ld value=%zu block=%zu "
+	       "size=%zuMiB\n", label ? label : "", label ? " " : "",
+	       b.threads, b.files, b.value, b.block, b.size >> 20);
+	bench_report_header(stdout);
+
+	for (i = 0; i < N_WORKLOADS; i++)
+		if (run_workload(workers, i))
+			goto out;
+
+	ret = 0;
+out:
+	for (i = 0; i < b.threads; i++) {
+		snprintf(path, sizeof(path), "%s/t%d", b.dir, i);
+		rmdir(path);
+		free(workers[i].buf);
+	}
+	free(workers);
+	return ret;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# run-bench.sh: mounts xattrfs on a temporary directory and runs fs-bench on
+# its base directory, for reference, and then on the mount.
+#
+# usage: run-bench.sh <xattrfs> <fs-bench> [fs-bench options]..
+# the mount options are taken from $XATTRFS_OPTS (e.g. "-o group_commit").
+
+xattrfs=$1
+fsbench=$2
+shift 2
+
+if [ ! -x "$xattrfs" ] || [ ! -x "$fsbench" ]; then
+	echo "usage: $0 <xattrfs> <fs-bench> [fs-bench options].." >&2
+	exit 1
+fi
+
+tmp=`mktemp -d ${TMPDIR:-/tmp}/xattrfs-bench.XXXXXX` || exit 1
+mkdir "$tmp/base" "$tmp/mnt" || exit 1
+
+cleanup() {
+	if grep -q " $tmp/mnt " /proc/mounts; then
+		fusermount -u "$tmp/mnt"
+	fi
+	rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+"$fsbench" -l base "$@" "$tmp/base" || exit 1
+echo
+
+"$xattrfs" $XATTRFS_OPTS "b:$tmp/base" "$tmp/mnt" || exit 1
+
+# the file system goes to the background before it is mounted
+i=0
+while ! grep -q " $tmp/mnt " /proc/mounts; do
+	i=`expr $i + 1`
+	if [ $i -gt 50 ]; then
+		echo "$tmp/mnt: not mounted" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+"$fsbench" -l "xattrfs $XATTRFS_OPTS" "$@" "$tmp/mnt"
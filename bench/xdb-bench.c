@@ -0,0 +1,317 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * xdb-bench: the xdb interface (xattrfs-xdb.c) on a temporary database,
+ * without fuse. each thread works on inodes of its own, and the workloads run
+ * one after another on the xattrs the previous ones left.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/xattr.h>
+
+#include "xattrfs.h"
+#include "bench.h"
+
+#define BENCH_NAME		"user.bench"
+#define BENCH_MISS		"user.nonexistent"
+
+enum {
+	W_SET = 0,
+	W_GET,
+	W_GET_MISS,
+	W_LIST,
+	W_REPLACE,
+	W_REMOVE,
+
+	N_WORKLOADS
+};
+
+static const char *workloads[] = {
+	"set", "get", "get-miss", "list", "replace", "remove",
+};
+
+static struct {
+	int threads;
+	long ops;
+	size_t size;
+	int keep;
+	struct xdb *xdb;
+	struct bench_gate gate;
+} b = {
+	.threads = 4,
+	.ops = 10000,
+	.size = 64,
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int workload;
+	struct bench_hist hist;
+};
+
+static int run_op(int workload, ino_t ino, char *value, char *buf)
+{
+	switch (workload) {
+	case W_SET:
+		return xdb_setxattr(b.xdb, ino, BENCH_NAME, value, b.size,
+				    XATTR_CREATE);
+	case W_GET:
+		return xdb_getxattr(b.xdb, ino, BENCH_NAME, buf, b.size) !=
+			(int) b.size;
+	case W_GET_MISS:
+		return xdb_getxattr(b.xdb, ino, BENCH_MISS, buf, b.size) !=
+			-ENODATA;
+	case W_LIST:
+		return xdb_listxattr(b.xdb, ino, buf, b.size + 64) <= 0;
+	case W_REPLACE:
+		return xdb_setxattr(b.xdb, ino, BENCH_NAME, value, b.size,
+				    XATTR_REPLACE);
+	case W_REMOVE:
+		return xdb_removexattr(b.xdb, ino, BENCH_NAME);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	long i;
+	uint64_t t;
+	struct worker *w = arg;
+	ino_t base = 1 + (ino_t) w->id * b.ops;
+	char *value = malloc(b.size + 1);
+	char *buf = malloc(b.size + 64);
+
+	bench_hist_init(&w->hist);
+	if (bench_gate_wait(&b.gate))
+		goto out;
+
+	w->hist.start = bench_now();
+	if (!value || !buf) {
+		w->hist.errors = b.ops;
+		goto out;
+	}
+
+	/* sqlite does not rewrite a row with the same value */
+	memset(value, (w->workload == W_REPLACE ? 'A' : 'a') + w->id % 26,
+	       b.size);
+
+	for (i = 0; i < b.ops; i++) {
+		t = bench_now();
+		if (run_op(w->workload, base + i, value, buf))
+			w->hist.errors++;
+		bench_hist_add(&w->hist, bench_now() - t);
+	}
+
+	w->hist.end = bench_now();
+out:
+	free(value);
+	free(buf);
+	return NULL;
+}
+
+static int run_workload(struct worker *workers, int workload)
+{
+	int i, n;
+	struct bench_hist total;
+
+	bench_hist_init(&total);
+	bench_gate_init(&b.gate);
+
+	for (n = 0; n < b.threads; n++) {
+		workers[n].id = n;
+		workers[n].workload = workload;
+		if (pthread_create(&workers[n].thread, NULL, worker_main,
+				   &workers[n]))
+			break;
+	}
+
+	/* the threads that were created return without a run */
+	bench_gate_open(&b.gate, n == b.threads);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(workers[i].thread, NULL);
+		bench_hist_merge(&total, &workers[i].hist);
+	}
+
+	bench_gate_destroy(&b.gate);
+
+	if (n < b.threads)
+		return -1;
+
+	bench_report(stdout, workloads[workload], b.threads, &total,
+		     workload == W_GET || workload == W_SET ||
+		     workload == W_REPLACE ? total.count * b.size : 0);
+
+	return 0;
+}
+
+/* the database files, with their journals */
+static void cleanup(const char *dir, int tmpdir)
+{
+	DIR *dp;
+	struct dirent *de;
+	char path[PATH_MAX];
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+
+	while ((de = readdir(dp)) != NULL) {
+		if (0 == strncmp(de->d_name, ".xattr", 6)) {
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			unlink(path);
+		}
+	}
+
+	closedir(dp);
+
+	if (tmpdir)
+		rmdir(dir);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [OPTIONS]..\n\n"
+	       "  -B NAME  backend (sqlite)\n"
+	       "  -l NAME  layout of the database (rows)\n"
+	       "  -t N     threads (4)\n"
+	       "  -n N     operations per thread and workload (10000)\n"
+	       "  -s B     value size (64)\n"
+	       "  -d TIER  durability tier (strict)\n"
+	       "  -S N     shards (1)\n"
+	       "  -g       group commit\n"
+	       "  -c KB    value cache (16384, 0: off)\n"
+	       "  -D DIR   directory of the database (a temporary one)\n"
+	       "  -k       keep the database\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int op, i;
+	int ret = 1;
+	int shards = 1;
+	int group_commit = 0;
+	long value_cache = -1;
+	char *tier = NULL;
+	char *backend = NULL;
+	char *layout = NULL;
+	char *dir = NULL;
+	char tmp[] = "/tmp/xdb-bench.XXXXXX";
+	struct xdb_config cfg;
+	struct worker *workers;
+
+	while ((op = getopt(argc, argv, "B:l:t:n:s:d:S:gc:D:kh")) != -1) {
+		switch (op) {
+		case 'B':
+			backend = optarg;
+			break;
+		case 'l':
+			layout = optarg;
+			break;
+		case 't':
+			b.threads = atoi(optarg);
+			break;
+		case 'n':
+			b.ops = atol(optarg);
+			break;
+		case 's':
+			b.size = atol(optarg);
+			break;
+		case 'd':
+			tier = optarg;
+			break;
+		case 'S':
+			shards = atoi(optarg);
+			break;
+		case 'g':
+			group_commit = 1;
+			break;
+		case 'c':
+			value_cache = atol(optarg);
+			break;
+		case 'D':
+			dir = optarg;
+			break;
+		case 'k':
+			b.keep = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return op == 'h' ? 0 : 1;
+		}
+	}
+
+	if (xdb_config_init(&cfg, tier)) {
+		fprintf(stderr, "unknown durability tier: %s\n", tier);
+		return 1;
+	}
+
+	if (backend)
+		cfg.backend = backend;
+	cfg.layout = layout;
+	cfg.shards = shards;
+	cfg.group_commit = group_commit;
+	if (value_cache >= 0)
+		cfg.value_cache = value_cache;
+	else if (0 == strcmp(cfg.backend, "kv"))
+		cfg.value_cache = 0;
+
+	if (b.threads <= 0 || b.ops <= 0 || b.size == 0 ||
+	    xdb_config_check(&cfg)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!dir) {
+		dir = mkdtemp(tmp);
+		if (!dir) {
+			perror("mkdtemp");
+			return 1;
+		}
+	}
+
+	workers = calloc(b.threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		goto out;
+	}
+
+	if (xdb_init(&b.xdb, dir, &cfg)) {
+		fprintf(stderr, "%s: cannot open the xattr database\n", dir);
+		goto out;
+	}
+
+	printf("# xdb-bench: backend=%s layout=%s threads=%d ops=%ld size=%zu "
+	       "journal=%s sync=%s shards=%d group_commit=%d value_cache=%ld "
+	       "sqlite=%s\n",
+	       cfg.backend, b.xdb->layout ? "packed" : "rows", b.threads,
+	       b.ops, b.size, cfg.journal, cfg.sync,
+	       cfg.shards, cfg.group_commit, cfg.value_cache,
+	       sqlite3_libversion());
+	bench_report_header(stdout);
+
+	for (i = 0; i < N_WORKLOADS; i++)
+		if (run_workload(workers, i))
+			goto out_xdb;
+
+	ret = 0;
+out_xdb:
+	xdb_exit(b.xdb);
+out:
+	if (!b.keep)
+		cleanup(dir, dir == tmp);
+	free(workers);
+	return ret;
+}
@@ -0,0 +1,389 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * xattr value cache: a bounded LRU of (ino, name) -> value, which also keeps
+ * "no such attribute" results. the cache is split into shards, each with its
+ * own lock, hash table, LRU list and share of the memory limit.
+ *
+ * the packed name list of an inode (for listxattr) is cached as the value of
+ * the empty name, which no real xattr can have.
+ *
+ * a miss returns the shard sequence number, and xdb_cache_insert() drops the
+ * value if the shard has been invalidated since then. so a reader that races
+ * with setxattr or removexattr never caches the old value.
+ *
+ * the values a reader gets along with the one it asked for (see
+ * xdb_cache_prefill()) have no miss of their own, and are checked against
+ * cache->gen instead, which every invalidation bumps.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "xattrfs.h"
+
+#define CACHE_SHARDS		64
+#define CACHE_MIN_BUCKETS	64
+
+struct cache_entry {
+	struct cache_entry *hnext;
+	struct cache_entry *prev;	/* LRU, most recent first */
+	struct cache_entry *next;
+	uint32_t hash;
+	ino_t ino;
+	ssize_t size;			/* -1: no such attribute */
+	char *value;
+	char name[];			/* followed by the value */
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry **buckets;
+	unsigned int nbuckets;
+	struct cache_entry lru;		/* sentinel */
+	size_t bytes;
+	size_t limit;
+	uint64_t seq;			/* bumped on each invalidation */
+	uint64_t entries;
+	uint64_t hits;
+	uint64_t neg_hits;
+	uint64_t misses;
+	uint64_t evictions;
+} __attribute__((aligned(64)));
+
+struct xdb_cache {
+	struct cache_shard shards[CACHE_SHARDS];
+	uint64_t gen;
+};
+
+static inline uint32_t hash_key(ino_t ino, const char *name)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+	uint64_t i = (uint64_t) ino;
+	int n;
+
+	for (n = 0; n < 8; n++, i >>= 8) {
+		h ^= (uint8_t) i;
+		h *= 16777619U;
+	}
+
+	while (*name) {
+		h ^= (uint8_t) *name++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static inline struct cache_shard *get_shard(struct xdb_cache *cache,
+						uint32_t hash)
+{
+	return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static inline struct cache_entry **get_bucket(struct cache_shard *shard,
+						uint32_t hash)
+{
+	return &shard->buckets[(hash / CACHE_SHARDS) & (shard->nbuckets - 1)];
+}
+
+static inline size_t entry_bytes(struct cache_entry *e)
+{
+	return sizeof(*e) + strlen(e->name) + 1 + (e->size > 0 ? e->size : 0);
+}
+
+static inline void lru_del(struct cache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static inline void lru_add(struct cache_shard *shard, struct cache_entry *e)
+{
+	e->next = shard->lru.next;
+	e->prev = &shard->lru;
+	shard->lru.next->prev = e;
+	shard->lru.next = e;
+}
+
+static struct cache_entry **find(struct cache_shard *shard, uint32_t hash,
+				 ino_t ino, const char *name)
+{
+	struct cache_entry **pos;
+
+	for (pos = get_bucket(shard, hash); *pos; pos = &(*pos)->hnext) {
+		struct cache_entry *e = *pos;
+
+		if (e->hash == hash && e->ino == ino &&
+		    0 == strcmp(e->name, name))
+			return pos;
+	}
+
+	return NULL;
+}
+
+static void drop(struct cache_shard *shard, struct cache_entry **pos)
+{
+	struct cache_entry *e = *pos;
+
+	*pos = e->hnext;
+	lru_del(e);
+	shard->bytes -= entry_bytes(e);
+	shard->entries--;
+	free(e);
+}
+
+static void evict(struct cache_shard *shard, size_t need)
+{
+	while (shard->bytes + need > shard->limit &&
+	       shard->lru.prev != &shard->lru) {
+		struct cache_entry *e = shard->lru.prev;
+
+		drop(shard, find(shard, e->hash, e->ino, e->name));
+		shard->evictions++;
+	}
+}
+
+/**
+ * external interface
+ */
+
+int xdb_cache_init(struct xdb_cache **cache, size_t limit)
+{
+	int i;
+	unsigned int nbuckets = CACHE_MIN_BUCKETS;
+	struct xdb_cache *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return -ENOMEM;
+
+	/* about one bucket per 256 bytes of cached data */
+	while (nbuckets * 256UL * CACHE_SHARDS < limit)
+		nbuckets <<= 1;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &self->shards[i];
+
+		shard->buckets = calloc(nbuckets, sizeof(*shard->buckets));
+		if (!shard->buckets) {
+			xdb_cache_exit(self);
+			return -ENOMEM;
+		}
+
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->nbuckets = nbuckets;
+		shard->lru.next = shard->lru.prev = &shard->lru;
+		shard->limit = limit / CACHE_SHARDS;
+	}
+
+	*cache = self;
+
+	return 0;
+}
+
+void xdb_cache_exit(struct xdb_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+		struct cache_entry *e, *next;
+
+		if (!shard->buckets)
+			continue;
+
+		for (e = shard->lru.next; e != &shard->lru; e = next) {
+			next = e->next;
+			free(e);
+		}
+
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+
+	free(cache);
+}
+
+int xdb_cache_lookup(struct xdb_cache *cache, ino_t ino, const char *name,
+			char *value, size_t size, ssize_t *ret, uint64_t *seq)
+{
+	uint32_t hash = hash_key(ino, name);
+	struct cache_shard *shard = get_shard(cache, hash);
+	struct cache_entry **pos;
+	struct cache_entry *e;
+
+	pthread_mutex_lock(&shard->lock);
+
+	pos = find(shard, hash, ino, name);
+	if (!pos) {
+		shard->misses++;
+		*seq = shard->seq;
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+
+	e = *pos;
+	lru_del(e);
+	lru_add(shard, e);
+
+	if (e->size < 0) {
+		shard->neg_hits++;
+		*ret = -ENODATA;
+	}
+	else {
+		shard->hits++;
+
+		if (size == 0)
+			*ret = e->size;
+		else if (size < (size_t) e->size)
+			*ret = -ERANGE;
+		else {
+			memcpy(value, e->value, e->size);
+			*ret = e->size;
+		}
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return 1;
+}
+
+/* @gen is the cache->gen to check instead of the shard sequence, or NULL */
+static void insert(struct xdb_cache *cache, ino_t ino, const char *name,
+			const char *value, ssize_t size, uint64_t seq,
+			const uint64_t *gen)
+{
+	uint32_t hash = hash_key(ino, name);
+	struct cache_shard *shard = get_shard(cache, hash);
+	size_t namelen = strlen(name) + 1;
+	struct cache_entry **pos;
+	struct cache_entry *e;
+
+	e = malloc(sizeof(*e) + namelen + (size > 0 ? size : 0));
+	if (!e)
+		return;
+
+	e->hash = hash;
+	e->ino = ino;
+	e->size = size;
+	e->value = &e->name[namelen];
+	memcpy(e->name, name, namelen);
+	if (size > 0)
+		memcpy(e->value, value, size);
+
+	pthread_mutex_lock(&shard->lock);
+
+	/* invalidated since the miss, or too large to be worth it */
+	if ((gen ? *gen != __atomic_load_n(&cache->gen, __ATOMIC_SEQ_CST)
+		 : seq != shard->seq) ||
+	    entry_bytes(e) > shard->limit / 4) {
+		pthread_mutex_unlock(&shard->lock);
+		free(e);
+		return;
+	}
+
+	pos = find(shard, hash, ino, name);
+	if (pos && gen) {
+		/* the same value, which may be in use */
+		pthread_mutex_unlock(&shard->lock);
+		free(e);
+		return;
+	}
+	if (pos)
+		drop(shard, pos);
+
+	evict(shard, entry_bytes(e));
+
+	e->hnext = *get_bucket(shard, hash);
+	*get_bucket(shard, hash) = e;
+	lru_add(shard, e);
+	shard->bytes += entry_bytes(e);
+	shard->entries++;
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void xdb_cache_insert(struct xdb_cache *cache, ino_t ino, const char *name,
+			const char *value, ssize_t size, uint64_t seq)
+{
+	insert(cache, ino, name, value, size, seq, NULL);
+}
+
+#define CACHE_LIST		""
+
+static void invalidate(struct xdb_cache *cache, ino_t ino, const char *name)
+{
+	uint32_t hash = hash_key(ino, name);
+	struct cache_shard *shard = get_shard(cache, hash);
+	struct cache_entry **pos;
+
+	pthread_mutex_lock(&shard->lock);
+
+	pos = find(shard, hash, ino, name);
+	if (pos)
+		drop(shard, pos);
+
+	shard->seq++;
+	__atomic_add_fetch(&cache->gen, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* the name list of the inode changes with any of its names */
+void xdb_cache_invalidate(struct xdb_cache *cache, ino_t ino,
+			const char *name)
+{
+	invalidate(cache, ino, name);
+	invalidate(cache, ino, CACHE_LIST);
+}
+
+int xdb_cache_lookup_list(struct xdb_cache *cache, ino_t ino,
+			char *list, size_t size, ssize_t *ret, uint64_t *seq)
+{
+	return xdb_cache_lookup(cache, ino, CACHE_LIST, list, size, ret, seq);
+}
+
+void xdb_cache_insert_list(struct xdb_cache *cache, ino_t ino,
+			const char *list, size_t size, uint64_t seq)
+{
+	xdb_cache_insert(cache, ino, CACHE_LIST, list, size, seq);
+}
+
+uint64_t xdb_cache_gen(struct xdb_cache *cache)
+{
+	return __atomic_load_n(&cache->gen, __ATOMIC_SEQ_CST);
+}
+
+void xdb_cache_prefill(struct xdb_cache *cache, ino_t ino, const char *name,
+			const char *value, size_t size, uint64_t gen)
+{
+	insert(cache, ino, name, value, size, 0, &gen);
+}
+
+void xdb_cache_stats(struct xdb_cache *cache, struct xdb_cache_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->hits;
+		stats->neg_hits += shard->neg_hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->entries += shard->entries;
+		stats->bytes += shard->bytes;
+		stats->limit += shard->limit;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
@@ -0,0 +1,790 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * the control namespace: a virtual directory (XATTRFS_CTL_DIR) at the root of
+ * the mount, which does not exist in the base directory. the contents of a
+ * control file are generated when it is opened, and read with direct_io, and
+ * a write to a writable one is a command.
+ *
+ * the directory is not listed in the root, so that tree walkers (backups,
+ * rsync, find) never descend into it.
+ *
+ * with -o query, QUERY_DIR/<name>[=<value>[*]] is a directory of the files
+ * with the xattr <name> (with the value <value>, or a value starting with it),
+ * found with an index query instead of a tree walk. each entry is a symlink
+ * to the file, named after its path with '%' and '/' escaped (%25, %2F).
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FUSE_USE_VERSION		26
+#include <fuse.h>
+
+#include "xattrfs.h"
+
+#define QUERY_DIR		XATTRFS_CTL_DIR "/query"
+#define QUERY_DEPTH		256	/* max. directory levels of a match */
+
+struct ctl_buf {
+	char *data;
+	size_t len;
+	int index;			/* in ctl_files[] */
+};
+
+static void show_sqlite(struct xattrfs_ctx *ctx, FILE *fp)
+{
+	int i;
+	sqlite3_int64 mem, pages, overflow, mallocs, hi;
+	struct xdb_status st;
+
+	sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &mem, &hi, 0);
+	sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &mallocs, &hi, 0);
+	sqlite3_status64(SQLITE_STATUS_PAGECACHE_USED, &pages, &hi, 0);
+	sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &overflow, &hi, 0);
+
+	fprintf(fp, "# TYPE xattrfs_sqlite_memory_used_bytes gauge\n"
+		    "xattrfs_sqlite_memory_used_bytes %lld\n"
+		    "# TYPE xattrfs_sqlite_malloc_count gauge\n"
+		    "xattrfs_sqlite_malloc_count %lld\n"
+		    "# TYPE xattrfs_sqlite_pagecache_used_pages gauge\n"
+		    "xattrfs_sqlite_pagecache_used_pages %lld\n"
+		    "# TYPE xattrfs_sqlite_pagecache_overflow_bytes gauge\n"
+		    "xattrfs_sqlite_pagecache_overflow_bytes %lld\n",
+		    mem, mallocs, pages, overflow);
+
+	fprintf(fp, "# TYPE xattrfs_db_connections gauge\n"
+		    "# TYPE xattrfs_db_cache_used_bytes gauge\n"
+		    "# TYPE xattrfs_db_cache_hits_total counter\n"
+		    "# TYPE xattrfs_db_cache_misses_total counter\n"
+		    "# TYPE xattrfs_db_cache_writes_total counter\n"
+		    "# TYPE xattrfs_db_schema_used_bytes gauge\n"
+		    "# TYPE xattrfs_db_stmt_used_bytes gauge\n");
+
+	for (i = 0; i < ctx->xdb->nshards; i++) {
+		xdb_status(ctx->xdb, i, &st);
+
+		fprintf(fp, "xattrfs_db_connections{shard=\"%d\"} %d\n"
+			    "xattrfs_db_cache_used_bytes{shard=\"%d\"} %llu\n"
+			    "xattrfs_db_cache_hits_total{shard=\"%d\"} %llu\n"
+			    "xattrfs_db_cache_misses_total{shard=\"%d\"} %llu\n"
+			    "xattrfs_db_cache_writes_total{shard=\"%d\"} %llu\n"
+			    "xattrfs_db_schema_used_bytes{shard=\"%d\"} %llu\n"
+			    "xattrfs_db_stmt_used_bytes{shard=\"%d\"} %llu\n",
+			    i, st.conns, i, _llu(st.cache_used),
+			    i, _llu(st.cache_hits), i, _llu(st.cache_misses),
+			    i, _llu(st.cache_writes), i, _llu(st.schema_used),
+			    i, _llu(st.stmt_used));
+	}
+}
+
+static void show_kv(struct xattrfs_ctx *ctx, FILE *fp)
+{
+	struct xdb_kv_stats st;
+
+	xdb_kv_stats(ctx->xdb, &st);
+
+	fprintf(fp, "# TYPE xattrfs_kv_keys gauge\n"
+		    "xattrfs_kv_keys %llu\n"
+		    "# TYPE xattrfs_kv_log_bytes gauge\n"
+		    "xattrfs_kv_log_bytes %llu\n"
+		    "# TYPE xattrfs_kv_dead_bytes gauge\n"
+		    "xattrfs_kv_dead_bytes %llu\n"
+		    "# TYPE xattrfs_kv_compactions_total counter\n"
+		    "xattrfs_kv_compactions_total %llu\n",
+		    _llu(st.keys), _llu(st.log_bytes), _llu(st.dead_bytes),
+		    _llu(st.compactions));
+}
+
+static int show_stats(struct xattrfs_ctx *ctx, FILE *fp)
+{
+	struct xdb_cache_stats cs;
+	uint64_t rounds, purged;
+
+	if (ctx->gc) {
+		xattrfs_gc_stats(ctx->gc, &rounds, &purged);
+
+		fprintf(fp, "# TYPE xattrfs_gc_rounds_total counter\n"
+			    "xattrfs_gc_rounds_total %llu\n"
+			    "# TYPE xattrfs_gc_purged_total counter\n"
+			    "xattrfs_gc_purged_total %llu\n",
+			    _llu(rounds), _llu(purged));
+	}
+
+	if (ctx->xdb->kv)
+		show_kv(ctx, fp);
+	else
+		show_sqlite(ctx, fp);
+
+	if (!ctx->xdb->cache)
+		return xattrfs_metrics_show(fp);
+
+	xdb_cache_stats(ctx->xdb->cache, &cs);
+
+	fprintf(fp, "# TYPE xattrfs_cache_hits_total counter\n"
+		    "xattrfs_cache_hits_total{result=\"value\"} %llu\n"
+		    "xattrfs_cache_hits_total{result=\"noattr\"} %llu\n"
+		    "# TYPE xattrfs_cache_misses_total counter\n"
+		    "xattrfs_cache_misses_total %llu\n"
+		    "# TYPE xattrfs_cache_evictions_total counter\n"
+		    "xattrfs_cache_evictions_total %llu\n"
+		    "# TYPE xattrfs_cache_entries gauge\n"
+		    "xattrfs_cache_entries %llu\n"
+		    "# TYPE xattrfs_cache_bytes gauge\n"
+		    "xattrfs_cache_bytes %llu\n"
+		    "# TYPE xattrfs_cache_limit_bytes gauge\n"
+		    "xattrfs_cache_limit_bytes %llu\n",
+		    _llu(cs.hits), _llu(cs.neg_hits), _llu(cs.misses),
+		    _llu(cs.evictions), _llu(cs.entries), _llu(cs.bytes),
+		    _llu(cs.limit));
+
+	return xattrfs_metrics_show(fp);
+}
+
+/* the operation metrics start over, the other counters are kept */
+static int reset_stats(struct xattrfs_ctx *ctx)
+{
+	xattrfs_metrics_reset();
+	return 0;
+}
+
+/* a control file is either read (@show) or written (@store) */
+static const struct ctl_file {
+	const char *name;
+	int (*show) (struct xattrfs_ctx *ctx, FILE *fp);
+	int (*store) (struct xattrfs_ctx *ctx);
+} ctl_files[] = {
+	{ "stats",	show_stats,	NULL },
+	{ "reset",	NULL,		reset_stats },
+};
+
+#define N_CTL_FILES	(sizeof(ctl_files) / sizeof(ctl_files[0]))
+
+/* returns -1 for the directory itself, or the index in ctl_files[] */
+static int lookup(const char *path, int *index)
+{
+	unsigned int i;
+
+	path += strlen(XATTRFS_CTL_DIR);
+	if (path[0] == '\0') {
+		*index = -1;
+		return 0;
+	}
+
+	for (i = 0; i < N_CTL_FILES; i++) {
+		if (0 == strcmp(&path[1], ctl_files[i].name)) {
+			*index = i;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * the query directory
+ */
+
+struct query {
+	char name[XATTR_NAME_MAX + 1];
+	char *value;			/* NULL for any value */
+	size_t len;
+	int prefix;
+	char buf[XATTR_SIZE_MAX];	/* the decoded query */
+};
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* decodes %XX escapes of @len bytes of @src, returns the decoded length */
+static ssize_t unescape(const char *src, size_t len, char *dst, size_t size)
+{
+	size_t i, n = 0;
+	int hi, lo;
+
+	for (i = 0; i < len; i++) {
+		if (n == size)
+			return -ENAMETOOLONG;
+
+		if (src[i] != '%') {
+			dst[n++] = src[i];
+			continue;
+		}
+
+		if (i + 2 >= len)
+			return -ENOENT;
+
+		hi = hexval(src[i + 1]);
+		lo = hexval(src[i + 2]);
+		if (hi < 0 || lo < 0)
+			return -ENOENT;
+
+		dst[n++] = hi << 4 | lo;
+		i += 2;
+	}
+
+	return n;
+}
+
+/* a directory entry for @path: '%' and '/' are escaped */
+static int escape(const char *path, char *name, size_t size)
+{
+	size_t n = 0;
+
+	for ( ; *path; path++) {
+		if (n + 4 > size)
+			return -ENAMETOOLONG;
+
+		if (*path == '%' || *path == '/')
+			n += sprintf(&name[n], "%%%02X", *path);
+		else
+			name[n++] = *path;
+	}
+
+	name[n] = '\0';
+
+	return 0;
+}
+
+/* <name>, <name>=<value> or <name>=<value>* */
+static int parse_query(const char *str, size_t len, struct query *q)
+{
+	ssize_t n;
+	const char *eq = memchr(str, '=', len);
+
+	n = unescape(str, eq ? (size_t) (eq - str) : len, q->name,
+		     sizeof(q->name) - 1);
+	if (n <= 0)
+		return -ENOENT;
+
+	q->name[n] = '\0';
+	if (memchr(q->name, '\0', n))
+		return -ENOENT;
+
+	q->value = NULL;
+	q->len = 0;
+	q->prefix = 0;
+
+	if (!eq)
+		return 0;
+
+	len -= eq - str + 1;
+	if (len && eq[len] == '*') {
+		q->prefix = 1;
+		len--;
+	}
+
+	n = unescape(eq + 1, len, q->buf, sizeof(q->buf));
+	if (n < 0)
+		return -ENOENT;
+
+	q->value = q->buf;
+	q->len = n;
+
+	return 0;
+}
+
+/**
+ * splits a path below QUERY_DIR: the query (or NULL for QUERY_DIR itself)
+ * and the entry in its directory (or NULL). returns -ENOENT for deeper paths.
+ */
+static int query_lookup(const char *path, struct query *q, const char **entry)
+{
+	const char *end;
+
+	*entry = NULL;
+
+	path += strlen(QUERY_DIR);
+	if (path[0] == '\0')
+		return 1;
+
+	end = strchr(++path, '/');
+	if (end) {
+		*entry = end + 1;
+		if (**entry == '\0' || strchr(*entry, '/'))
+			return -ENOENT;
+	}
+
+	return parse_query(path, end ? (size_t) (end - path) : strlen(path), q);
+}
+
+static inline int is_query(struct xattrfs_ctx *ctx, const char *path)
+{
+	size_t len = sizeof(QUERY_DIR) - 1;
+
+	return ctx->query && 0 == strncmp(path, QUERY_DIR, len) &&
+		(path[len] == '\0' || path[len] == '/');
+}
+
+/* query nodes take the free inode numbers of the control namespace */
+static ino_t query_ino(const char *path)
+{
+	unsigned long hash = 5381;
+	unsigned long first = N_CTL_FILES + 2;
+
+	if (0 == strcmp(path, QUERY_DIR))
+		return XATTRFS_CTL_INO(first - 1);
+
+	while (*path)
+		hash = hash * 33 + (unsigned char) *path++;
+
+	return XATTRFS_CTL_INO(first + hash % (XATTRFS_CTL_NODES - first));
+}
+
+/* whether the file @ino matches @q, its value may have changed */
+static int query_match(struct xattrfs_ctx *ctx, ino_t ino, struct query *q)
+{
+	int ret;
+	char *value;
+
+	ret = xdb_getxattr(ctx->xdb, ino, q->name, NULL, 0);
+	if (ret < 0 || !q->value)
+		return ret >= 0;
+
+	if ((size_t) ret < q->len || (!q->prefix && (size_t) ret != q->len))
+		return 0;
+
+	value = malloc(ret ? ret : 1);
+	if (!value)
+		return 0;
+
+	ret = xdb_getxattr(ctx->xdb, ino, q->name, value, ret);
+	ret = ret >= 0 && (size_t) ret >= q->len &&
+	      0 == memcmp(value, q->value, q->len);
+
+	free(value);
+
+	return ret;
+}
+
+/**
+ * the path of @ino relative to the base directory, from the reverse index.
+ * names that no longer lead to @ino (changed outside of the mount) are not
+ * trusted.
+ */
+static int resolve(struct xattrfs_ctx *ctx, ino_t ino, ino_t root,
+			char *path, size_t size)
+{
+	int ret, depth;
+	size_t len, pos = size - 1;
+	ino_t cur = ino;
+	char name[NAME_MAX + 1];
+	char buf[PATH_MAX];
+	struct stat sb;
+
+	path[pos] = '\0';
+
+	for (depth = 0; cur != root; depth++) {
+		if (depth == QUERY_DEPTH)
+			return -ELOOP;
+
+		ret = xdb_dentry_lookup(ctx->xdb, cur, &cur, name, sizeof(name));
+		if (ret)
+			return ret;
+
+		len = strlen(name) + (depth ? 1 : 0);
+		if (len > pos)
+			return -ENAMETOOLONG;
+
+		if (depth)
+			path[--pos] = '/';
+
+		pos -= strlen(name);
+		memcpy(&path[pos], name, strlen(name));
+	}
+
+	memmove(path, &path[pos], size - pos);
+
+	snprintf(buf, sizeof(buf), "%s%s", ctx->fsroot, path);
+	if (lstat(buf, &sb) || sb.st_ino != ino)
+		return -ENOENT;
+
+	return 0;
+}
+
+/* the file an entry links to, if it still matches the query */
+static int query_entry(struct xattrfs_ctx *ctx, struct query *q,
+			const char *entry, char *path, struct stat *sb)
+{
+	ssize_t n;
+	char *c;
+	char buf[PATH_MAX];
+
+	n = unescape(entry, strlen(entry), path, PATH_MAX - 1);
+	if (n <= 0)
+		return -ENOENT;
+
+	path[n] = '\0';
+	if (memchr(path, '\0', n))
+		return -ENOENT;
+
+	/* only the files below the base directory */
+	for (c = path; c; c = strchr(c, '/')) {
+		if (*c == '/')
+			c++;
+		if (0 == strncmp(c, "..", 2) && (c[2] == '/' || c[2] == '\0'))
+			return -ENOENT;
+	}
+
+	snprintf(buf, sizeof(buf), "%s%s", ctx->fsroot, path);
+	if (lstat(buf, sb))
+		return -ENOENT;
+
+	return query_match(ctx, sb->st_ino, q) ? 0 : -ENOENT;
+}
+
+static int query_getattr(struct xattrfs_ctx *ctx, const char *path,
+			struct stat *stbuf)
+{
+	int ret;
+	const char *entry;
+	char buf[PATH_MAX];
+	struct stat sb;
+	struct query *q = malloc(sizeof(*q));
+
+	if (!q)
+		return -ENOMEM;
+
+	ret = query_lookup(path, q, &entry);
+	if (ret < 0)
+		goto out;
+
+	stbuf->st_ino = query_ino(path);
+
+	if (entry) {
+		ret = query_entry(ctx, q, entry, buf, &sb);
+		if (ret)
+			goto out;
+
+		stbuf->st_mode = S_IFLNK | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = strlen(buf) + 9;	/* "../../../" */
+	}
+	else {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	}
+
+	ret = 0;
+out:
+	free(q);
+	return ret;
+}
+
+static int query_readdir(struct xattrfs_ctx *ctx, const char *path,
+			void *buf, fuse_fill_dir_t filler)
+{
+	int i, n;
+	int ret = 0;
+	const char *entry;
+	ino_t *inos = NULL;
+	char rel[PATH_MAX];
+	char name[NAME_MAX + 1];
+	struct stat root;
+	struct query *q = malloc(sizeof(*q));
+
+	if (!q)
+		return -ENOMEM;
+
+	ret = query_lookup(path, q, &entry);
+	if (ret < 0 || entry) {
+		ret = ret < 0 ? ret : -ENOTDIR;
+		goto out;
+	}
+
+	if (filler(buf, ".", NULL, 0) || filler(buf, "..", NULL, 0)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* queries are not listed, only looked up */
+	ret = 0;
+	if (0 == strcmp(path, QUERY_DIR))
+		goto out;
+
+	if (lstat(ctx->fsroot, &root)) {
+		ret = -errno;
+		goto out;
+	}
+
+	n = xdb_query(ctx->xdb, q->name, q->value, q->len, q->prefix, &inos);
+	if (n < 0) {
+		ret = n;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (resolve(ctx, inos[i], root.st_ino, rel, sizeof(rel)) ||
+		    escape(rel, name, sizeof(name)))
+			continue;	/* not indexed, or gone */
+
+		if (filler(buf, name, NULL, 0)) {
+			ret = -ENOMEM;
+			break;
+		}
+	}
+
+out:
+	free(inos);
+	free(q);
+	return ret;
+}
+
+/* the entry is relative to its directory, QUERY_DIR/<query> */
+int xattrfs_ctl_readlink(struct xattrfs_ctx *ctx, const char *path,
+			char *link, size_t size)
+{
+	int ret;
+	const char *entry;
+	char buf[PATH_MAX];
+	struct stat sb;
+	struct query *q;
+
+	if (!is_query(ctx, path))
+		return -EINVAL;
+
+	q = malloc(sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+
+	ret = query_lookup(path, q, &entry);
+	if (ret >= 0 && !entry)
+		ret = -EINVAL;
+	if (ret >= 0)
+		ret = query_entry(ctx, q, entry, buf, &sb);
+
+	free(q);
+
+	if (ret)
+		return ret;
+
+	snprintf(link, size, "../../../%s", buf);
+
+	return 0;
+}
+
+int xattrfs_ctl_getattr(struct xattrfs_ctx *ctx, const char *path,
+			struct stat *stbuf)
+{
+	int index;
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+
+	if (is_query(ctx, path))
+		return query_getattr(ctx, path, stbuf);
+
+	if (lookup(path, &index))
+		return -ENOENT;
+
+	if (index < 0) {
+		stbuf->st_ino = XATTRFS_CTL_INO(0);
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	}
+	else {
+		stbuf->st_ino = XATTRFS_CTL_INO(index + 1);
+		stbuf->st_mode = S_IFREG | (ctl_files[index].show ? 0444 : 0) |
+				 (ctl_files[index].store ? 0200 : 0);
+		stbuf->st_nlink = 1;
+	}
+
+	return 0;
+}
+
+int xattrfs_ctl_access(struct xattrfs_ctx *ctx, const char *path, int mask)
+{
+	int index;
+	struct stat sb;
+
+	if (is_query(ctx, path)) {
+		if (query_getattr(ctx, path, &sb))
+			return -ENOENT;
+	}
+	else if (lookup(path, &index))
+		return -ENOENT;
+	else if (index >= 0) {
+		if ((mask & W_OK) && !ctl_files[index].store)
+			return -EACCES;
+		if ((mask & R_OK) && !ctl_files[index].show)
+			return -EACCES;
+		return mask & X_OK ? -EACCES : 0;
+	}
+
+	return mask & W_OK ? -EACCES : 0;
+}
+
+int xattrfs_ctl_readdir(struct xattrfs_ctx *ctx, const char *path,
+			void *buf, fuse_fill_dir_t filler)
+{
+	unsigned int i;
+	int index;
+
+	if (is_query(ctx, path))
+		return query_readdir(ctx, path, buf, filler);
+
+	if (lookup(path, &index) || index >= 0)
+		return -ENOTDIR;
+
+	if (filler(buf, ".", NULL, 0) || filler(buf, "..", NULL, 0))
+		return -ENOMEM;
+
+	for (i = 0; i < N_CTL_FILES; i++)
+		if (filler(buf, ctl_files[i].name, NULL, 0))
+			return -ENOMEM;
+
+	if (ctx->query && filler(buf, &QUERY_DIR[sizeof(XATTRFS_CTL_DIR)],
+				 NULL, 0))
+		return -ENOMEM;
+
+	return 0;
+}
+
+int xattrfs_ctl_open(struct xattrfs_ctx *ctx, const char *path,
+			struct fuse_file_info *fi)
+{
+	int ret = 0;
+	int index;
+	FILE *fp;
+	struct ctl_buf *cb;
+	struct stat sb;
+
+	if (is_query(ctx, path)) {
+		ret = query_getattr(ctx, path, &sb);
+		return ret ? ret : S_ISDIR(sb.st_mode) ? -EISDIR : -ELOOP;
+	}
+
+	if (lookup(path, &index))
+		return -ENOENT;
+	if (index < 0)
+		return -EISDIR;
+
+	switch (fi->flags & O_ACCMODE) {
+	case O_RDONLY:
+		if (!ctl_files[index].show)
+			return -EACCES;
+		break;
+	case O_WRONLY:
+		if (!ctl_files[index].store)
+			return -EACCES;
+		break;
+	default:
+		return -EACCES;
+	}
+
+	cb = calloc(1, sizeof(*cb));
+	if (!cb)
+		return -ENOMEM;
+
+	cb->index = index;
+	fi->direct_io = 1;
+
+	if (!ctl_files[index].show) {
+		fi->fh = (uintptr_t) cb;
+		return 0;
+	}
+
+	fp = open_memstream(&cb->data, &cb->len);
+	if (!fp) {
+		free(cb);
+		return -ENOMEM;
+	}
+
+	ret = ctl_files[index].show(ctx, fp);
+	fclose(fp);
+
+	if (ret) {
+		free(cb->data);
+		free(cb);
+		return ret;
+	}
+
+	fi->fh = (uintptr_t) cb;
+
+	return 0;
+}
+
+int xattrfs_ctl_read(const char *path, char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	struct ctl_buf *cb = (struct ctl_buf *) (uintptr_t) fi->fh;
+
+	if (offset >= cb->len)
+		return 0;
+
+	if (size > cb->len - offset)
+		size = cb->len - offset;
+
+	memcpy(buf, &cb->data[offset], size);
+
+	return size;
+}
+
+int xattrfs_ctl_write(struct xattrfs_ctx *ctx, size_t size,
+			struct fuse_file_info *fi)
+{
+	int ret;
+	struct ctl_buf *cb = (struct ctl_buf *) (uintptr_t) fi->fh;
+
+	ret = ctl_files[cb->index].store(ctx);
+
+	return ret ? ret : (int) size;
+}
+
+/* for O_TRUNC, which comes before the writes */
+int xattrfs_ctl_truncate(struct xattrfs_ctx *ctx, const char *path)
+{
+	int index;
+
+	if (is_query(ctx, path) || lookup(path, &index))
+		return -ENOENT;
+	if (index < 0)
+		return -EISDIR;
+
+	return ctl_files[index].store ? 0 : -EACCES;
+}
+
+int xattrfs_ctl_release(const char *path, struct fuse_file_info *fi)
+{
+	struct ctl_buf *cb = (struct ctl_buf *) (uintptr_t) fi->fh;
+
+	free(cb->data);
+	free(cb);
+
+	return 0;
+}
+
+/* the path of a control node, for the low-level api which has only inodes */
+int xattrfs_ctl_path(ino_t ino, char *buf, size_t size)
+{
+	unsigned long n = XATTRFS_CTL_INO(0) - ino;
+
+	if (n == 0)
+		snprintf(buf, size, "%s", XATTRFS_CTL_DIR);
+	else if (n <= N_CTL_FILES)
+		snprintf(buf, size, "%s/%s", XATTRFS_CTL_DIR,
+			 ctl_files[n - 1].name);
+	else
+		return -ENOENT;
+
+	return 0;
+}
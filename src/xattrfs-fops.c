@@ -35,6 +35,104 @@ char *fullpath(struct xattrfs_ctx *ctx, const char *path, char *buf)
 	return buf;
 }
 
+/* inode number of the base file, from the path cache if possible */
+static int get_ino(struct xattrfs_ctx *ctx, const char *path, ino_t *ino)
+{
+	int ret = 0;
+	uint64_t seq = 0;
+	char buf[PATH_MAX];
+	struct stat sb;
+
+	if (ctx->pcache && xattrfs_pcache_lookup(ctx->pcache, path, ino, &seq))
+		return 0;
+
+	ret = lstat(fullpath(ctx, path, buf), &sb);
+	if (ret)
+		return -errno;
+
+	if (ctx->pcache)
+		xattrfs_pcache_insert(ctx->pcache, path, sb.st_ino, seq);
+
+	*ino = sb.st_ino;
+
+	return 0;
+}
+
+static inline void invalidate_path(struct xattrfs_ctx *ctx, const char *path)
+{
+	if (ctx->pcache)
+		xattrfs_pcache_invalidate(ctx->pcache, path);
+}
+
+/**
+ * the reverse index of the names (-o query), kept up to date by the namespace
+ * operations. it only helps the query directory find the matches, which are
+ * checked against the base directory, so failures are not reported.
+ */
+
+static int split_path(struct xattrfs_ctx *ctx, const char *path,
+			ino_t *parent, const char **name)
+{
+	char dir[PATH_MAX];
+	const char *last = strrchr(path, '/');
+
+	if (!last || last[1] == '\0')
+		return -EINVAL;
+
+	memcpy(dir, path, last - path);
+	strcpy(&dir[last - path], last == path ? "/" : "");
+	*name = last + 1;
+
+	return get_ino(ctx, dir, parent);
+}
+
+static void index_add(struct xattrfs_ctx *ctx, const char *path)
+{
+	ino_t ino, parent;
+	const char *name;
+
+	if (!ctx->query || split_path(ctx, path, &parent, &name) ||
+	    get_ino(ctx, path, &ino))
+		return;
+
+	xdb_dentry_add(ctx->xdb, parent, name, ino);
+}
+
+static void index_remove(struct xattrfs_ctx *ctx, const char *path)
+{
+	ino_t parent;
+	const char *name;
+
+	if (!ctx->query || split_path(ctx, path, &parent, &name))
+		return;
+
+	xdb_dentry_remove(ctx->xdb, parent, name);
+}
+
+/* the files created before the index are added when they get an xattr */
+static void index_path(struct xattrfs_ctx *ctx, const char *path, ino_t ino)
+{
+	ino_t parent;
+	char name[NAME_MAX + 1];
+	char buf[PATH_MAX];
+	char *last;
+
+	if (!ctx->query)
+		return;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+
+	while (buf[1] != '\0' &&
+	       xdb_dentry_lookup(ctx->xdb, ino, &parent, name, sizeof(name))) {
+		index_add(ctx, buf);
+
+		last = strrchr(buf, '/');
+		last[last == buf ? 1 : 0] = '\0';
+		if (get_ino(ctx, buf, &ino))
+			return;
+	}
+}
+
 /**
  * FUSE operations: every function should return negated errno (-errno) instead
  * of -1, on error.
@@ -43,12 +141,24 @@ char *fullpath(struct xattrfs_ctx *ctx, const char *path, char *buf)
 static int xattrfs_getattr(const char *path, struct stat *stbuf)
 {
 	int ret = 0;
+	uint64_t seq = 0;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
 
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_getattr(ctx, path, stbuf);
+
+	if (ctx->pcache)
+		seq = xattrfs_pcache_seq(ctx->pcache, path);
+
 	ret = lstat(fullpath(ctx, path, buf), stbuf);
+	if (ret < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	if (ctx->pcache)
+		xattrfs_pcache_insert(ctx->pcache, path, stbuf->st_ino, seq);
+
+	return ret;
 }
 
 /* the link should be null-terminated. on success, should return 0 */
@@ -58,6 +168,9 @@ static int xattrfs_readlink(const char *path, char *link, size_t size)
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
 
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_readlink(ctx, path, link, size);
+
 	ret = readlink(fullpath(ctx, path, buf), link, size);
 
 	return ret < 0 ? -errno : 0;
@@ -71,8 +184,13 @@ static int xattrfs_mknod(const char *path, mode_t mode, dev_t dev)
 	char buf[PATH_MAX];
 
 	ret = mknod(fullpath(ctx, path, buf), mode, dev);
+	if (ret < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	invalidate_path(ctx, path);
+	index_add(ctx, path);
+
+	return ret;
 }
 
 static int xattrfs_mkdir(const char *path, mode_t mode)
@@ -82,8 +200,13 @@ static int xattrfs_mkdir(const char *path, mode_t mode)
 	char buf[PATH_MAX];
 
 	ret = mkdir(fullpath(ctx, path, buf), mode);
+	if (ret < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	invalidate_path(ctx, path);
+	index_add(ctx, path);
+
+	return ret;
 }
 
 static int xattrfs_unlink(const char *path)
@@ -91,10 +214,20 @@ static int xattrfs_unlink(const char *path)
 	int ret = 0;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
+	struct stat sb;
 
-	ret = unlink(fullpath(ctx, path, buf));
+	if (lstat(fullpath(ctx, path, buf), &sb) < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	ret = unlink(buf);
+	if (ret < 0)
+		return -errno;
+
+	invalidate_path(ctx, path);
+	index_remove(ctx, path);
+	xattrfs_purge_unlinked(ctx, &sb);
+
+	return ret;
 }
 
 static int xattrfs_rmdir(const char *path)
@@ -102,10 +235,20 @@ static int xattrfs_rmdir(const char *path)
 	int ret = 0;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
+	struct stat sb;
+
+	if (lstat(fullpath(ctx, path, buf), &sb) < 0)
+		return -errno;
 
-	ret = rmdir(fullpath(ctx, path, buf));
+	ret = rmdir(buf);
+	if (ret < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	invalidate_path(ctx, path);
+	index_remove(ctx, path);
+	xattrfs_purge_unlinked(ctx, &sb);
+
+	return ret;
 }
 
 static int xattrfs_symlink(const char *path, const char *link)
@@ -115,8 +258,13 @@ static int xattrfs_symlink(const char *path, const char *link)
 	char buf[PATH_MAX];
 
 	ret = symlink(path, fullpath(ctx, link, buf));
+	if (ret < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	invalidate_path(ctx, link);
+	index_add(ctx, link);
+
+	return ret;
 }
 
 static int xattrfs_rename(const char *old, const char *new)
@@ -125,11 +273,39 @@ static int xattrfs_rename(const char *old, const char *new)
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char oldpath[PATH_MAX];
 	char newpath[PATH_MAX];
+	struct stat sb, target;
+	int replaced;
 
-	ret = rename(fullpath(ctx, old, oldpath),
-		     fullpath(ctx, new, newpath));
+	if (lstat(fullpath(ctx, old, oldpath), &sb) < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	replaced = 0 == lstat(fullpath(ctx, new, newpath), &target) &&
+		   target.st_ino != sb.st_ino;
+
+	xattrfs_touch(ctx, sb.st_ino);
+
+	ret = rename(oldpath, newpath);
+	if (ret < 0)
+		return -errno;
+
+	if (replaced)
+		xattrfs_purge_unlinked(ctx, &target);
+
+	if (ctx->pcache) {
+		/* every path below a renamed directory has moved */
+		if (S_ISDIR(sb.st_mode))
+			xattrfs_pcache_invalidate_all(ctx->pcache);
+		else {
+			xattrfs_pcache_invalidate(ctx->pcache, old);
+			xattrfs_pcache_invalidate(ctx->pcache, new);
+		}
+	}
+
+	/* a replaced name points to the renamed inode now */
+	index_remove(ctx, old);
+	index_add(ctx, new);
+
+	return ret;
 }
 
 static int xattrfs_link(const char *path, const char *new)
@@ -138,11 +314,20 @@ static int xattrfs_link(const char *path, const char *new)
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char oldpath[PATH_MAX];
 	char newpath[PATH_MAX];
+	struct stat sb;
 
 	ret = link(fullpath(ctx, path, oldpath),
 		   fullpath(ctx, new, newpath));
+	if (ret < 0)
+		return -errno;
 
-	return ret < 0 ? -errno : ret;
+	invalidate_path(ctx, new);
+	index_add(ctx, new);
+
+	if (ctx->gc && 0 == lstat(newpath, &sb))
+		xattrfs_gc_touch(ctx->gc, sb.st_ino);
+
+	return ret;
 }
 
 static int xattrfs_chmod(const char *path, mode_t mode)
@@ -173,6 +358,9 @@ static int xattrfs_truncate(const char *path, off_t newsize)
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
 
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_truncate(ctx, path);
+
 	ret = truncate(fullpath(ctx, path, buf), newsize);
 
 	return ret < 0 ? -errno : ret;
@@ -195,6 +383,9 @@ static int xattrfs_open(const char *path, struct fuse_file_info *fi)
 	char buf[PATH_MAX];
 	int fd;
 
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_open(ctx, path, fi);
+
 	fd = open(fullpath(ctx, path, buf), fi->flags);
 	if (fd > 0) {
 		fi->fh = fd;
@@ -207,15 +398,77 @@ static int xattrfs_open(const char *path, struct fuse_file_info *fi)
 static int xattrfs_read(const char *path, char *buf, size_t size,
 			off_t offset, struct fuse_file_info *fi)
 {
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_read(path, buf, size, offset, fi);
+
 	return pread(fi->fh, buf, size, offset);
 }
 
 static int xattrfs_write(const char *path, const char *buf, size_t size,
 			off_t offset, struct fuse_file_info *fi)
 {
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_write(get_xattrfs_ctx, size, fi);
+
 	return pwrite(fi->fh, buf, size, offset);
 }
 
+#ifdef FUSE_CAP_SPLICE_READ
+/**
+ * the data is not copied here: read_buf hands the backing file to fuse, which
+ * splices from it into the device when the kernel allows (-o splice), and
+ * write_buf splices the request pages into the backing file the same way.
+ */
+
+static int xattrfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	int ret = 0;
+	struct fuse_bufvec *src = malloc(sizeof(*src));
+
+	if (!src)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+
+	if (xattrfs_is_ctl(path)) {
+		src->buf[0].mem = malloc(size ? size : 1);
+		if (!src->buf[0].mem) {
+			free(src);
+			return -ENOMEM;
+		}
+
+		ret = xattrfs_ctl_read(path, src->buf[0].mem, size, offset, fi);
+		src->buf[0].size = ret;
+	}
+	else {
+		src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src->buf[0].fd = fi->fh;
+		src->buf[0].pos = offset;
+	}
+
+	*bufp = src;
+
+	return 0;
+}
+
+static int xattrfs_write_buf(const char *path, struct fuse_bufvec *buf,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_write(get_xattrfs_ctx, fuse_buf_size(buf),
+					 fi);
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+#endif
+
 static int xattrfs_statfs(const char *path, struct statvfs *vfs)
 {
 	int ret = 0;
@@ -236,6 +489,9 @@ static int xattrfs_flush(const char *path, struct fuse_file_info *fi)
 static int xattrfs_release(const char *path, struct fuse_file_info *fi)
 {
 	/** no more references to the file handle. */
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_release(path, fi);
+
 	return close(fi->fh);
 }
 
@@ -264,13 +520,20 @@ static int xattrfs_setxattr(const char *path, const char *name,
 	int ret = 0;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
-	struct stat sb;
+	ino_t ino;
 
-	ret = stat(fullpath(ctx, path, buf), &sb);
+	ret = get_ino(ctx, path, &ino);
 	if (ret)
-		return -errno;
+		return ret;
+
+	xattrfs_touch(ctx, ino);
+	index_path(ctx, path, ino);
+
+	if (ctx->tiered)
+		return xattrfs_tier_setxattr(ctx, fullpath(ctx, path, buf), 0,
+					     ino, name, value, size, flags);
 
-	return xdb_setxattr(ctx->xdb, sb.st_ino, name, value, size, flags);
+	return xdb_setxattr(ctx->xdb, ino, name, value, size, flags);
 }
 
 static int xattrfs_getxattr(const char *path, const char *name,
@@ -279,13 +542,17 @@ static int xattrfs_getxattr(const char *path, const char *name,
 	int ret = 0;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
-	struct stat sb;
+	ino_t ino;
 
-	ret = stat(fullpath(ctx, path, buf), &sb);
+	ret = get_ino(ctx, path, &ino);
 	if (ret)
-		return -errno;
+		return ret;
+
+	if (ctx->tiered)
+		return xattrfs_tier_getxattr(ctx, fullpath(ctx, path, buf), 0,
+					     ino, name, value, size);
 
-	return xdb_getxattr(ctx->xdb, sb.st_ino, name, value, size);
+	return xdb_getxattr(ctx->xdb, ino, name, value, size);
 }
 
 static int xattrfs_listxattr(const char *path, char *list, size_t size)
@@ -293,13 +560,17 @@ static int xattrfs_listxattr(const char *path, char *list, size_t size)
 	int ret = 0;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
-	struct stat sb;
+	ino_t ino;
 
-	ret = stat(fullpath(ctx, path, buf), &sb);
+	ret = get_ino(ctx, path, &ino);
 	if (ret)
-		return -errno;
+		return ret;
 
-	return xdb_listxattr(ctx->xdb, sb.st_ino, list, size);
+	if (ctx->tiered)
+		return xattrfs_tier_listxattr(ctx, fullpath(ctx, path, buf), 0,
+					      ino, list, size);
+
+	return xdb_listxattr(ctx->xdb, ino, list, size);
 }
 
 static int xattrfs_removexattr(const char *path, const char *name)
@@ -307,30 +578,53 @@ static int xattrfs_removexattr(const char *path, const char *name)
 	int ret = 0;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
-	struct stat sb;
+	ino_t ino;
 
-	ret = stat(fullpath(ctx, path, buf), &sb);
+	ret = get_ino(ctx, path, &ino);
 	if (ret)
-		return -errno;
+		return ret;
 
-	return xdb_removexattr(ctx->xdb, sb.st_ino, name);
+	if (ctx->tiered)
+		return xattrfs_tier_removexattr(ctx, fullpath(ctx, path, buf),
+						0, ino, name);
+
+	return xdb_removexattr(ctx->xdb, ino, name);
 }
 
 /**
- * our implementation of readdir is stateless.
+ * readdir passes the telldir() position of each entry to the filler, so a
+ * large directory is listed in several calls, each resuming (with seekdir())
+ * where the last one stopped.
  */
 
+struct xattrfs_dirp {
+	DIR *dp;
+	struct dirent *entry;		/* read but not filled yet */
+	off_t offset;
+};
+
 static int xattrfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	DIR *dp;
+	struct xattrfs_dirp *d;
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
 
-	dp = opendir(fullpath(ctx, path, buf));
-	if (!dp)
+	if (xattrfs_is_ctl(path)) {
+		fi->fh = 0;
+		return 0;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+
+	d->dp = opendir(fullpath(ctx, path, buf));
+	if (!d->dp) {
+		free(d);
 		return -errno;
+	}
 
-	fi->fh = (intptr_t) dp;
+	fi->fh = (uintptr_t) d;
 
 	return 0;
 }
@@ -338,24 +632,48 @@ static int xattrfs_opendir(const char *path, struct fuse_file_info *fi)
 static int xattrfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			off_t offset, struct fuse_file_info *fi)
 {
-	struct dirent *de;
-	DIR *dp = (DIR *) (uintptr_t) fi->fh;
+	off_t next;
+	struct stat st;
+	struct xattrfs_dirp *d = (struct xattrfs_dirp *) (uintptr_t) fi->fh;
 
-	de = readdir(dp);
-	if (!de)
-		return -errno;
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_readdir(get_xattrfs_ctx, path, buf, filler);
 
-	do {
-		if (filler(buf, de->d_name, NULL, 0))
-			return -ENOMEM;
-	} while ((de = readdir(dp)) != NULL);
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
 
-	return 0;
+	for (;;) {
+		if (!d->entry) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (!d->entry)
+				return -errno;
+		}
+
+		xattrfs_dirent_stat(d->dp, d->entry, &st);
+		next = telldir(d->dp);
+
+		if (filler(buf, d->entry->d_name, &st, next))
+			return 0;	/* full, the entry waits for the next call */
+
+		d->entry = NULL;
+		d->offset = next;
+	}
 }
 
 static int xattrfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
-	closedir((DIR *) (uintptr_t) fi->fh);
+	struct xattrfs_dirp *d = (struct xattrfs_dirp *) (uintptr_t) fi->fh;
+
+	if (xattrfs_is_ctl(path))
+		return 0;
+
+	closedir(d->dp);
+	free(d);
+
 	return 0;
 }
 
@@ -379,12 +697,36 @@ static void *xattrfs_init(struct fuse_conn_info *conn)
 					fuse_get_context()->private_data;
 	struct xdb *xdb;
 
-	ret = xdb_init(&xdb, ctx->fsroot);
-	if (ret)
-		return NULL;
+	xattrfs_want_splice(ctx, conn);
+
+	ret = xdb_init(&xdb, ctx->fsroot, &ctx->xdbcfg);
+	if (ret) {
+		fprintf(stderr, "xattrfs: failed to open the xattr database "
+				"(%d)\n", ret);
+		goto out_exit;
+	}
 
 	ctx->xdb = xdb;
 
+	if (ctx->pcache_size &&
+	    xattrfs_pcache_init(&ctx->pcache, ctx->pcache_size,
+				ctx->pcache_ttl)) {
+		fputs("xattrfs: failed to create the path cache\n", stderr);
+		goto out_exit;
+	}
+
+	if (ctx->gc_interval &&
+	    xattrfs_gc_init(&ctx->gc, ctx, ctx->gc_interval, ctx->gc_batch)) {
+		fputs("xattrfs: failed to start the garbage collector\n",
+		      stderr);
+		goto out_exit;
+	}
+
+	return ctx;
+
+out_exit:
+	/* not NULL, which every operation would get; destroy cleans up */
+	fuse_exit(fuse_get_context()->fuse);
 	return ctx;
 }
 
@@ -392,6 +734,10 @@ static void xattrfs_destroy(void *context)
 {
 	struct xattrfs_ctx *ctx = (struct xattrfs_ctx *) context;
 
+	if (ctx->gc)
+		xattrfs_gc_exit(ctx->gc);
+	if (ctx->pcache)
+		xattrfs_pcache_exit(ctx->pcache);
 	if (ctx->xdb)
 		xdb_exit(ctx->xdb);
 	if (ctx->fsroot)
@@ -403,18 +749,27 @@ static int xattrfs_access(const char *path, int mask)
 	struct xattrfs_ctx *ctx = get_xattrfs_ctx;
 	char buf[PATH_MAX];
 
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_access(ctx, path, mask);
+
 	return access(fullpath(ctx, path, buf), mask);
 }
 
 static int xattrfs_ftruncate(const char *path, off_t newsize,
 				struct fuse_file_info *fi)
 {
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_truncate(get_xattrfs_ctx, path);
+
 	return ftruncate(fi->fh, newsize);
 }
 
 static int xattrfs_fgetattr(const char *path, struct stat *stbuf,
 			struct fuse_file_info *fi)
 {
+	if (xattrfs_is_ctl(path))
+		return xattrfs_ctl_getattr(get_xattrfs_ctx, path, stbuf);
+
 	return fstat(fi->fh, stbuf);
 }
 
@@ -424,45 +779,207 @@ static int xattrfs_utimens(const char *path, const struct timespec tv[2])
 }
 
 
+/**
+ * each operation is timed (see xattrfs-metrics.c) by a wrapper, which is what
+ * goes to fuse.
+ */
+#define METERED(op, name, proto, args)				\
+static int metered_##name proto					\
+{								\
+	uint64_t t = xattrfs_metrics_begin(op);			\
+	int ret = xattrfs_##name args;				\
+								\
+	xattrfs_metrics_end(op, t, ret);			\
+	return ret;						\
+}
+
+METERED(XM_GETATTR, getattr,
+	(const char *path, struct stat *stbuf),
+	(path, stbuf))
+
+METERED(XM_READLINK, readlink,
+	(const char *path, char *link, size_t size),
+	(path, link, size))
+
+METERED(XM_MKNOD, mknod,
+	(const char *path, mode_t mode, dev_t dev),
+	(path, mode, dev))
+
+METERED(XM_MKDIR, mkdir,
+	(const char *path, mode_t mode),
+	(path, mode))
+
+METERED(XM_UNLINK, unlink,
+	(const char *path),
+	(path))
+
+METERED(XM_RMDIR, rmdir,
+	(const char *path),
+	(path))
+
+METERED(XM_SYMLINK, symlink,
+	(const char *path, const char *link),
+	(path, link))
+
+METERED(XM_RENAME, rename,
+	(const char *old, const char *new),
+	(old, new))
+
+METERED(XM_LINK, link,
+	(const char *path, const char *new),
+	(path, new))
+
+METERED(XM_CHMOD, chmod,
+	(const char *path, mode_t mode),
+	(path, mode))
+
+METERED(XM_CHOWN, chown,
+	(const char *path, uid_t uid, gid_t gid),
+	(path, uid, gid))
+
+METERED(XM_TRUNCATE, truncate,
+	(const char *path, off_t newsize),
+	(path, newsize))
+
+METERED(XM_UTIME, utime,
+	(const char *path, struct utimbuf *tbuf),
+	(path, tbuf))
+
+METERED(XM_OPEN, open,
+	(const char *path, struct fuse_file_info *fi),
+	(path, fi))
+
+METERED(XM_READ, read,
+	(const char *path, char *buf, size_t size, off_t offset,
+	 struct fuse_file_info *fi),
+	(path, buf, size, offset, fi))
+
+METERED(XM_WRITE, write,
+	(const char *path, const char *buf, size_t size, off_t offset,
+	 struct fuse_file_info *fi),
+	(path, buf, size, offset, fi))
+
+METERED(XM_STATFS, statfs,
+	(const char *path, struct statvfs *vfs),
+	(path, vfs))
+
+METERED(XM_FLUSH, flush,
+	(const char *path, struct fuse_file_info *fi),
+	(path, fi))
+
+METERED(XM_RELEASE, release,
+	(const char *path, struct fuse_file_info *fi),
+	(path, fi))
+
+METERED(XM_FSYNC, fsync,
+	(const char *path, int datasync, struct fuse_file_info *fi),
+	(path, datasync, fi))
+
+METERED(XM_SETXATTR, setxattr,
+	(const char *path, const char *name, const char *value, size_t size,
+	 int flags),
+	(path, name, value, size, flags))
+
+METERED(XM_GETXATTR, getxattr,
+	(const char *path, const char *name, char *value, size_t size),
+	(path, name, value, size))
+
+METERED(XM_LISTXATTR, listxattr,
+	(const char *path, char *list, size_t size),
+	(path, list, size))
+
+METERED(XM_REMOVEXATTR, removexattr,
+	(const char *path, const char *name),
+	(path, name))
+
+METERED(XM_OPENDIR, opendir,
+	(const char *path, struct fuse_file_info *fi),
+	(path, fi))
+
+METERED(XM_READDIR, readdir,
+	(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+	 struct fuse_file_info *fi),
+	(path, buf, filler, offset, fi))
+
+METERED(XM_RELEASEDIR, releasedir,
+	(const char *path, struct fuse_file_info *fi),
+	(path, fi))
+
+METERED(XM_FSYNCDIR, fsyncdir,
+	(const char *path, int datasync, struct fuse_file_info *fi),
+	(path, datasync, fi))
+
+METERED(XM_ACCESS, access,
+	(const char *path, int mask),
+	(path, mask))
+
+METERED(XM_FTRUNCATE, ftruncate,
+	(const char *path, off_t newsize, struct fuse_file_info *fi),
+	(path, newsize, fi))
+
+METERED(XM_FGETATTR, fgetattr,
+	(const char *path, struct stat *stbuf, struct fuse_file_info *fi),
+	(path, stbuf, fi))
+
+METERED(XM_UTIMENS, utimens,
+	(const char *path, const struct timespec tv[2]),
+	(path, tv))
+
+#ifdef FUSE_CAP_SPLICE_READ
+METERED(XM_READ_BUF, read_buf,
+	(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+	 struct fuse_file_info *fi),
+	(path, bufp, size, offset, fi))
+
+METERED(XM_WRITE_BUF, write_buf,
+	(const char *path, struct fuse_bufvec *buf, off_t offset,
+	 struct fuse_file_info *fi),
+	(path, buf, offset, fi))
+#endif
+
 struct fuse_operations xattrfs_fops = {
-	.getattr	= xattrfs_getattr,
-	.readlink	= xattrfs_readlink,
+	.getattr	= metered_getattr,
+	.readlink	= metered_readlink,
 	.getdir		= NULL,
-	.mknod		= xattrfs_mknod,
-	.mkdir		= xattrfs_mkdir,
-	.unlink		= xattrfs_unlink,
-	.rmdir		= xattrfs_rmdir,
-	.symlink	= xattrfs_symlink,
-	.rename		= xattrfs_rename,
-	.link		= xattrfs_link,
-	.chmod		= xattrfs_chmod,
-	.chown		= xattrfs_chown,
-	.truncate	= xattrfs_truncate,
-	.utime		= xattrfs_utime,
-	.open		= xattrfs_open,
-	.read		= xattrfs_read,
-	.write		= xattrfs_write,
-	.statfs		= xattrfs_statfs,
-	.flush		= xattrfs_flush,
-	.release	= xattrfs_release,
-	.fsync		= xattrfs_fsync,
-	.setxattr	= xattrfs_setxattr,
-	.getxattr	= xattrfs_getxattr,
-	.listxattr	= xattrfs_listxattr,
-	.removexattr	= xattrfs_removexattr,
-	.opendir	= xattrfs_opendir,
-	.readdir	= xattrfs_readdir,
-	.releasedir	= xattrfs_releasedir,
-	.fsyncdir	= xattrfs_fsyncdir,
+	.mknod		= metered_mknod,
+	.mkdir		= metered_mkdir,
+	.unlink		= metered_unlink,
+	.rmdir		= metered_rmdir,
+	.symlink	= metered_symlink,
+	.rename		= metered_rename,
+	.link		= metered_link,
+	.chmod		= metered_chmod,
+	.chown		= metered_chown,
+	.truncate	= metered_truncate,
+	.utime		= metered_utime,
+	.open		= metered_open,
+	.read		= metered_read,
+	.write		= metered_write,
+	.statfs		= metered_statfs,
+	.flush		= metered_flush,
+	.release	= metered_release,
+	.fsync		= metered_fsync,
+	.setxattr	= metered_setxattr,
+	.getxattr	= metered_getxattr,
+	.listxattr	= metered_listxattr,
+	.removexattr	= metered_removexattr,
+	.opendir	= metered_opendir,
+	.readdir	= metered_readdir,
+	.releasedir	= metered_releasedir,
+	.fsyncdir	= metered_fsyncdir,
 	.init		= xattrfs_init,
 	.destroy	= xattrfs_destroy,
-	.access		= xattrfs_access,
+	.access		= metered_access,
 	.create		= NULL,
-	.ftruncate	= xattrfs_ftruncate,
-	.fgetattr	= xattrfs_fgetattr,
+	.ftruncate	= metered_ftruncate,
+	.fgetattr	= metered_fgetattr,
 	.lock		= NULL,
 	/** currently, stick to deprecated utime(2) */
-	.utimens	= xattrfs_utimens,
+	.utimens	= metered_utimens,
 	.bmap		= NULL,
+#ifdef FUSE_CAP_SPLICE_READ
+	.read_buf	= metered_read_buf,
+	.write_buf	= metered_write_buf,
+#endif
 };
 
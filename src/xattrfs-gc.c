@@ -0,0 +1,454 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * orphan sweeper: unlink, rmdir and rename purge the xattrs of a base file
+ * whose last link goes away, but files removed behind our back (or while the
+ * file system was not mounted) leave their rows behind. the sweeper finds them
+ * in rounds, a few entries at a time:
+ *
+ *  1. walk: read the base tree, @batch entries per step, and collect the inode
+ *     numbers it finds.
+ *  2. sweep: read the inodes in the database, @batch per step, and purge the
+ *     ones the walk has not seen.
+ *
+ * a file can move from a directory that is not walked yet into one that is,
+ * or get its first xattr after its directory has been walked. rename, link
+ * and setxattr through the mount therefore mark the inode as touched, and a
+ * touched inode is never purged in the same round. a file moved in the base
+ * directory directly during a round is not seen, so only enable the sweeper
+ * when the base directory is not changed behind the mount.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xattrfs.h"
+
+#define GC_HASH_SIZE		1024
+#define GC_PAUSE		100		/* msec between two steps */
+
+struct gc_ino {
+	struct gc_ino *next;
+	ino_t ino;
+};
+
+struct gc_dir {
+	struct gc_dir *next;
+	char path[];			/* relative to the base directory */
+};
+
+struct xattrfs_gc {
+	struct xattrfs_ctx *ctx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int stop;
+	int interval;			/* sec between two rounds */
+	int batch;
+
+	/* the walk */
+	struct gc_dir *dirs;		/* to be read */
+	DIR *dp;			/* being read */
+	char *dpath;
+	ino_t *live;			/* inodes seen, sorted for the sweep */
+	size_t nlive;
+	size_t maxlive;
+
+	/* the sweep */
+	ino_t cursor;
+	ino_t *inos;
+
+	struct gc_ino *touched[GC_HASH_SIZE];	/* in this round */
+	int lost;			/* a touch could not be recorded */
+
+	uint64_t rounds;
+	uint64_t purged;
+};
+
+static inline unsigned int hash_ino(ino_t ino)
+{
+	return (unsigned int) ((ino * 2654435761UL) % GC_HASH_SIZE);
+}
+
+static int is_touched(struct xattrfs_gc *gc, ino_t ino)
+{
+	struct gc_ino *t;
+
+	for (t = gc->touched[hash_ino(ino)]; t; t = t->next)
+		if (t->ino == ino)
+			return 1;
+
+	return 0;
+}
+
+static void clear_touched(struct xattrfs_gc *gc)
+{
+	int i;
+	struct gc_ino *t, *next;
+
+	for (i = 0; i < GC_HASH_SIZE; i++) {
+		for (t = gc->touched[i]; t; t = next) {
+			next = t->next;
+			free(t);
+		}
+		gc->touched[i] = NULL;
+	}
+}
+
+static int push_dir(struct xattrfs_gc *gc, const char *parent,
+			const char *name)
+{
+	struct gc_dir *d;
+	size_t len = strlen(parent) + strlen(name) + 2;
+
+	if (len > PATH_MAX)
+		return -ENAMETOOLONG;
+
+	d = malloc(sizeof(*d) + len);
+	if (!d)
+		return -ENOMEM;
+
+	if (!parent[0])
+		strcpy(d->path, name);
+	else if (snprintf(d->path, len, "%s/%s", parent, name) >= (int) len) {
+		free(d);
+		return -ENAMETOOLONG;
+	}
+
+	d->next = gc->dirs;
+	gc->dirs = d;
+
+	return 0;
+}
+
+static int add_live(struct xattrfs_gc *gc, ino_t ino)
+{
+	if (gc->nlive == gc->maxlive) {
+		size_t max = gc->maxlive ? gc->maxlive << 1 : 4096;
+		ino_t *tmp = realloc(gc->live, max * sizeof(*tmp));
+
+		if (!tmp)
+			return -ENOMEM;
+
+		gc->live = tmp;
+		gc->maxlive = max;
+	}
+
+	gc->live[gc->nlive++] = ino;
+
+	return 0;
+}
+
+static int cmp_ino(const void *a, const void *b)
+{
+	ino_t x = *(const ino_t *) a;
+	ino_t y = *(const ino_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static inline int is_live(struct xattrfs_gc *gc, ino_t ino)
+{
+	return NULL != bsearch(&ino, gc->live, gc->nlive, sizeof(ino),
+			       cmp_ino);
+}
+
+static int start_round(struct xattrfs_gc *gc)
+{
+	struct stat sb;
+
+	gc->nlive = 0;
+	gc->cursor = 0;
+
+	if (stat(gc->ctx->fsroot, &sb) < 0)
+		return -errno;
+
+	if (add_live(gc, sb.st_ino))
+		return -ENOMEM;
+
+	return push_dir(gc, "", ".");
+}
+
+/* reads up to a batch of entries. returns 1 when the walk is done */
+static int walk(struct xattrfs_gc *gc)
+{
+	int n = 0;
+	int fd;
+	char buf[PATH_MAX];
+	struct dirent *de;
+	struct stat sb;
+
+	while (n < gc->batch) {
+		if (!gc->dp) {
+			struct gc_dir *d = gc->dirs;
+
+			if (!d)
+				return 1;
+
+			gc->dirs = d->next;
+			free(gc->dpath);
+			gc->dpath = strdup(d->path);
+			free(d);
+
+			if (!gc->dpath)
+				return -ENOMEM;
+
+			snprintf(buf, sizeof(buf), "%s%s", gc->ctx->fsroot,
+				 gc->dpath);
+			/* a directory we cannot read hides live inodes */
+			fd = open(buf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd < 0)
+				return errno == ENOENT && strcmp(gc->dpath, ".")
+					? 0 : -errno;
+
+			gc->dp = fdopendir(fd);
+			if (!gc->dp) {
+				close(fd);
+				return -errno;
+			}
+		}
+
+		errno = 0;
+		de = readdir(gc->dp);
+		if (!de) {
+			if (errno)
+				return -errno;
+
+			closedir(gc->dp);
+			gc->dp = NULL;
+			continue;
+		}
+
+		n++;
+
+		if (0 == strcmp(de->d_name, ".") ||
+		    0 == strcmp(de->d_name, ".."))
+			continue;
+
+		/* a mount point has the d_ino of the directory it covers */
+		if (de->d_type != DT_UNKNOWN && de->d_type != DT_DIR) {
+			sb.st_ino = de->d_ino;
+			sb.st_mode = DTTOIF(de->d_type);
+		}
+		else if (fstatat(dirfd(gc->dp), de->d_name, &sb,
+				 AT_SYMLINK_NOFOLLOW) < 0) {
+			if (errno == ENOENT)
+				continue;
+			return -errno;
+		}
+
+		if (add_live(gc, sb.st_ino))
+			return -ENOMEM;
+
+		if (S_ISDIR(sb.st_mode) &&
+		    push_dir(gc, strcmp(gc->dpath, ".") ? gc->dpath : "",
+			     de->d_name))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* checks up to a batch of inodes. returns 1 when the sweep is done */
+static int sweep(struct xattrfs_gc *gc)
+{
+	int i, n;
+	struct xdb *xdb = gc->ctx->xdb;
+
+	n = xdb_scan_inodes(xdb, gc->cursor, gc->inos, gc->batch);
+	if (n < 0)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		ino_t ino = gc->inos[i];
+
+		if (is_live(gc, ino))
+			continue;
+
+		/* setxattr waits for this in xattrfs_gc_touch() */
+		pthread_mutex_lock(&gc->lock);
+		if (!gc->lost && !is_touched(gc, ino) &&
+		    0 == xdb_purge(xdb, ino))
+			gc->purged++;
+		pthread_mutex_unlock(&gc->lock);
+	}
+
+	if (n)
+		gc->cursor = gc->inos[n - 1];
+
+	return n < gc->batch;
+}
+
+/* returns 1 if stopped */
+static int pause_for(struct xattrfs_gc *gc, long msec)
+{
+	int ret;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000L;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+
+	pthread_mutex_lock(&gc->lock);
+	for (ret = 0; !gc->stop && ret != ETIMEDOUT; )
+		ret = pthread_cond_timedwait(&gc->wakeup, &gc->lock, &ts);
+	ret = gc->stop;
+	pthread_mutex_unlock(&gc->lock);
+
+	return ret;
+}
+
+static void *gc_thread(void *arg)
+{
+	int ret;
+	struct xattrfs_gc *gc = (struct xattrfs_gc *) arg;
+
+	while (!pause_for(gc, gc->interval * 1000L)) {
+		pthread_mutex_lock(&gc->lock);
+		ret = start_round(gc);
+		pthread_mutex_unlock(&gc->lock);
+
+		while (ret == 0) {
+			ret = walk(gc);
+			if (ret == 0 && pause_for(gc, GC_PAUSE))
+				break;
+		}
+
+		if (ret < 0)
+			fprintf(stderr, "xattrfs: gc walk failed (%d)\n", ret);
+		if (ret != 1)
+			goto next;	/* never sweep after a partial walk */
+
+		qsort(gc->live, gc->nlive, sizeof(*gc->live), cmp_ino);
+
+		do {
+			ret = sweep(gc);
+		} while (ret == 0 && !pause_for(gc, GC_PAUSE));
+
+		if (ret < 0)
+			fprintf(stderr, "xattrfs: gc sweep failed (%d)\n", ret);
+next:
+		pthread_mutex_lock(&gc->lock);
+		while (gc->dirs) {
+			struct gc_dir *d = gc->dirs;
+
+			gc->dirs = d->next;
+			free(d);
+		}
+		if (gc->dp) {
+			closedir(gc->dp);
+			gc->dp = NULL;
+		}
+		clear_touched(gc);
+		gc->lost = 0;
+		gc->rounds++;
+		pthread_mutex_unlock(&gc->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * external interface
+ */
+
+int xattrfs_gc_init(struct xattrfs_gc **gc, struct xattrfs_ctx *ctx,
+			int interval, int batch)
+{
+	int ret = 0;
+	pthread_condattr_t attr;
+	struct xattrfs_gc *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return -ENOMEM;
+
+	self->inos = calloc(batch, sizeof(*self->inos));
+	if (!self->inos) {
+		free(self);
+		return -ENOMEM;
+	}
+
+	self->ctx = ctx;
+	self->interval = interval;
+	self->batch = batch;
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&self->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&self->thread, NULL, gc_thread, self);
+	if (ret) {
+		pthread_cond_destroy(&self->wakeup);
+		pthread_mutex_destroy(&self->lock);
+		free(self->inos);
+		free(self);
+		return -ret;
+	}
+
+	*gc = self;
+
+	return 0;
+}
+
+void xattrfs_gc_exit(struct xattrfs_gc *gc)
+{
+	pthread_mutex_lock(&gc->lock);
+	gc->stop = 1;
+	pthread_cond_signal(&gc->wakeup);
+	pthread_mutex_unlock(&gc->lock);
+
+	pthread_join(gc->thread, NULL);
+
+	clear_touched(gc);
+	free(gc->dpath);
+	free(gc->live);
+	free(gc->inos);
+	pthread_cond_destroy(&gc->wakeup);
+	pthread_mutex_destroy(&gc->lock);
+	free(gc);
+}
+
+void xattrfs_gc_touch(struct xattrfs_gc *gc, ino_t ino)
+{
+	struct gc_ino *t;
+
+	pthread_mutex_lock(&gc->lock);
+
+	if (!is_touched(gc, ino)) {
+		t = malloc(sizeof(*t));
+		if (t) {
+			t->ino = ino;
+			t->next = gc->touched[hash_ino(ino)];
+			gc->touched[hash_ino(ino)] = t;
+		}
+		else
+			gc->lost = 1;	/* purge nothing in this round */
+	}
+
+	pthread_mutex_unlock(&gc->lock);
+}
+
+void xattrfs_gc_stats(struct xattrfs_gc *gc, uint64_t *rounds,
+			uint64_t *purged)
+{
+	pthread_mutex_lock(&gc->lock);
+	*rounds = gc->rounds;
+	*purged = gc->purged;
+	pthread_mutex_unlock(&gc->lock);
+}
@@ -0,0 +1,1095 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * the kv backend (-o backend=kv): the xattrs and the dentries are records of
+ * an append-only log (KV_FILE), which is memory-mapped, and an index in memory
+ * points to the live record of each key.
+ *
+ *  - the index is a hash table on the inode number, so the xattrs of an inode
+ *    are on one chain. nodes are only added to a chain, never taken out: a
+ *    removed key keeps its node, with no record. readers walk the chains and
+ *    read the values from the mapping without any lock.
+ *  - writers append under kv->wlock, one at a time, and update the index
+ *    after the record is written.
+ *  - at mount, the log is replayed into the index. a torn record at the end
+ *    (a crash in the middle of an append) fails its crc, and is cut off.
+ *  - a thread compacts the log when more than half of it is dead: the live
+ *    records go into a new log with a new index (a generation), then what was
+ *    appended meanwhile is replayed into it, and it replaces the old one. the
+ *    old generation goes away once its last reader is done with it.
+ *
+ * lookups by value (queries) and by the inode of a dentry walk the whole
+ * index.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>		/* XATTR_CREATE, XATTR_REPLACE */
+#include <attr/xattr.h>		/* ENOATTR */
+
+#include "xattrfs.h"
+
+#define KV_MAGIC		"xattrkv1"
+#define KV_HEADER		16
+#define KV_MAP_SIZE		(1ULL << 38)	/* the largest log, 256 GiB */
+#define KV_MIN_BUCKETS		1024
+#define KV_COMPACT_MIN		(4 << 20)	/* dead bytes */
+#define KV_CHECK_INTERVAL	1000		/* msec */
+#define KV_OUT_SIZE		(1 << 20)
+
+enum {
+	KV_SET = 1,		/* an xattr */
+	KV_DEL,
+	KV_PURGE,		/* every xattr of an inode */
+	KV_DENTRY,		/* a dentry, with the inode as the value */
+	KV_UNDENTRY,
+};
+
+struct kv_rec {
+	uint32_t crc;			/* of the rest of the record */
+	uint8_t type;
+	uint8_t pad;
+	uint16_t nlen;			/* of the name, without its nul */
+	uint32_t vlen;
+	uint32_t pad2;
+	uint64_t ino;			/* or the parent of a dentry */
+	char data[];			/* the name, its nul, the value */
+};
+
+struct kv_node {
+	struct kv_node *next;		/* in the bucket */
+	uint64_t ino;
+	uint64_t off;			/* of the live record, 0 if removed */
+	uint32_t size;			/* of the live record */
+	uint8_t type;			/* KV_SET or KV_DENTRY */
+	char name[];
+};
+
+/* a log with its index */
+struct kv_gen {
+	struct kv_gen *retired;		/* xdb_kv->retired */
+	int fd;
+	char *map;
+	uint64_t tail;			/* the end of the log */
+	struct kv_node **buckets;
+	uint64_t mask;
+	uint64_t keys;			/* nodes with a record */
+	uint64_t nodes;
+	uint64_t dead;			/* bytes of dead records */
+	int readers;
+};
+
+struct xdb_kv {
+	struct kv_gen *gen;
+	pthread_mutex_t wlock;		/* appends and index updates */
+	char *path;
+	int sync;			/* fdatasync() every append */
+	uint64_t compactions;
+	struct kv_gen *retired;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int stop;
+};
+
+/* buffered appends of the compaction */
+struct kv_out {
+	struct kv_gen *gen;
+	char *buf;
+	size_t len;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static inline size_t rec_size(size_t nlen, size_t vlen)
+{
+	return (sizeof(struct kv_rec) + nlen + 1 + vlen + 7) & ~(size_t) 7;
+}
+
+static inline const char *rec_value(const struct kv_rec *rec)
+{
+	return rec->data + rec->nlen + 1;
+}
+
+static inline uint32_t rec_crc(const struct kv_rec *rec, size_t size)
+{
+	return crc32(0, (const char *) rec + sizeof(rec->crc),
+		     size - sizeof(rec->crc));
+}
+
+static inline uint64_t bucket_of(struct kv_gen *g, uint64_t ino)
+{
+	return ((ino * 0x9e3779b97f4a7c15ULL) >> 20) & g->mask;
+}
+
+/**
+ * a reader holds the generation it walks. the check after the increment
+ * makes sure that it has not been replaced in between, which the compaction
+ * would not wait for.
+ */
+static struct kv_gen *gen_get(struct xdb_kv *kv)
+{
+	struct kv_gen *g;
+
+	for (;;) {
+		g = __atomic_load_n(&kv->gen, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&g->readers, 1, __ATOMIC_SEQ_CST);
+		if (g == __atomic_load_n(&kv->gen, __ATOMIC_SEQ_CST))
+			return g;
+		__atomic_sub_fetch(&g->readers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static inline void gen_put(struct kv_gen *g)
+{
+	__atomic_sub_fetch(&g->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline struct kv_node *first(struct kv_gen *g, uint64_t ino)
+{
+	return __atomic_load_n(&g->buckets[bucket_of(g, ino)],
+			       __ATOMIC_ACQUIRE);
+}
+
+static struct kv_node *lookup(struct kv_gen *g, int type, uint64_t ino,
+				const char *name)
+{
+	struct kv_node *n;
+
+	for (n = first(g, ino); n; n = n->next)
+		if (n->ino == ino && n->type == type &&
+		    0 == strcmp(n->name, name))
+			return n;
+
+	return NULL;
+}
+
+/* the live record of @n, or NULL */
+static inline const struct kv_rec *node_rec(struct kv_gen *g,
+					struct kv_node *n)
+{
+	uint64_t off = __atomic_load_n(&n->off, __ATOMIC_ACQUIRE);
+
+	return off ? (const struct kv_rec *) (g->map + off) : NULL;
+}
+
+static void set_node(struct kv_gen *g, struct kv_node *n, uint64_t off,
+			uint32_t size)
+{
+	if (n->off)
+		g->dead += n->size;
+	else if (off)
+		g->keys++;
+	else
+		return;
+
+	if (!off)
+		g->keys--;
+
+	n->size = size;
+	__atomic_store_n(&n->off, off, __ATOMIC_RELEASE);
+}
+
+/**
+ * the index after the record @rec at @off. the writer of @g calls this, so
+ * the nodes only change here.
+ */
+static int apply(struct kv_gen *g, const struct kv_rec *rec, uint64_t off,
+			uint32_t size)
+{
+	int type = rec->type == KV_DEL ? KV_SET :
+		   rec->type == KV_UNDENTRY ? KV_DENTRY : rec->type;
+	uint64_t b;
+	struct kv_node *n;
+
+	if (rec->type == KV_PURGE) {
+		for (n = first(g, rec->ino); n; n = n->next)
+			if (n->ino == rec->ino && n->type == KV_SET)
+				set_node(g, n, 0, 0);
+		g->dead += size;
+		return 0;
+	}
+
+	n = lookup(g, type, rec->ino, rec->data);
+
+	if (rec->type == KV_DEL || rec->type == KV_UNDENTRY) {
+		if (n)
+			set_node(g, n, 0, 0);
+		g->dead += size;
+		return 0;
+	}
+
+	if (n) {
+		set_node(g, n, off, size);
+		return 0;
+	}
+
+	n = malloc(sizeof(*n) + rec->nlen + 1);
+	if (!n)
+		return -ENOMEM;
+
+	n->ino = rec->ino;
+	n->off = off;
+	n->size = size;
+	n->type = type;
+	memcpy(n->name, rec->data, rec->nlen + 1);
+
+	b = bucket_of(g, rec->ino);
+	n->next = g->buckets[b];
+	__atomic_store_n(&g->buckets[b], n, __ATOMIC_RELEASE);
+
+	g->keys++;
+	g->nodes++;
+
+	return 0;
+}
+
+static int valid_type(int type)
+{
+	return type >= KV_SET && type <= KV_UNDENTRY;
+}
+
+static int append(struct xdb_kv *kv, struct kv_gen *g, int type, ino_t ino,
+			const char *name, const void *value, size_t vlen)
+{
+	int ret;
+	size_t nlen = strlen(name);
+	size_t size = rec_size(nlen, vlen);
+	uint64_t zero = 0;
+	struct kv_rec rec;
+	struct iovec iov[4];
+
+	if (nlen > UINT16_MAX || vlen > UINT32_MAX)
+		return -E2BIG;
+	if (g->tail + size > KV_MAP_SIZE)
+		return -ENOSPC;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.nlen = nlen;
+	rec.vlen = vlen;
+	rec.ino = ino;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *) name;
+	iov[1].iov_len = nlen + 1;
+	iov[2].iov_base = (void *) value;
+	iov[2].iov_len = vlen;
+	iov[3].iov_base = &zero;
+	iov[3].iov_len = size - sizeof(rec) - nlen - 1 - vlen;
+
+	rec.crc = crc32(0, (char *) &rec + sizeof(rec.crc),
+			sizeof(rec) - sizeof(rec.crc));
+	rec.crc = crc32(rec.crc, name, nlen + 1);
+	rec.crc = crc32(rec.crc, value, vlen);
+	rec.crc = crc32(rec.crc, &zero, iov[3].iov_len);
+
+	if (pwritev(g->fd, iov, 4, g->tail) != (ssize_t) size)
+		return -EIO;
+	if (kv->sync && fdatasync(g->fd))
+		return -EIO;
+
+	ret = apply(g, (struct kv_rec *) (g->map + g->tail), g->tail, size);
+	if (ret)
+		return ret;
+
+	__atomic_store_n(&g->tail, g->tail + size, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void free_index(struct kv_gen *g)
+{
+	uint64_t i;
+	struct kv_node *n, *next;
+
+	for (i = 0; g->buckets && i <= g->mask; i++)
+		for (n = g->buckets[i]; n; n = next) {
+			next = n->next;
+			free(n);
+		}
+
+	free(g->buckets);
+	g->buckets = NULL;
+}
+
+static void close_gen(struct kv_gen *g)
+{
+	free_index(g);
+	if (g->map && g->map != MAP_FAILED)
+		munmap(g->map, KV_MAP_SIZE);
+	if (g->fd >= 0)
+		close(g->fd);
+	g->map = NULL;
+	g->fd = -1;
+}
+
+/* an empty log at @path with room for @keys keys in the index */
+static int create_gen(struct kv_gen **gen, const char *path, uint64_t keys,
+			int flags)
+{
+	uint64_t n = KV_MIN_BUCKETS;
+	struct kv_gen *g = calloc(1, sizeof(*g));
+
+	if (!g)
+		return -ENOMEM;
+
+	while (n < keys * 2)
+		n <<= 1;
+
+	g->mask = n - 1;
+	g->buckets = calloc(n, sizeof(*g->buckets));
+	g->fd = open(path, O_RDWR | O_CREAT | flags, 0644);
+	if (!g->buckets || g->fd < 0)
+		goto out;
+
+	g->map = mmap(NULL, KV_MAP_SIZE, PROT_READ, MAP_SHARED | MAP_NORESERVE,
+		      g->fd, 0);
+	if (g->map == MAP_FAILED)
+		goto out;
+
+	*gen = g;
+
+	return 0;
+
+out:
+	close_gen(g);
+	free(g);
+	return -EIO;
+}
+
+static int write_header(struct kv_gen *g)
+{
+	char header[KV_HEADER] = KV_MAGIC;
+
+	if (pwrite(g->fd, header, KV_HEADER, 0) != KV_HEADER)
+		return -EIO;
+
+	g->tail = KV_HEADER;
+
+	return 0;
+}
+
+/* replays the log into the index, and cuts off a torn record at the end */
+static int replay(struct kv_gen *g, uint64_t end)
+{
+	int ret;
+	uint64_t off = KV_HEADER;
+	uint64_t size;
+	struct kv_rec *rec;
+
+	while (off + sizeof(*rec) <= end) {
+		rec = (struct kv_rec *) (g->map + off);
+		size = rec_size(rec->nlen, rec->vlen);
+
+		if (off + size > end || !valid_type(rec->type) ||
+		    rec->crc != rec_crc(rec, size))
+			break;
+
+		ret = apply(g, rec, off, size);
+		if (ret)
+			return ret;
+
+		off += size;
+	}
+
+	if (off < end) {
+		fprintf(stderr, "xattrfs: %llu bytes of a torn record at the "
+				"end of the kv log are dropped\n",
+				_llu(end - off));
+		if (ftruncate(g->fd, off))
+			return -EIO;
+	}
+
+	g->tail = off;
+
+	return 0;
+}
+
+static int open_log(struct xdb_kv *kv)
+{
+	int ret;
+	struct stat sb;
+	struct kv_gen *g;
+
+	if (stat(kv->path, &sb))
+		sb.st_size = 0;
+
+	/* about a key per 64 bytes of the log */
+	ret = create_gen(&g, kv->path, sb.st_size / 64, 0);
+	if (ret)
+		return ret;
+
+	if (sb.st_size == 0)
+		ret = write_header(g);
+	else if (sb.st_size < KV_HEADER ||
+		 memcmp(g->map, KV_MAGIC, sizeof(KV_MAGIC) - 1))
+		ret = -EINVAL;
+	else
+		ret = replay(g, sb.st_size);
+
+	if (ret) {
+		close_gen(g);
+		free(g);
+		return ret;
+	}
+
+	kv->gen = g;
+
+	return 0;
+}
+
+static int out_flush(struct kv_out *out)
+{
+	if (out->len && pwrite(out->gen->fd, out->buf, out->len,
+			       out->gen->tail) != (ssize_t) out->len)
+		return -EIO;
+
+	out->gen->tail += out->len;
+	out->len = 0;
+
+	return 0;
+}
+
+/**
+ * the live records of each key go to the new log as they are. the index of
+ * the new log takes them from the buffer, and never reads the log before it
+ * is flushed, since every key comes once.
+ */
+static int out_copy(struct kv_out *out, const struct kv_rec *rec,
+			uint32_t size)
+{
+	int ret;
+
+	if (out->len + size > KV_OUT_SIZE) {
+		ret = out_flush(out);
+		if (ret)
+			return ret;
+	}
+
+	if (size > KV_OUT_SIZE) {
+		if (pwrite(out->gen->fd, rec, size, out->gen->tail) != size)
+			return -EIO;
+		ret = apply(out->gen, rec, out->gen->tail, size);
+		out->gen->tail += size;
+		return ret;
+	}
+
+	memcpy(out->buf + out->len, rec, size);
+	ret = apply(out->gen, (struct kv_rec *) (out->buf + out->len),
+		    out->gen->tail + out->len, size);
+	out->len += size;
+
+	return ret;
+}
+
+static int sync_dir(const char *path)
+{
+	int fd, ret;
+	char *dir = strdup(path);
+
+	if (!dir)
+		return -ENOMEM;
+
+	*strrchr(dir, '/') = '\0';
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd < 0)
+		return -errno;
+
+	ret = fsync(fd) ? -errno : 0;
+	close(fd);
+
+	return ret;
+}
+
+static int compact(struct xdb_kv *kv)
+{
+	int ret;
+	uint64_t i, end, off;
+	uint32_t size;
+	struct kv_gen *old = kv->gen;	/* only replaced here */
+	struct kv_gen *g = NULL;
+	struct kv_node *n;
+	struct kv_out out = { .len = 0 };
+	char tmp[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s.compact", kv->path);
+
+	pthread_mutex_lock(&kv->wlock);
+	end = old->tail;
+	ret = create_gen(&g, tmp, old->keys, O_TRUNC);
+	pthread_mutex_unlock(&kv->wlock);
+
+	if (ret)
+		return ret;
+
+	out.gen = g;
+	out.buf = malloc(KV_OUT_SIZE);
+	if (!out.buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = write_header(g);
+
+	/* what is appended from @end on is replayed below */
+	for (i = 0; ret == 0 && i <= old->mask; i++) {
+		for (n = __atomic_load_n(&old->buckets[i], __ATOMIC_ACQUIRE);
+		     ret == 0 && n; n = n->next) {
+			off = __atomic_load_n(&n->off, __ATOMIC_ACQUIRE);
+			if (off == 0 || off >= end)
+				continue;
+
+			size = rec_size(((struct kv_rec *) (old->map + off))->nlen,
+					((struct kv_rec *) (old->map + off))->vlen);
+			ret = out_copy(&out, (struct kv_rec *) (old->map + off),
+				       size);
+		}
+	}
+
+	if (ret == 0)
+		ret = out_flush(&out);
+	if (ret)
+		goto out;
+
+	pthread_mutex_lock(&kv->wlock);
+
+	for (off = end; ret == 0 && off < old->tail; off += size) {
+		struct kv_rec *rec = (struct kv_rec *) (old->map + off);
+
+		size = rec_size(rec->nlen, rec->vlen);
+		if (pwrite(g->fd, rec, size, g->tail) != size)
+			ret = -EIO;
+		else
+			ret = apply(g, (struct kv_rec *) (g->map + g->tail),
+				    g->tail, size);
+		g->tail += size;
+	}
+
+	if (ret == 0 && fdatasync(g->fd))
+		ret = -EIO;
+	if (ret == 0 && rename(tmp, kv->path))
+		ret = -errno;
+	if (ret == 0)
+		ret = sync_dir(kv->path);
+
+	if (ret) {
+		pthread_mutex_unlock(&kv->wlock);
+		goto out;
+	}
+
+	__atomic_store_n(&kv->gen, g, __ATOMIC_SEQ_CST);
+	kv->compactions++;
+
+	pthread_mutex_unlock(&kv->wlock);
+
+	while (__atomic_load_n(&old->readers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	/* a late reader may still look at the counter, so it stays */
+	close_gen(old);
+	old->retired = kv->retired;
+	kv->retired = old;
+
+	free(out.buf);
+
+	return 0;
+
+out:
+	free(out.buf);
+	unlink(tmp);
+	close_gen(g);
+	free(g);
+	return ret;
+}
+
+/* more than half of the log is dead, or the chains get long */
+static int need_compact(struct kv_gen *g)
+{
+	return (g->dead >= KV_COMPACT_MIN && g->dead * 2 >= g->tail) ||
+		g->nodes > (g->mask + 1) * 4;
+}
+
+static void *kv_thread(void *arg)
+{
+	int ret;
+	struct timespec ts;
+	struct xdb_kv *kv = (struct xdb_kv *) arg;
+
+	pthread_mutex_lock(&kv->lock);
+
+	while (!kv->stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += KV_CHECK_INTERVAL / 1000;
+
+		ret = pthread_cond_timedwait(&kv->wakeup, &kv->lock, &ts);
+		if (kv->stop || ret != ETIMEDOUT)
+			continue;
+
+		pthread_mutex_unlock(&kv->lock);
+
+		if (need_compact(kv->gen)) {
+			ret = compact(kv);
+			if (ret)
+				fprintf(stderr, "xattrfs: kv compaction "
+						"failed (%d)\n", ret);
+		}
+
+		pthread_mutex_lock(&kv->lock);
+	}
+
+	pthread_mutex_unlock(&kv->lock);
+
+	return NULL;
+}
+
+/**
+ * the backend
+ */
+
+static void kv_exit(struct xdb *xdb)
+{
+	struct xdb_kv *kv = xdb->kv;
+	struct kv_gen *g;
+
+	if (kv) {
+		if (kv->thread) {
+			pthread_mutex_lock(&kv->lock);
+			kv->stop = 1;
+			pthread_cond_signal(&kv->wakeup);
+			pthread_mutex_unlock(&kv->lock);
+
+			pthread_join(kv->thread, NULL);
+		}
+
+		if (kv->gen) {
+			fdatasync(kv->gen->fd);
+			close_gen(kv->gen);
+			free(kv->gen);
+		}
+
+		while ((g = kv->retired) != NULL) {
+			kv->retired = g->retired;
+			free(g);
+		}
+
+		pthread_cond_destroy(&kv->wakeup);
+		pthread_mutex_destroy(&kv->lock);
+		pthread_mutex_destroy(&kv->wlock);
+		free(kv->path);
+		free(kv);
+	}
+
+	pthread_mutex_destroy(&xdb->lock);
+	free(xdb);
+}
+
+static int kv_init(struct xdb **xdb, const char *dir,
+			const struct xdb_config *cfg)
+{
+	int ret;
+	pthread_condattr_t attr;
+	struct xdb_kv *kv;
+	struct xdb *self = calloc(1, sizeof(*self));
+	char path[PATH_MAX];
+
+	if (!self)
+		return -ENOMEM;
+
+	self->cfg = *cfg;
+	pthread_mutex_init(&self->lock, NULL);
+
+	pthread_once(&crc_once, crc_init);
+
+	kv = calloc(1, sizeof(*kv));
+	if (!kv) {
+		kv_exit(self);
+		return -ENOMEM;
+	}
+
+	self->kv = kv;
+
+	pthread_mutex_init(&kv->wlock, NULL);
+	pthread_mutex_init(&kv->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&kv->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* as the sync levels of sqlite: full and extra sync every commit */
+	kv->sync = 0 == strcmp(cfg->sync, "full") ||
+		   0 == strcmp(cfg->sync, "extra");
+
+	snprintf(path, sizeof(path), "%s/%s", dir, KV_FILE);
+	kv->path = strdup(path);
+	if (!kv->path) {
+		kv_exit(self);
+		return -ENOMEM;
+	}
+
+	ret = open_log(kv);
+	if (ret) {
+		kv_exit(self);
+		return ret;
+	}
+
+	ret = pthread_create(&kv->thread, NULL, kv_thread, kv);
+	if (ret) {
+		kv->thread = 0;
+		kv_exit(self);
+		return -ret;
+	}
+
+	*xdb = self;
+
+	return 0;
+}
+
+static int kv_getxattr(struct xdb *xdb, ino_t ino, const char *name,
+			char *value, size_t size)
+{
+	int ret;
+	struct kv_gen *g = gen_get(xdb->kv);
+	struct kv_node *n = lookup(g, KV_SET, ino, name);
+	const struct kv_rec *rec = n ? node_rec(g, n) : NULL;
+
+	if (!rec)
+		ret = -ENODATA;
+	else if (size == 0)
+		ret = rec->vlen;
+	else if (size < rec->vlen)
+		ret = -ERANGE;
+	else {
+		memcpy(value, rec_value(rec), rec->vlen);
+		ret = rec->vlen;
+	}
+
+	gen_put(g);
+
+	return ret;
+}
+
+static int kv_setxattr(struct xdb *xdb, ino_t ino, const char *name,
+			const char *value, size_t size, int flags)
+{
+	int ret = 0;
+	struct xdb_kv *kv = xdb->kv;
+	struct kv_node *n;
+
+	pthread_mutex_lock(&kv->wlock);
+
+	n = lookup(kv->gen, KV_SET, ino, name);
+	if (n && n->off && (flags & XATTR_CREATE))
+		ret = -EEXIST;
+	else if ((!n || !n->off) && (flags & XATTR_REPLACE))
+		ret = -ENOATTR;
+	else
+		ret = append(kv, kv->gen, KV_SET, ino, name, value, size);
+
+	pthread_mutex_unlock(&kv->wlock);
+
+	return ret;
+}
+
+static int kv_removexattr(struct xdb *xdb, ino_t ino, const char *name)
+{
+	int ret;
+	struct xdb_kv *kv = xdb->kv;
+	struct kv_node *n;
+
+	pthread_mutex_lock(&kv->wlock);
+
+	n = lookup(kv->gen, KV_SET, ino, name);
+	if (n && n->off)
+		ret = append(kv, kv->gen, KV_DEL, ino, name, NULL, 0);
+	else
+		ret = -ENOATTR;
+
+	pthread_mutex_unlock(&kv->wlock);
+
+	return ret;
+}
+
+static int kv_listxattr(struct xdb *xdb, ino_t ino, char *list, size_t size)
+{
+	size_t len = 0;
+	size_t nlen;
+	struct kv_gen *g = gen_get(xdb->kv);
+	struct kv_node *n;
+
+	for (n = first(g, ino); n; n = n->next) {
+		if (n->ino != ino || n->type != KV_SET || !node_rec(g, n))
+			continue;
+
+		nlen = strlen(n->name) + 1;
+		if (size && len + nlen <= size)
+			memcpy(&list[len], n->name, nlen);
+		len += nlen;
+	}
+
+	gen_put(g);
+
+	return size && size < len ? -ERANGE : (int) len;
+}
+
+static int kv_purge(struct xdb *xdb, ino_t ino)
+{
+	int ret = 0;
+	struct xdb_kv *kv = xdb->kv;
+	struct kv_node *n;
+
+	pthread_mutex_lock(&kv->wlock);
+
+	/* most files have no xattrs, and those are not logged */
+	for (n = first(kv->gen, ino); n; n = n->next)
+		if (n->ino == ino && n->type == KV_SET && n->off)
+			break;
+
+	if (n)
+		ret = append(kv, kv->gen, KV_PURGE, ino, "", NULL, 0);
+
+	pthread_mutex_unlock(&kv->wlock);
+
+	return ret;
+}
+
+/* the index is not ordered, so the lowest @count above @after are kept */
+static int kv_scan_inodes(struct xdb *xdb, ino_t after, ino_t *inos,
+			int count)
+{
+	int n = 0;
+	int lo, hi, mid;
+	uint64_t i;
+	struct kv_gen *g = gen_get(xdb->kv);
+	struct kv_node *node;
+
+	for (i = 0; i <= g->mask; i++) {
+		node = __atomic_load_n(&g->buckets[i], __ATOMIC_ACQUIRE);
+		for ( ; node; node = node->next) {
+			if (node->type != KV_SET || node->ino <= after ||
+			    !node_rec(g, node))
+				continue;
+
+			for (lo = 0, hi = n; lo < hi; ) {
+				mid = (lo + hi) / 2;
+				if (inos[mid] < node->ino)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			if (lo == count || (lo < n && inos[lo] == node->ino))
+				continue;
+
+			if (n < count)
+				n++;
+			memmove(&inos[lo + 1], &inos[lo],
+				(n - lo - 1) * sizeof(*inos));
+			inos[lo] = node->ino;
+		}
+	}
+
+	gen_put(g);
+
+	return n;
+}
+
+static int kv_dentry_add(struct xdb *xdb, ino_t parent, const char *name,
+			ino_t ino)
+{
+	int ret;
+	uint64_t value = ino;
+	struct xdb_kv *kv = xdb->kv;
+
+	pthread_mutex_lock(&kv->wlock);
+	ret = append(kv, kv->gen, KV_DENTRY, parent, name, &value,
+		     sizeof(value));
+	pthread_mutex_unlock(&kv->wlock);
+
+	return ret;
+}
+
+static int kv_dentry_remove(struct xdb *xdb, ino_t parent, const char *name)
+{
+	int ret = 0;
+	struct xdb_kv *kv = xdb->kv;
+	struct kv_node *n;
+
+	pthread_mutex_lock(&kv->wlock);
+
+	n = lookup(kv->gen, KV_DENTRY, parent, name);
+	if (n && n->off)
+		ret = append(kv, kv->gen, KV_UNDENTRY, parent, name, NULL, 0);
+
+	pthread_mutex_unlock(&kv->wlock);
+
+	return ret;
+}
+
+static int kv_dentry_lookup(struct xdb *xdb, ino_t ino, ino_t *parent,
+			char *name, size_t size)
+{
+	int ret = -ENOENT;
+	uint64_t i, value;
+	struct kv_gen *g = gen_get(xdb->kv);
+	struct kv_node *n;
+	const struct kv_rec *rec;
+
+	for (i = 0; ret == -ENOENT && i <= g->mask; i++) {
+		n = __atomic_load_n(&g->buckets[i], __ATOMIC_ACQUIRE);
+		for ( ; n; n = n->next) {
+			if (n->type != KV_DENTRY)
+				continue;
+
+			rec = node_rec(g, n);
+			if (!rec)
+				continue;
+
+			memcpy(&value, rec_value(rec), sizeof(value));
+			if (value != ino)
+				continue;
+
+			*parent = n->ino;
+			if (strlen(n->name) >= size)
+				ret = -ENAMETOOLONG;
+			else {
+				strcpy(name, n->name);
+				ret = 0;
+			}
+			break;
+		}
+	}
+
+	gen_put(g);
+
+	return ret;
+}
+
+static int kv_query(struct xdb *xdb, const char *name, const char *value,
+		size_t len, int prefix, ino_t **inos)
+{
+	int ret = 0;
+	int count = 0;
+	int size = 0;
+	uint64_t i;
+	ino_t *tmp;
+	struct kv_gen *g = gen_get(xdb->kv);
+	struct kv_node *n;
+	const struct kv_rec *rec;
+
+	*inos = NULL;
+
+	for (i = 0; ret == 0 && i <= g->mask; i++) {
+		n = __atomic_load_n(&g->buckets[i], __ATOMIC_ACQUIRE);
+		for ( ; n; n = n->next) {
+			if (n->type != KV_SET || strcmp(n->name, name))
+				continue;
+
+			rec = node_rec(g, n);
+			if (!rec)
+				continue;
+
+			if (value && (prefix ? rec->vlen < len
+					     : rec->vlen != len))
+				continue;
+			if (value && memcmp(rec_value(rec), value, len))
+				continue;
+
+			if (count == size) {
+				size = size ? size * 2 : 64;
+				tmp = realloc(*inos, size * sizeof(*tmp));
+				if (!tmp) {
+					ret = -ENOMEM;
+					break;
+				}
+				*inos = tmp;
+			}
+
+			(*inos)[count++] = n->ino;
+		}
+	}
+
+	gen_put(g);
+
+	if (ret) {
+		free(*inos);
+		*inos = NULL;
+		return ret;
+	}
+
+	return count;
+}
+
+const struct xdb_backend xdb_kv_backend = {
+	.name		= "kv",
+	.init		= kv_init,
+	.exit		= kv_exit,
+	.getxattr	= kv_getxattr,
+	.setxattr	= kv_setxattr,
+	.removexattr	= kv_removexattr,
+	.listxattr	= kv_listxattr,
+	.purge		= kv_purge,
+	.scan_inodes	= kv_scan_inodes,
+	.dentry_add	= kv_dentry_add,
+	.dentry_remove	= kv_dentry_remove,
+	.dentry_lookup	= kv_dentry_lookup,
+	.query		= kv_query,
+};
+
+/**
+ * external interface
+ */
+
+void xdb_kv_stats(struct xdb *xdb, struct xdb_kv_stats *st)
+{
+	struct kv_gen *g = gen_get(xdb->kv);
+
+	st->keys = __atomic_load_n(&g->keys, __ATOMIC_RELAXED);
+	st->log_bytes = __atomic_load_n(&g->tail, __ATOMIC_RELAXED);
+	st->dead_bytes = __atomic_load_n(&g->dead, __ATOMIC_RELAXED);
+	st->compactions = __atomic_load_n(&xdb->kv->compactions,
+					  __ATOMIC_RELAXED);
+
+	gen_put(g);
+}
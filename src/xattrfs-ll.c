@@ -0,0 +1,1310 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * the low-level (inode based) fuse implementation, used with -o lowlevel.
+ *
+ * every node the kernel has looked up is kept in a table with an O_PATH file
+ * descriptor of the base file, and the fuse node id is the address of the
+ * entry. so an operation works on the descriptor (*at() calls) without
+ * building or resolving a path, and the xattr operations take the inode number
+ * straight from the node.
+ *
+ * nodes are keyed by (st_dev, st_ino), so hard links share one node, and they
+ * are freed when the kernel forgets the last lookup. the design follows the
+ * passthrough_ll example of libfuse.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define FUSE_USE_VERSION		26
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include "xattrfs.h"
+
+#define LL_HASH_MIN		1024
+
+struct ll_inode {
+	struct ll_inode *next;		/* hash chain */
+	int fd;				/* O_PATH */
+	ino_t ino;
+	dev_t dev;
+	uint64_t nlookup;
+	off_t size;			/* when the page cache was last valid */
+	struct timespec mtime;
+};
+
+struct ll_fs {
+	struct xattrfs_ctx *ctx;
+	struct fuse_session *se;
+	struct ll_inode root;		/* not in the table */
+	pthread_mutex_t lock;		/* protects the table */
+	struct ll_inode **table;
+	unsigned long nbuckets;
+	unsigned long count;
+};
+
+struct ll_dirp {
+	DIR *dp;
+	struct dirent *entry;		/* read but not replied yet */
+	off_t offset;
+};
+
+static inline struct ll_fs *ll_fs(fuse_req_t req)
+{
+	return (struct ll_fs *) fuse_req_userdata(req);
+}
+
+static inline struct ll_inode *ll_inode(struct ll_fs *fs, fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &fs->root;
+
+	return (struct ll_inode *) (uintptr_t) ino;
+}
+
+static inline int ll_fd(struct ll_fs *fs, fuse_ino_t ino)
+{
+	return ll_inode(fs, ino)->fd;
+}
+
+static inline fuse_ino_t ll_nodeid(struct ll_fs *fs, struct ll_inode *inode)
+{
+	return inode == &fs->root ? FUSE_ROOT_ID : (uintptr_t) inode;
+}
+
+static inline char *procname(int fd, char *buf)
+{
+	sprintf(buf, "/proc/self/fd/%d", fd);
+	return buf;
+}
+
+static inline unsigned long hash_inode(struct ll_fs *fs, ino_t ino, dev_t dev)
+{
+	return ((ino ^ dev) * 2654435761UL) & (fs->nbuckets - 1);
+}
+
+static void grow_table(struct ll_fs *fs)
+{
+	unsigned long i, nbuckets = fs->nbuckets << 1;
+	struct ll_inode **table = calloc(nbuckets, sizeof(*table));
+	struct ll_inode **old = fs->table;
+	unsigned long oldsize = fs->nbuckets;
+
+	if (!table)
+		return;		/* keep the longer chains */
+
+	fs->table = table;
+	fs->nbuckets = nbuckets;
+
+	for (i = 0; i < oldsize; i++) {
+		struct ll_inode *inode, *next;
+
+		for (inode = old[i]; inode; inode = next) {
+			unsigned long h = hash_inode(fs, inode->ino, inode->dev);
+
+			next = inode->next;
+			inode->next = table[h];
+			table[h] = inode;
+		}
+	}
+
+	free(old);
+}
+
+/* returns the node of @st with one more lookup, taking over @fd if new */
+static struct ll_inode *get_inode(struct ll_fs *fs, int fd, struct stat *st)
+{
+	unsigned long h;
+	struct ll_inode *inode;
+
+	pthread_mutex_lock(&fs->lock);
+
+	h = hash_inode(fs, st->st_ino, st->st_dev);
+	for (inode = fs->table[h]; inode; inode = inode->next)
+		if (inode->ino == st->st_ino && inode->dev == st->st_dev)
+			break;
+
+	if (inode) {
+		inode->nlookup++;
+		close(fd);
+		goto out;
+	}
+
+	inode = calloc(1, sizeof(*inode));
+	if (!inode)
+		goto out;
+
+	inode->fd = fd;
+	inode->ino = st->st_ino;
+	inode->dev = st->st_dev;
+	inode->nlookup = 1;
+	inode->next = fs->table[h];
+	fs->table[h] = inode;
+
+	if (++fs->count > 2 * fs->nbuckets)
+		grow_table(fs);
+
+out:
+	pthread_mutex_unlock(&fs->lock);
+	return inode;
+}
+
+static void put_inode(struct ll_fs *fs, struct ll_inode *inode, uint64_t n)
+{
+	struct ll_inode **pos;
+
+	if (inode == &fs->root)
+		return;
+
+	pthread_mutex_lock(&fs->lock);
+
+	inode->nlookup -= n;
+	if (inode->nlookup) {
+		pthread_mutex_unlock(&fs->lock);
+		return;
+	}
+
+	pos = &fs->table[hash_inode(fs, inode->ino, inode->dev)];
+	for ( ; *pos; pos = &(*pos)->next) {
+		if (*pos == inode) {
+			*pos = inode->next;
+			break;
+		}
+	}
+	fs->count--;
+
+	pthread_mutex_unlock(&fs->lock);
+
+	close(inode->fd);
+	free(inode);
+}
+
+static int do_lookup(struct ll_fs *fs, fuse_ino_t parent, const char *name,
+			struct fuse_entry_param *e)
+{
+	int ret = 0;
+	int fd;
+	struct ll_inode *inode;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = fs->ctx->attr_timeout;
+	e->entry_timeout = fs->ctx->entry_timeout;
+
+	fd = openat(ll_fd(fs, parent), name, O_PATH | O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	ret = fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	if (e->attr.st_ino == fs->root.ino && e->attr.st_dev == fs->root.dev) {
+		close(fd);
+		e->ino = FUSE_ROOT_ID;
+		return 0;
+	}
+
+	inode = get_inode(fs, fd, &e->attr);
+	if (!inode) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	e->ino = ll_nodeid(fs, inode);
+
+	return 0;
+}
+
+/**
+ * the control namespace has no base file, so its nodes are answered by
+ * xattrfs-ctl.c through their paths.
+ */
+
+static inline int is_ctl(fuse_ino_t ino)
+{
+	return xattrfs_is_ctl_ino((ino_t) ino);
+}
+
+static int ctl_lookup(struct ll_fs *fs, fuse_ino_t parent, const char *name,
+			struct fuse_entry_param *e)
+{
+	int ret = 0;
+	char path[PATH_MAX];
+
+	if (parent == FUSE_ROOT_ID)
+		snprintf(path, sizeof(path), "%s", XATTRFS_CTL_DIR);
+	else if (parent != XATTRFS_CTL_INO(0))
+		return -ENOTDIR;
+	else
+		snprintf(path, sizeof(path), "%s/%s", XATTRFS_CTL_DIR, name);
+
+	memset(e, 0, sizeof(*e));
+
+	ret = xattrfs_ctl_getattr(fs->ctx, path, &e->attr);
+	if (ret)
+		return ret;
+
+	e->ino = e->attr.st_ino;
+
+	return 0;
+}
+
+struct ll_dirbuf {
+	fuse_req_t req;
+	char *p;
+	size_t size;
+};
+
+/* a fuse_fill_dir_t for xattrfs_ctl_readdir() */
+static int ll_fill(void *buf, const char *name, const struct stat *st,
+			off_t off)
+{
+	struct ll_dirbuf *b = (struct ll_dirbuf *) buf;
+	size_t old = b->size;
+	struct stat stb;
+	char *p;
+
+	memset(&stb, 0, sizeof(stb));
+	if (st)
+		stb = *st;
+
+	b->size += fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+	p = realloc(b->p, b->size);
+	if (!p)
+		return 1;
+
+	b->p = p;
+	fuse_add_direntry(b->req, &b->p[old], b->size - old, name, &stb,
+			  b->size);
+
+	return 0;
+}
+
+static void ctl_readdir(fuse_req_t req, size_t size, off_t off)
+{
+	int ret = 0;
+	struct ll_dirbuf b = { .req = req };
+
+	ret = xattrfs_ctl_readdir(ll_fs(req)->ctx, XATTRFS_CTL_DIR, &b,
+				  ll_fill);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else if (off < b.size)
+		fuse_reply_buf(req, &b.p[off],
+			       b.size - off < size ? b.size - off : size);
+	else
+		fuse_reply_buf(req, NULL, 0);
+
+	free(b.p);
+}
+
+/**
+ * low-level operations: each request is answered with exactly one fuse_reply_*
+ * call, and errors are replied as positive errno.
+ */
+
+static void xattrfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	int ret = 0;
+	struct ll_fs *fs = (struct ll_fs *) userdata;
+	struct xattrfs_ctx *ctx = fs->ctx;
+
+	xattrfs_want_splice(ctx, conn);
+
+	ret = xdb_init(&ctx->xdb, ctx->fsroot, &ctx->xdbcfg);
+	if (ret) {
+		fprintf(stderr, "xattrfs: failed to open the xattr database "
+				"(%d)\n", ret);
+		ctx->xdb = NULL;
+		fuse_session_exit(fs->se);
+		return;
+	}
+
+	if (ctx->gc_interval &&
+	    xattrfs_gc_init(&ctx->gc, ctx, ctx->gc_interval, ctx->gc_batch))
+		fprintf(stderr, "xattrfs: failed to start the garbage "
+				"collector\n");
+}
+
+static void xattrfs_ll_destroy(void *userdata)
+{
+	struct ll_fs *fs = (struct ll_fs *) userdata;
+	struct xattrfs_ctx *ctx = fs->ctx;
+
+	if (ctx->gc)
+		xattrfs_gc_exit(ctx->gc);
+	ctx->gc = NULL;
+	if (ctx->xdb)
+		xdb_exit(ctx->xdb);
+	ctx->xdb = NULL;
+}
+
+static void xattrfs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+				const char *name)
+{
+	int ret = 0;
+	struct fuse_entry_param e;
+	struct ll_fs *fs = ll_fs(req);
+
+	if (is_ctl(parent) ||
+	    (parent == FUSE_ROOT_ID &&
+	     0 == strcmp(name, &XATTRFS_CTL_DIR[1])))
+		ret = ctl_lookup(fs, parent, name, &e);
+	else
+		ret = do_lookup(fs, parent, name, &e);
+
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void xattrfs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+				unsigned long nlookup)
+{
+	if (!is_ctl(ino))
+		put_inode(ll_fs(req), ll_inode(ll_fs(req), ino), nlookup);
+
+	fuse_reply_none(req);
+}
+
+static void xattrfs_ll_forget_multi(fuse_req_t req, size_t count,
+				struct fuse_forget_data *forgets)
+{
+	size_t i;
+	struct ll_fs *fs = ll_fs(req);
+
+	for (i = 0; i < count; i++) {
+		fuse_ino_t ino = forgets[i].ino;
+
+		if (!is_ctl(ino))
+			put_inode(fs, ll_inode(fs, ino), forgets[i].nlookup);
+	}
+
+	fuse_reply_none(req);
+}
+
+static void xattrfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
+{
+	int ret = 0;
+	struct stat st;
+	char path[PATH_MAX];
+	struct ll_fs *fs = ll_fs(req);
+
+	if (is_ctl(ino)) {
+		ret = xattrfs_ctl_path((ino_t) ino, path, sizeof(path));
+		if (!ret)
+			ret = xattrfs_ctl_getattr(fs->ctx, path, &st);
+	}
+	else if (fstatat(ll_fd(fs, ino), "", &st,
+			 AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+		ret = -errno;
+
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &st, fs->ctx->attr_timeout);
+}
+
+static void xattrfs_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+				struct stat *attr, int valid,
+				struct fuse_file_info *fi)
+{
+	int ret = 0;
+	int fd;
+	char buf[64];
+	char path[PATH_MAX];
+
+	/* O_TRUNC of a writable control file, whose times are not kept */
+	if (is_ctl(ino)) {
+		if (valid & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID |
+			     FUSE_SET_ATTR_GID))
+			ret = -EACCES;
+		else if (valid & FUSE_SET_ATTR_SIZE) {
+			ret = xattrfs_ctl_path((ino_t) ino, path, sizeof(path));
+			if (!ret)
+				ret = xattrfs_ctl_truncate(ll_fs(req)->ctx,
+							   path);
+		}
+
+		if (ret)
+			fuse_reply_err(req, -ret);
+		else
+			xattrfs_ll_getattr(req, ino, fi);
+		return;
+	}
+
+	fd = ll_fd(ll_fs(req), ino);
+
+	if (valid & FUSE_SET_ATTR_MODE) {
+		if (fi)
+			ret = fchmod(fi->fh, attr->st_mode);
+		else
+			ret = chmod(procname(fd, buf), attr->st_mode);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = valid & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t) -1;
+		gid_t gid = valid & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t) -1;
+
+		ret = fchownat(fd, "", uid, gid,
+			       AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (valid & FUSE_SET_ATTR_SIZE) {
+		if (fi)
+			ret = ftruncate(fi->fh, attr->st_size);
+		else
+			ret = truncate(procname(fd, buf), attr->st_size);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2] = {
+			{ .tv_nsec = UTIME_OMIT }, { .tv_nsec = UTIME_OMIT },
+		};
+
+		if (valid & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+
+		if (valid & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+
+		if (fi)
+			ret = futimens(fi->fh, tv);
+		else
+			ret = utimensat(AT_FDCWD, procname(fd, buf), tv, 0);
+		if (ret < 0)
+			goto out;
+	}
+
+out:
+	if (ret < 0)
+		fuse_reply_err(req, errno);
+	else
+		xattrfs_ll_getattr(req, ino, fi);
+}
+
+static void xattrfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	ssize_t ret;
+	char buf[PATH_MAX + 1];
+
+	if (is_ctl(ino)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	ret = readlinkat(ll_fd(ll_fs(req), ino), "", buf, sizeof(buf));
+	if (ret < 0)
+		fuse_reply_err(req, errno);
+	else if (ret == sizeof(buf))
+		fuse_reply_err(req, ENAMETOOLONG);
+	else {
+		buf[ret] = '\0';
+		fuse_reply_readlink(req, buf);
+	}
+}
+
+/* replies the new entry of mknod, mkdir, symlink and link */
+static void reply_new_entry(fuse_req_t req, fuse_ino_t parent,
+				const char *name, int ret)
+{
+	struct fuse_entry_param e;
+
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	ret = do_lookup(ll_fs(req), parent, name, &e);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void xattrfs_ll_mknod(fuse_req_t req, fuse_ino_t parent,
+				const char *name, mode_t mode, dev_t rdev)
+{
+	if (is_ctl(parent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	reply_new_entry(req, parent, name,
+			mknodat(ll_fd(ll_fs(req), parent), name, mode, rdev));
+}
+
+static void xattrfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+				const char *name, mode_t mode)
+{
+	if (is_ctl(parent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	reply_new_entry(req, parent, name,
+			mkdirat(ll_fd(ll_fs(req), parent), name, mode));
+}
+
+static void xattrfs_ll_symlink(fuse_req_t req, const char *link,
+				fuse_ino_t parent, const char *name)
+{
+	if (is_ctl(parent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	reply_new_entry(req, parent, name,
+			symlinkat(link, ll_fd(ll_fs(req), parent), name));
+}
+
+static void xattrfs_ll_link(fuse_req_t req, fuse_ino_t ino,
+				fuse_ino_t newparent, const char *newname)
+{
+	char buf[64];
+	struct ll_fs *fs = ll_fs(req);
+
+	if (is_ctl(ino) || is_ctl(newparent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	xattrfs_touch(fs->ctx, ll_inode(fs, ino)->ino);
+
+	reply_new_entry(req, newparent, newname,
+			linkat(AT_FDCWD, procname(ll_fd(fs, ino), buf),
+			       ll_fd(fs, newparent), newname,
+			       AT_SYMLINK_FOLLOW));
+}
+
+static void xattrfs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+				const char *name)
+{
+	int ret = 0;
+	struct ll_fs *fs = ll_fs(req);
+	struct stat sb;
+
+	if (is_ctl(parent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	ret = fstatat(ll_fd(fs, parent), name, &sb, AT_SYMLINK_NOFOLLOW);
+	if (ret == 0)
+		ret = unlinkat(ll_fd(fs, parent), name, 0);
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	xattrfs_purge_unlinked(fs->ctx, &sb);
+
+	fuse_reply_err(req, 0);
+}
+
+static void xattrfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+				const char *name)
+{
+	int ret = 0;
+	struct ll_fs *fs = ll_fs(req);
+	struct stat sb;
+
+	if (is_ctl(parent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	ret = fstatat(ll_fd(fs, parent), name, &sb, AT_SYMLINK_NOFOLLOW);
+	if (ret == 0)
+		ret = unlinkat(ll_fd(fs, parent), name, AT_REMOVEDIR);
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	xattrfs_purge_unlinked(fs->ctx, &sb);
+
+	fuse_reply_err(req, 0);
+}
+
+static void xattrfs_ll_rename(fuse_req_t req, fuse_ino_t parent,
+				const char *name, fuse_ino_t newparent,
+				const char *newname)
+{
+	int ret = 0;
+	int replaced;
+	struct ll_fs *fs = ll_fs(req);
+	struct stat sb, target;
+
+	if (is_ctl(parent) || is_ctl(newparent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	if (fstatat(ll_fd(fs, parent), name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	replaced = 0 == fstatat(ll_fd(fs, newparent), newname, &target,
+				AT_SYMLINK_NOFOLLOW) &&
+		   target.st_ino != sb.st_ino;
+
+	xattrfs_touch(fs->ctx, sb.st_ino);
+
+	ret = renameat(ll_fd(fs, parent), name, ll_fd(fs, newparent), newname);
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	if (replaced)
+		xattrfs_purge_unlinked(fs->ctx, &target);
+
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * with -o kernel_cache, the kernel keeps the pages of a file across opens, as
+ * long as its size and mtime are what we saw when it was last closed. so a
+ * change made directly in the base directory drops the cache at the next open.
+ */
+
+static int cache_valid(struct ll_fs *fs, struct ll_inode *inode, int fd)
+{
+	int ret = 0;
+	struct stat st;
+
+	if (!fs->ctx->kernel_cache || fstat(fd, &st) < 0)
+		return 0;
+
+	pthread_mutex_lock(&fs->lock);
+	ret = inode->size == st.st_size &&
+	      inode->mtime.tv_sec == st.st_mtim.tv_sec &&
+	      inode->mtime.tv_nsec == st.st_mtim.tv_nsec;
+	inode->size = st.st_size;
+	inode->mtime = st.st_mtim;
+	pthread_mutex_unlock(&fs->lock);
+
+	return ret;
+}
+
+static void xattrfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
+{
+	int ret = 0;
+	int fd;
+	char buf[PATH_MAX];
+
+	if (is_ctl(ino)) {
+		ret = xattrfs_ctl_path((ino_t) ino, buf, sizeof(buf));
+		if (!ret)
+			ret = xattrfs_ctl_open(ll_fs(req)->ctx, buf, fi);
+
+		if (ret)
+			fuse_reply_err(req, -ret);
+		else
+			fuse_reply_open(req, fi);
+		return;
+	}
+
+	fd = open(procname(ll_fd(ll_fs(req), ino), buf),
+		  fi->flags & ~O_NOFOLLOW);
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fi->fh = fd;
+	fi->keep_cache = cache_valid(ll_fs(req), ll_inode(ll_fs(req), ino), fd);
+	fuse_reply_open(req, fi);
+}
+
+static void xattrfs_ll_create(fuse_req_t req, fuse_ino_t parent,
+				const char *name, mode_t mode,
+				struct fuse_file_info *fi)
+{
+	int ret = 0;
+	int fd;
+	struct fuse_entry_param e;
+	struct ll_fs *fs = ll_fs(req);
+
+	if (is_ctl(parent)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	fd = openat(ll_fd(fs, parent), name,
+		    (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	ret = do_lookup(fs, parent, name, &e);
+	if (ret) {
+		close(fd);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fi->fh = fd;
+	fuse_reply_create(req, &e, fi);
+}
+
+/* replies with the backing file, which fuse splices from if it can */
+static void xattrfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t off, struct fuse_file_info *fi)
+{
+	int ret = 0;
+	char *buf;
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+
+	if (!is_ctl(ino)) {
+		src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src.buf[0].fd = fi->fh;
+		src.buf[0].pos = off;
+
+		fuse_reply_data(req, &src, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	buf = malloc(size ? size : 1);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = xattrfs_ctl_read(NULL, buf, size, off, fi);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+
+	free(buf);
+}
+
+static void xattrfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_bufvec *buf, off_t off,
+				struct fuse_file_info *fi)
+{
+	ssize_t ret;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	if (is_ctl(ino)) {
+		ret = xattrfs_ctl_write(ll_fs(req)->ctx, fuse_buf_size(buf),
+					fi);
+		if (ret < 0)
+			fuse_reply_err(req, -ret);
+		else
+			fuse_reply_write(req, ret);
+		return;
+	}
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = off;
+
+	ret = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void xattrfs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
+{
+	/** this is called upon each close() call */
+	fuse_reply_err(req, 0);
+}
+
+static void xattrfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
+{
+	if (is_ctl(ino))
+		xattrfs_ctl_release(NULL, fi);
+	else {
+		/* our own writes are in the kernel cache already */
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			cache_valid(ll_fs(req), ll_inode(ll_fs(req), ino),
+				    fi->fh);
+		close(fi->fh);
+	}
+
+	fuse_reply_err(req, 0);
+}
+
+static void xattrfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+				struct fuse_file_info *fi)
+{
+	int ret = 0;
+
+	if (is_ctl(ino)) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+#ifdef HAVE_FDATASYNC
+	if (datasync)
+		ret = fdatasync(fi->fh);
+	else
+#endif
+		ret = fsync(fi->fh);
+
+	fuse_reply_err(req, ret < 0 ? errno : 0);
+}
+
+static void xattrfs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
+{
+	int fd;
+	struct ll_dirp *d;
+
+	if (is_ctl(ino)) {
+		if (ino != XATTRFS_CTL_INO(0)) {
+			fuse_reply_err(req, ENOTDIR);
+			return;
+		}
+		fi->fh = 0;
+		fuse_reply_open(req, fi);
+		return;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (!d) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fd = openat(ll_fd(ll_fs(req), ino), ".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || !(d->dp = fdopendir(fd))) {
+		fuse_reply_err(req, errno);
+		if (fd >= 0)
+			close(fd);
+		free(d);
+		return;
+	}
+
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
+}
+
+static void xattrfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t off, struct fuse_file_info *fi)
+{
+	char *buf, *p;
+	size_t rem = size;
+	struct ll_dirp *d = (struct ll_dirp *) (uintptr_t) fi->fh;
+
+	if (is_ctl(ino)) {
+		ctl_readdir(req, size, off);
+		return;
+	}
+
+	buf = p = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (off != d->offset) {
+		seekdir(d->dp, off);
+		d->entry = NULL;
+		d->offset = off;
+	}
+
+	for (;;) {
+		size_t len;
+		off_t next;
+		struct stat st;
+
+		if (!d->entry) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (!d->entry) {
+				if (errno && rem == size) {
+					fuse_reply_err(req, errno);
+					free(buf);
+					return;
+				}
+				break;
+			}
+		}
+
+		xattrfs_dirent_stat(d->dp, d->entry, &st);
+		next = telldir(d->dp);
+
+		len = fuse_add_direntry(req, p, rem, d->entry->d_name,
+					&st, next);
+		if (len > rem)
+			break;		/* the entry waits for the next call */
+
+		p += len;
+		rem -= len;
+		d->entry = NULL;
+		d->offset = next;
+	}
+
+	fuse_reply_buf(req, buf, size - rem);
+	free(buf);
+}
+
+static void xattrfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info *fi)
+{
+	struct ll_dirp *d = (struct ll_dirp *) (uintptr_t) fi->fh;
+
+	if (d) {
+		closedir(d->dp);
+		free(d);
+	}
+
+	fuse_reply_err(req, 0);
+}
+
+static void xattrfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+				struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, 0);
+}
+
+static void xattrfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs vfs;
+	struct ll_fs *fs = ll_fs(req);
+
+	if (fstatvfs(is_ctl(ino) ? fs->root.fd : ll_fd(fs, ino), &vfs) < 0)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &vfs);
+}
+
+static void xattrfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	int ret = 0;
+	char buf[PATH_MAX];
+	struct ll_fs *fs = ll_fs(req);
+
+	if (is_ctl(ino)) {
+		ret = xattrfs_ctl_path((ino_t) ino, buf, sizeof(buf));
+		if (!ret)
+			ret = xattrfs_ctl_access(fs->ctx, buf, mask);
+	}
+	else if (access(procname(ll_fd(fs, ino), buf), mask) < 0)
+		ret = -errno;
+
+	fuse_reply_err(req, -ret);
+}
+
+/**
+ * extended attributes go straight to the xdb with the inode number of the
+ * node, without any path lookup.
+ */
+
+static struct xdb *get_xdb(fuse_req_t req, fuse_ino_t ino)
+{
+	struct xdb *xdb = ll_fs(req)->ctx->xdb;
+
+	if (is_ctl(ino))
+		fuse_reply_err(req, ENOTSUP);
+	else if (!xdb)
+		fuse_reply_err(req, EIO);
+	else
+		return xdb;
+
+	return NULL;
+}
+
+static void xattrfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino,
+				const char *name, const char *value,
+				size_t size, int flags)
+{
+	int ret = 0;
+	char buf[64];
+	struct xdb *xdb = get_xdb(req, ino);
+	struct ll_fs *fs = ll_fs(req);
+	struct ll_inode *inode;
+
+	if (!xdb)
+		return;
+
+	inode = ll_inode(fs, ino);
+	xattrfs_touch(fs->ctx, inode->ino);
+
+	if (fs->ctx->tiered)
+		ret = xattrfs_tier_setxattr(fs->ctx, procname(inode->fd, buf),
+					    1, inode->ino, name, value, size,
+					    flags);
+	else
+		ret = xdb_setxattr(xdb, inode->ino, name, value, size, flags);
+
+	fuse_reply_err(req, -ret);
+}
+
+static void xattrfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino,
+				const char *name, size_t size)
+{
+	int ret = 0;
+	char buf[64];
+	char *value = NULL;
+	struct xdb *xdb = get_xdb(req, ino);
+	struct ll_fs *fs = ll_fs(req);
+	struct ll_inode *inode;
+
+	if (!xdb)
+		return;
+
+	if (size && !(value = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	inode = ll_inode(fs, ino);
+
+	if (fs->ctx->tiered)
+		ret = xattrfs_tier_getxattr(fs->ctx, procname(inode->fd, buf),
+					    1, inode->ino, name, value, size);
+	else
+		ret = xdb_getxattr(xdb, inode->ino, name, value, size);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (size)
+		fuse_reply_buf(req, value, ret);
+	else
+		fuse_reply_xattr(req, ret);
+
+	free(value);
+}
+
+static void xattrfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	int ret = 0;
+	char buf[64];
+	char *list = NULL;
+	struct xdb *xdb = get_xdb(req, ino);
+	struct ll_fs *fs = ll_fs(req);
+	struct ll_inode *inode;
+
+	if (!xdb)
+		return;
+
+	if (size && !(list = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	inode = ll_inode(fs, ino);
+
+	if (fs->ctx->tiered)
+		ret = xattrfs_tier_listxattr(fs->ctx, procname(inode->fd, buf),
+					     1, inode->ino, list, size);
+	else
+		ret = xdb_listxattr(xdb, inode->ino, list, size);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (size)
+		fuse_reply_buf(req, list, ret);
+	else
+		fuse_reply_xattr(req, ret);
+
+	free(list);
+}
+
+static void xattrfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino,
+				const char *name)
+{
+	int ret = 0;
+	char buf[64];
+	struct xdb *xdb = get_xdb(req, ino);
+	struct ll_fs *fs = ll_fs(req);
+	struct ll_inode *inode;
+
+	if (!xdb)
+		return;
+
+	inode = ll_inode(fs, ino);
+
+	if (fs->ctx->tiered)
+		ret = xattrfs_tier_removexattr(fs->ctx,
+					       procname(inode->fd, buf), 1,
+					       inode->ino, name);
+	else
+		ret = xdb_removexattr(xdb, inode->ino, name);
+
+	fuse_reply_err(req, -ret);
+}
+
+static struct fuse_lowlevel_ops xattrfs_ll_ops = {
+	.init		= xattrfs_ll_init,
+	.destroy	= xattrfs_ll_destroy,
+	.lookup		= xattrfs_ll_lookup,
+	.forget		= xattrfs_ll_forget,
+	.forget_multi	= xattrfs_ll_forget_multi,
+	.getattr	= xattrfs_ll_getattr,
+	.setattr	= xattrfs_ll_setattr,
+	.readlink	= xattrfs_ll_readlink,
+	.mknod		= xattrfs_ll_mknod,
+	.mkdir		= xattrfs_ll_mkdir,
+	.unlink		= xattrfs_ll_unlink,
+	.rmdir		= xattrfs_ll_rmdir,
+	.symlink	= xattrfs_ll_symlink,
+	.rename		= xattrfs_ll_rename,
+	.link		= xattrfs_ll_link,
+	.open		= xattrfs_ll_open,
+	.create		= xattrfs_ll_create,
+	.read		= xattrfs_ll_read,
+	.write_buf	= xattrfs_ll_write_buf,
+	.flush		= xattrfs_ll_flush,
+	.release	= xattrfs_ll_release,
+	.fsync		= xattrfs_ll_fsync,
+	.opendir	= xattrfs_ll_opendir,
+	.readdir	= xattrfs_ll_readdir,
+	.releasedir	= xattrfs_ll_releasedir,
+	.fsyncdir	= xattrfs_ll_fsyncdir,
+	.statfs		= xattrfs_ll_statfs,
+	.access		= xattrfs_ll_access,
+	.setxattr	= xattrfs_ll_setxattr,
+	.getxattr	= xattrfs_ll_getxattr,
+	.listxattr	= xattrfs_ll_listxattr,
+	.removexattr	= xattrfs_ll_removexattr,
+};
+
+static int ll_fs_init(struct ll_fs *fs, struct xattrfs_ctx *ctx)
+{
+	struct stat st;
+
+	memset(fs, 0, sizeof(*fs));
+	fs->ctx = ctx;
+
+	fs->root.fd = open(ctx->fsroot, O_PATH);
+	if (fs->root.fd < 0)
+		return -errno;
+
+	if (fstat(fs->root.fd, &st) < 0) {
+		close(fs->root.fd);
+		return -errno;
+	}
+
+	fs->root.ino = st.st_ino;
+	fs->root.dev = st.st_dev;
+
+	fs->nbuckets = LL_HASH_MIN;
+	fs->table = calloc(fs->nbuckets, sizeof(*fs->table));
+	if (!fs->table) {
+		close(fs->root.fd);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&fs->lock, NULL);
+
+	return 0;
+}
+
+static void ll_fs_exit(struct ll_fs *fs)
+{
+	unsigned long i;
+
+	for (i = 0; i < fs->nbuckets; i++) {
+		struct ll_inode *inode, *next;
+
+		for (inode = fs->table[i]; inode; inode = next) {
+			next = inode->next;
+			close(inode->fd);
+			free(inode);
+		}
+	}
+
+	free(fs->table);
+	pthread_mutex_destroy(&fs->lock);
+	close(fs->root.fd);
+}
+
+/**
+ * external interface
+ */
+
+int xattrfs_ll_main(struct fuse_args *args, struct xattrfs_ctx *ctx)
+{
+	int ret = -1;
+	int multithreaded, foreground;
+	char *mountpoint = NULL;
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	struct ll_fs fs;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+			       &foreground) < 0)
+		return 1;
+
+	ret = ll_fs_init(&fs, ctx);
+	if (ret) {
+		fprintf(stderr, "failed to open %s: %s\n", ctx->fsroot,
+				strerror(-ret));
+		free(mountpoint);
+		return 1;
+	}
+
+	ret = -1;
+
+	ch = fuse_mount(mountpoint, args);
+	if (!ch)
+		goto out;
+
+	se = fuse_lowlevel_new(args, &xattrfs_ll_ops, sizeof(xattrfs_ll_ops),
+			       &fs);
+	if (se) {
+		fs.se = se;
+		if (fuse_set_signal_handlers(se) != -1) {
+			fuse_session_add_chan(se, ch);
+			fuse_daemonize(foreground);
+
+			if (multithreaded)
+				ret = fuse_session_loop_mt(se);
+			else
+				ret = fuse_session_loop(se);
+
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		fuse_session_destroy(se);
+	}
+
+	fuse_unmount(mountpoint, ch);
+
+out:
+	ll_fs_exit(&fs);
+	free(mountpoint);
+	free((void *) ctx->fsroot);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,294 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * operation metrics: call, error and busy retry counters and latency
+ * histograms of each operation. every thread counts in its own slots, which
+ * only it writes, so the hot path takes no lock and shares no cache line;
+ * the slots of all threads are summed when the metrics are shown. the slots
+ * of an exiting thread are folded into the retired ones.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "xattrfs.h"
+
+/* le 1us, 2us, 4us, .. 4.2s, +Inf */
+#define XM_BUCKETS		24
+
+struct xm_op {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t busy;			/* SQLITE_BUSY retries */
+	uint64_t nsec;
+	uint64_t buckets[XM_BUCKETS];
+};
+
+struct xm_thread {
+	struct xm_thread *next;
+	struct xm_thread *prev;
+	int cur;			/* the xdb op in progress, or -1 */
+	struct xm_op ops[N_XM];
+};
+
+static const char *xm_names[N_XM] = {
+	"getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir", "symlink",
+	"rename", "link", "chmod", "chown", "truncate", "utime", "open",
+	"read", "write", "statfs", "flush", "release", "fsync", "setxattr",
+	"getxattr", "listxattr", "removexattr", "opendir", "readdir",
+	"releasedir", "fsyncdir", "access", "ftruncate", "fgetattr",
+	"utimens", "read_buf", "write_buf",
+
+	"getxattr", "setxattr", "removexattr", "listxattr", "purge", "scan",
+	"query", "dentry_add", "dentry_remove", "dentry_lookup", "transaction",
+};
+
+static pthread_mutex_t xm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t xm_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xm_key;
+static struct xm_thread *xm_threads;	/* live threads */
+static struct xm_thread xm_retired;	/* exited threads */
+static struct xm_thread xm_base;	/* at the last reset */
+
+static __thread struct xm_thread *xm_self;
+
+/* only the owner writes, readers may see a stale but never a torn value */
+static inline void xm_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+static inline uint64_t xm_get(uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void xm_sum(struct xm_thread *dst, struct xm_thread *src)
+{
+	int i, j;
+
+	for (i = 0; i < N_XM; i++) {
+		dst->ops[i].calls += xm_get(&src->ops[i].calls);
+		dst->ops[i].errors += xm_get(&src->ops[i].errors);
+		dst->ops[i].busy += xm_get(&src->ops[i].busy);
+		dst->ops[i].nsec += xm_get(&src->ops[i].nsec);
+		for (j = 0; j < XM_BUCKETS; j++)
+			dst->ops[i].buckets[j] +=
+				xm_get(&src->ops[i].buckets[j]);
+	}
+}
+
+static void xm_exit_thread(void *arg)
+{
+	struct xm_thread *t = arg;
+
+	pthread_mutex_lock(&xm_lock);
+	xm_sum(&xm_retired, t);
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		xm_threads = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	pthread_mutex_unlock(&xm_lock);
+
+	free(t);
+}
+
+static void xm_init_once(void)
+{
+	pthread_key_create(&xm_key, xm_exit_thread);
+}
+
+static struct xm_thread *xm_thread(void)
+{
+	struct xm_thread *t = xm_self;
+
+	if (t)
+		return t;
+
+	pthread_once(&xm_once, xm_init_once);
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->cur = -1;
+
+	pthread_mutex_lock(&xm_lock);
+	t->next = xm_threads;
+	if (xm_threads)
+		xm_threads->prev = t;
+	xm_threads = t;
+	pthread_mutex_unlock(&xm_lock);
+
+	pthread_setspecific(xm_key, t);
+	xm_self = t;
+
+	return t;
+}
+
+static inline uint64_t xm_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the first bucket with 2^i usec >= @nsec */
+static inline int xm_bucket(uint64_t nsec)
+{
+	uint64_t usec = nsec ? (nsec - 1) / 1000 : 0;
+	int i = usec ? 64 - __builtin_clzll(usec) : 0;
+
+	return i < XM_BUCKETS - 1 ? i : XM_BUCKETS - 1;
+}
+
+/**
+ * external interface
+ */
+
+uint64_t xattrfs_metrics_begin(int op)
+{
+	struct xm_thread *t = xm_thread();
+
+	if (t && op >= XM_XDB_FIRST)
+		t->cur = op;
+
+	return xm_now();
+}
+
+void xattrfs_metrics_end(int op, uint64_t start, int ret)
+{
+	uint64_t nsec = xm_now() - start;
+	struct xm_thread *t = xm_thread();
+	struct xm_op *o;
+
+	if (!t)
+		return;
+
+	o = &t->ops[op];
+	xm_add(&o->calls, 1);
+	xm_add(&o->nsec, nsec);
+	xm_add(&o->buckets[xm_bucket(nsec)], 1);
+
+	/* a missing file or xattr is an answer, not a failure */
+	if (ret < 0 && ret != -ENOENT && ret != -ENODATA)
+		xm_add(&o->errors, 1);
+
+	if (op >= XM_XDB_FIRST)
+		t->cur = -1;
+}
+
+/* counted against the xdb op in progress on this thread */
+void xattrfs_metrics_busy(void)
+{
+	struct xm_thread *t = xm_thread();
+
+	if (t && t->cur >= 0)
+		xm_add(&t->ops[t->cur].busy, 1);
+}
+
+static void xm_total(struct xm_thread *total)
+{
+	struct xm_thread *t;
+
+	memset(total, 0, sizeof(*total));
+	xm_sum(total, &xm_retired);
+	for (t = xm_threads; t; t = t->next)
+		xm_sum(total, t);
+}
+
+void xattrfs_metrics_reset(void)
+{
+	pthread_mutex_lock(&xm_lock);
+	xm_total(&xm_base);
+	pthread_mutex_unlock(&xm_lock);
+}
+
+static void show_family(FILE *fp, struct xm_thread *m, const char *prefix,
+			int first, int last)
+{
+	int i, j;
+	uint64_t n;
+	struct xm_op *o;
+
+	fprintf(fp, "# TYPE %s_calls_total counter\n", prefix);
+	for (i = first; i < last; i++)
+		if (m->ops[i].calls)
+			fprintf(fp, "%s_calls_total{op=\"%s\"} %llu\n",
+				prefix, xm_names[i], _llu(m->ops[i].calls));
+
+	fprintf(fp, "# TYPE %s_errors_total counter\n", prefix);
+	for (i = first; i < last; i++)
+		if (m->ops[i].calls)
+			fprintf(fp, "%s_errors_total{op=\"%s\"} %llu\n",
+				prefix, xm_names[i], _llu(m->ops[i].errors));
+
+	if (first >= XM_XDB_FIRST) {
+		fprintf(fp, "# TYPE %s_busy_retries_total counter\n", prefix);
+		for (i = first; i < last; i++)
+			if (m->ops[i].calls)
+				fprintf(fp, "%s_busy_retries_total{op=\"%s\"} "
+					"%llu\n", prefix, xm_names[i],
+					_llu(m->ops[i].busy));
+	}
+
+	fprintf(fp, "# TYPE %s_duration_seconds histogram\n", prefix);
+	for (i = first; i < last; i++) {
+		o = &m->ops[i];
+		if (!o->calls)
+			continue;
+
+		for (j = 0, n = 0; j < XM_BUCKETS - 1; j++) {
+			n += o->buckets[j];
+			fprintf(fp, "%s_duration_seconds_bucket{op=\"%s\","
+				"le=\"%.6f\"} %llu\n", prefix, xm_names[i],
+				(double) (1ULL << j) / 1e6, _llu(n));
+		}
+		fprintf(fp, "%s_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} "
+			"%llu\n", prefix, xm_names[i], _llu(o->calls));
+		fprintf(fp, "%s_duration_seconds_sum{op=\"%s\"} %.9f\n",
+			prefix, xm_names[i], o->nsec / 1e9);
+		fprintf(fp, "%s_duration_seconds_count{op=\"%s\"} %llu\n",
+			prefix, xm_names[i], _llu(o->calls));
+	}
+}
+
+int xattrfs_metrics_show(FILE *fp)
+{
+	int i, j;
+	struct xm_thread *m;
+
+	m = malloc(sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&xm_lock);
+	xm_total(m);
+	for (i = 0; i < N_XM; i++) {
+		m->ops[i].calls -= xm_base.ops[i].calls;
+		m->ops[i].errors -= xm_base.ops[i].errors;
+		m->ops[i].busy -= xm_base.ops[i].busy;
+		m->ops[i].nsec -= xm_base.ops[i].nsec;
+		for (j = 0; j < XM_BUCKETS; j++)
+			m->ops[i].buckets[j] -= xm_base.ops[i].buckets[j];
+	}
+	pthread_mutex_unlock(&xm_lock);
+
+	show_family(fp, m, "xattrfs_fuse_op", 0, XM_XDB_FIRST);
+	show_family(fp, m, "xattrfs_xdb_op", XM_XDB_FIRST, N_XM);
+
+	free(m);
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * name map: the ids of the xattr names of a shard (xdb_name), so that a
+ * lookup binds the id it already knows instead of joining xdb_name. there is
+ * one map per shard, since each shard numbers its names by itself.
+ *
+ * an entry is only a hint of what the database has: the writer adds the names
+ * it interns before their transaction commits, and drops the whole map when a
+ * transaction rolls back. a reader that finds the id of an uncommitted name
+ * finds no row with it, as it would with the name. ids are never reused by a
+ * process (see name_id() in xattrfs-xdb.c), so a stale id matches nothing.
+ *
+ * names are few, so the map keeps every one it is given, up to NAMES_MAX.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "xattrfs.h"
+
+#define NAMES_MIN_BUCKETS	64
+#define NAMES_MAX		65536
+
+struct names_entry {
+	struct names_entry *next;
+	uint32_t hash;
+	int64_t id;
+	char name[];
+};
+
+struct xdb_names {
+	pthread_rwlock_t lock;
+	struct names_entry **buckets;
+	unsigned int nbuckets;
+	unsigned int count;
+};
+
+static inline uint32_t hash_name(const char *name)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	while (*name) {
+		h ^= (uint8_t) *name++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static struct names_entry *find(struct xdb_names *names, uint32_t hash,
+				const char *name)
+{
+	struct names_entry *e;
+
+	for (e = names->buckets[hash & (names->nbuckets - 1)]; e; e = e->next)
+		if (e->hash == hash && 0 == strcmp(e->name, name))
+			return e;
+
+	return NULL;
+}
+
+/* doubles the buckets, or leaves them if there is no memory */
+static void grow(struct xdb_names *names)
+{
+	unsigned int i, n = names->nbuckets << 1;
+	struct names_entry **buckets = calloc(n, sizeof(*buckets));
+	struct names_entry *e, *next;
+
+	if (!buckets)
+		return;
+
+	for (i = 0; i < names->nbuckets; i++) {
+		for (e = names->buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (n - 1)];
+			buckets[e->hash & (n - 1)] = e;
+		}
+	}
+
+	free(names->buckets);
+	names->buckets = buckets;
+	names->nbuckets = n;
+}
+
+static void drop_all(struct xdb_names *names)
+{
+	unsigned int i;
+	struct names_entry *e, *next;
+
+	for (i = 0; i < names->nbuckets; i++) {
+		for (e = names->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+		names->buckets[i] = NULL;
+	}
+
+	names->count = 0;
+}
+
+/**
+ * external interface
+ */
+
+int xdb_names_init(struct xdb_names **names)
+{
+	struct xdb_names *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return -ENOMEM;
+
+	self->buckets = calloc(NAMES_MIN_BUCKETS, sizeof(*self->buckets));
+	if (!self->buckets) {
+		free(self);
+		return -ENOMEM;
+	}
+
+	pthread_rwlock_init(&self->lock, NULL);
+	self->nbuckets = NAMES_MIN_BUCKETS;
+
+	*names = self;
+
+	return 0;
+}
+
+void xdb_names_exit(struct xdb_names *names)
+{
+	drop_all(names);
+	pthread_rwlock_destroy(&names->lock);
+	free(names->buckets);
+	free(names);
+}
+
+/* the id of @name, or 0 if it is not in the map */
+int64_t xdb_names_lookup(struct xdb_names *names, const char *name)
+{
+	int64_t id = 0;
+	struct names_entry *e;
+
+	pthread_rwlock_rdlock(&names->lock);
+	e = find(names, hash_name(name), name);
+	if (e)
+		id = e->id;
+	pthread_rwlock_unlock(&names->lock);
+
+	return id;
+}
+
+void xdb_names_insert(struct xdb_names *names, const char *name, int64_t id)
+{
+	uint32_t hash = hash_name(name);
+	size_t len = strlen(name) + 1;
+	struct names_entry *e;
+
+	pthread_rwlock_wrlock(&names->lock);
+
+	if (names->count >= NAMES_MAX || find(names, hash, name))
+		goto out;
+
+	e = malloc(sizeof(*e) + len);
+	if (!e)
+		goto out;
+
+	e->hash = hash;
+	e->id = id;
+	memcpy(e->name, name, len);
+
+	if (names->count >= names->nbuckets)
+		grow(names);
+
+	e->next = names->buckets[hash & (names->nbuckets - 1)];
+	names->buckets[hash & (names->nbuckets - 1)] = e;
+	names->count++;
+out:
+	pthread_rwlock_unlock(&names->lock);
+}
+
+/* after a rollback, which may have taken names of the map with it */
+void xdb_names_clear(struct xdb_names *names)
+{
+	pthread_rwlock_wrlock(&names->lock);
+	drop_all(names);
+	pthread_rwlock_unlock(&names->lock);
+}
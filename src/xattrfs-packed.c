@@ -0,0 +1,194 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * packed records (-o layout=packed): every xattr of an inode in one value of
+ * xdb_packed, so that a single fetch has them all. a record is a run of
+ * entries, in the order their names were added:
+ *
+ *	u8	nid, with PACKED_BLOB if the value is in xdb_blob
+ *	u8	length of the name, without the namespace
+ *	u32	size of the value
+ *	name
+ *	value, or the u64 bid of the value in xdb_blob
+ *
+ * the numbers are little endian, and a replaced entry keeps its place.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "xattrfs.h"
+
+#define PACKED_BLOB		0x80
+#define PACKED_HEADER		6
+
+static inline uint32_t get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+	       (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/**
+ * external interface
+ */
+
+/* the bytes of an entry, or 0 if it cannot be packed */
+size_t xdb_packed_len(size_t namelen, size_t size, int blob)
+{
+	if (namelen > UINT8_MAX || size > UINT32_MAX)
+		return 0;
+
+	return PACKED_HEADER + namelen + (blob ? sizeof(uint64_t) : size);
+}
+
+/* writes an entry at @p, which has room for xdb_packed_len() bytes */
+size_t xdb_packed_put(unsigned char *p, int nid, const char *name,
+			size_t namelen, const void *value, size_t size,
+			int blob, int64_t bid)
+{
+	p[0] = nid | (blob ? PACKED_BLOB : 0);
+	p[1] = namelen;
+	put32(&p[2], size);
+	memcpy(&p[PACKED_HEADER], name, namelen);
+
+	p += PACKED_HEADER + namelen;
+	if (blob) {
+		put32(p, (uint64_t) bid);
+		put32(&p[4], (uint64_t) bid >> 32);
+	}
+	else if (size)
+		memcpy(p, value, size);
+
+	return xdb_packed_len(namelen, size, blob);
+}
+
+/**
+ * the entry at *@pos of @rec, which moves *@pos past it. returns 1, 0 at the
+ * end of the record, or -EIO if the entry runs over it.
+ */
+int xdb_packed_next(const unsigned char *rec, size_t len, size_t *pos,
+			struct xdb_packed_entry *e)
+{
+	const unsigned char *p = &rec[*pos];
+
+	if (*pos >= len)
+		return 0;
+
+	if (len - *pos < PACKED_HEADER)
+		return -EIO;
+
+	e->off = *pos;
+	e->nid = p[0] & ~PACKED_BLOB;
+	e->blob = !!(p[0] & PACKED_BLOB);
+	e->namelen = p[1];
+	e->size = get32(&p[2]);
+	e->name = (const char *) &p[PACKED_HEADER];
+	e->voff = *pos + PACKED_HEADER + e->namelen;
+	e->len = xdb_packed_len(e->namelen, e->size, e->blob);
+
+	if (e->len > len - *pos)
+		return -EIO;
+
+	*pos += e->len;
+
+	return 1;
+}
+
+/* returns 1 if @rec has the name @nid.@name, 0 if not, or -EIO */
+int xdb_packed_find(const unsigned char *rec, size_t len, int nid,
+			const char *name, struct xdb_packed_entry *e)
+{
+	int ret;
+	size_t pos = 0;
+	size_t namelen = strlen(name);
+
+	while ((ret = xdb_packed_next(rec, len, &pos, e)) == 1)
+		if (e->nid == nid && e->namelen == namelen &&
+		    0 == memcmp(e->name, name, namelen))
+			return 1;
+
+	return ret;
+}
+
+int64_t xdb_packed_bid(const unsigned char *rec,
+			const struct xdb_packed_entry *e)
+{
+	return (int64_t) ((uint64_t) get32(&rec[e->voff]) |
+			  (uint64_t) get32(&rec[e->voff + 4]) << 32);
+}
+
+void xdb_packed_set_bid(unsigned char *rec, const struct xdb_packed_entry *e,
+			int64_t bid)
+{
+	put32(&rec[e->voff], (uint64_t) bid);
+	put32(&rec[e->voff + 4], (uint64_t) bid >> 32);
+}
+
+static const unsigned char *unpack_find(sqlite3_value **argv,
+					struct xdb_packed_entry *e)
+{
+	const unsigned char *rec = sqlite3_value_blob(argv[0]);
+	const char *name = (const char *) sqlite3_value_text(argv[2]);
+
+	if (!rec || !name || xdb_packed_find(rec, sqlite3_value_bytes(argv[0]),
+					     sqlite3_value_int(argv[1]), name,
+					     e) != 1)
+		return NULL;
+
+	return rec;
+}
+
+/**
+ * xdb_unpack(rec, nid, name): the value of a name in a record, for the
+ * queries. like xdb_xattr.value, it is the size of a value in xdb_blob.
+ */
+static void unpack(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	struct xdb_packed_entry e;
+	const unsigned char *rec = unpack_find(argv, &e);
+
+	if (!rec)
+		return;
+
+	if (e.blob)
+		sqlite3_result_int64(ctx, e.size);
+	else
+		sqlite3_result_blob(ctx, &rec[e.voff], (int) e.size,
+				    SQLITE_TRANSIENT);
+}
+
+/* xdb_unpack_bid(rec, nid, name): the bid of a value in xdb_blob, or NULL */
+static void unpack_bid(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	struct xdb_packed_entry e;
+	const unsigned char *rec = unpack_find(argv, &e);
+
+	if (rec && e.blob)
+		sqlite3_result_int64(ctx, xdb_packed_bid(rec, &e));
+}
+
+int xdb_packed_register(sqlite3 *db)
+{
+	int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+
+	if (sqlite3_create_function(db, "xdb_unpack", 3, flags, NULL, unpack,
+				    NULL, NULL) != SQLITE_OK ||
+	    sqlite3_create_function(db, "xdb_unpack_bid", 3, flags, NULL,
+				    unpack_bid, NULL, NULL) != SQLITE_OK)
+		return -EIO;
+
+	return 0;
+}
@@ -0,0 +1,312 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * path cache: maps a path under the mount to the inode number of the base
+ * file, so that the xattr operations do not walk the path with stat() again.
+ * getattr fills it, and the namespace operations invalidate it.
+ *
+ * renaming a directory changes the inode of every path below it, so instead
+ * of searching for them, it bumps the generation, which invalidates every
+ * entry at once. entries also expire after a ttl, in case the base directory
+ * is changed behind our back.
+ *
+ * like the value cache, a miss (or xattrfs_pcache_seq()) returns the shard
+ * sequence number, and the insert after stat() is dropped if the shard has
+ * been invalidated in between.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "xattrfs.h"
+
+#define PCACHE_SHARDS		64
+
+struct pcache_entry {
+	struct pcache_entry *hnext;
+	struct pcache_entry *prev;	/* LRU, most recent first */
+	struct pcache_entry *next;
+	uint32_t hash;
+	ino_t ino;
+	uint64_t gen;
+	time_t expire;
+	char path[];
+};
+
+struct pcache_shard {
+	pthread_mutex_t lock;
+	struct pcache_entry **buckets;
+	unsigned int nbuckets;
+	struct pcache_entry lru;	/* sentinel */
+	unsigned long count;
+	unsigned long limit;
+	uint64_t seq;			/* bumped on each invalidation */
+} __attribute__((aligned(64)));
+
+struct xattrfs_pcache {
+	uint64_t gen;
+	time_t ttl;
+	struct pcache_shard shards[PCACHE_SHARDS];
+};
+
+static inline uint32_t hash_path(const char *path)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	while (*path) {
+		h ^= (uint8_t) *path++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static inline time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static inline struct pcache_shard *get_shard(struct xattrfs_pcache *pc,
+						uint32_t hash)
+{
+	return &pc->shards[hash % PCACHE_SHARDS];
+}
+
+static inline struct pcache_entry **get_bucket(struct pcache_shard *shard,
+						uint32_t hash)
+{
+	return &shard->buckets[(hash / PCACHE_SHARDS) &
+			       (shard->nbuckets - 1)];
+}
+
+static inline void lru_del(struct pcache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static inline void lru_add(struct pcache_shard *shard,
+			   struct pcache_entry *e)
+{
+	e->next = shard->lru.next;
+	e->prev = &shard->lru;
+	shard->lru.next->prev = e;
+	shard->lru.next = e;
+}
+
+static struct pcache_entry **find(struct pcache_shard *shard, uint32_t hash,
+				  const char *path)
+{
+	struct pcache_entry **pos;
+
+	for (pos = get_bucket(shard, hash); *pos; pos = &(*pos)->hnext) {
+		struct pcache_entry *e = *pos;
+
+		if (e->hash == hash && 0 == strcmp(e->path, path))
+			return pos;
+	}
+
+	return NULL;
+}
+
+static void drop(struct pcache_shard *shard, struct pcache_entry **pos)
+{
+	struct pcache_entry *e = *pos;
+
+	*pos = e->hnext;
+	lru_del(e);
+	shard->count--;
+	free(e);
+}
+
+/**
+ * external interface
+ */
+
+int xattrfs_pcache_init(struct xattrfs_pcache **pc, unsigned long size,
+			int ttl)
+{
+	int i;
+	unsigned int nbuckets = 16;
+	struct xattrfs_pcache *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return -ENOMEM;
+
+	while (nbuckets * PCACHE_SHARDS < size)
+		nbuckets <<= 1;
+
+	self->ttl = ttl;
+
+	for (i = 0; i < PCACHE_SHARDS; i++) {
+		struct pcache_shard *shard = &self->shards[i];
+
+		shard->buckets = calloc(nbuckets, sizeof(*shard->buckets));
+		if (!shard->buckets) {
+			xattrfs_pcache_exit(self);
+			return -ENOMEM;
+		}
+
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->nbuckets = nbuckets;
+		shard->lru.next = shard->lru.prev = &shard->lru;
+		shard->limit = size / PCACHE_SHARDS + 1;
+	}
+
+	*pc = self;
+
+	return 0;
+}
+
+void xattrfs_pcache_exit(struct xattrfs_pcache *pc)
+{
+	int i;
+
+	for (i = 0; i < PCACHE_SHARDS; i++) {
+		struct pcache_shard *shard = &pc->shards[i];
+		struct pcache_entry *e, *next;
+
+		if (!shard->buckets)
+			continue;
+
+		for (e = shard->lru.next; e != &shard->lru; e = next) {
+			next = e->next;
+			free(e);
+		}
+
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+
+	free(pc);
+}
+
+uint64_t xattrfs_pcache_seq(struct xattrfs_pcache *pc, const char *path)
+{
+	uint64_t seq;
+	struct pcache_shard *shard = get_shard(pc, hash_path(path));
+
+	pthread_mutex_lock(&shard->lock);
+	seq = shard->seq;
+	pthread_mutex_unlock(&shard->lock);
+
+	return seq;
+}
+
+int xattrfs_pcache_lookup(struct xattrfs_pcache *pc, const char *path,
+			ino_t *ino, uint64_t *seq)
+{
+	int ret = 0;
+	uint32_t hash = hash_path(path);
+	struct pcache_shard *shard = get_shard(pc, hash);
+	struct pcache_entry **pos;
+
+	pthread_mutex_lock(&shard->lock);
+
+	pos = find(shard, hash, path);
+	if (pos) {
+		struct pcache_entry *e = *pos;
+
+		if (e->gen != __atomic_load_n(&pc->gen, __ATOMIC_ACQUIRE) ||
+		    e->expire <= now())
+			drop(shard, pos);
+		else {
+			lru_del(e);
+			lru_add(shard, e);
+			*ino = e->ino;
+			ret = 1;
+		}
+	}
+
+	*seq = shard->seq;
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return ret;
+}
+
+void xattrfs_pcache_insert(struct xattrfs_pcache *pc, const char *path,
+			ino_t ino, uint64_t seq)
+{
+	uint32_t hash = hash_path(path);
+	struct pcache_shard *shard = get_shard(pc, hash);
+	size_t len = strlen(path) + 1;
+	struct pcache_entry **pos;
+	struct pcache_entry *e;
+
+	e = malloc(sizeof(*e) + len);
+	if (!e)
+		return;
+
+	e->hash = hash;
+	e->ino = ino;
+	e->expire = now() + pc->ttl;
+	memcpy(e->path, path, len);
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (seq != shard->seq) {
+		pthread_mutex_unlock(&shard->lock);
+		free(e);
+		return;
+	}
+
+	e->gen = __atomic_load_n(&pc->gen, __ATOMIC_ACQUIRE);
+
+	pos = find(shard, hash, path);
+	if (pos)
+		drop(shard, pos);
+
+	while (shard->count >= shard->limit)
+		drop(shard, find(shard, shard->lru.prev->hash,
+				 shard->lru.prev->path));
+
+	e->hnext = *get_bucket(shard, hash);
+	*get_bucket(shard, hash) = e;
+	lru_add(shard, e);
+	shard->count++;
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void xattrfs_pcache_invalidate(struct xattrfs_pcache *pc, const char *path)
+{
+	uint32_t hash = hash_path(path);
+	struct pcache_shard *shard = get_shard(pc, hash);
+	struct pcache_entry **pos;
+
+	pthread_mutex_lock(&shard->lock);
+
+	pos = find(shard, hash, path);
+	if (pos)
+		drop(shard, pos);
+
+	shard->seq++;
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* the shards first, so that no insert in flight gets the new generation */
+void xattrfs_pcache_invalidate_all(struct xattrfs_pcache *pc)
+{
+	int i;
+
+	for (i = 0; i < PCACHE_SHARDS; i++) {
+		pthread_mutex_lock(&pc->shards[i].lock);
+		pc->shards[i].seq++;
+		pthread_mutex_unlock(&pc->shards[i].lock);
+	}
+
+	__atomic_add_fetch(&pc->gen, 1, __ATOMIC_RELEASE);
+}
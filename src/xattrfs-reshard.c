@@ -0,0 +1,542 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * xattrfs-reshard: splits (or merges) the xattr database of a base directory
+ * into a different number of shards. the file system must not be mounted.
+ *
+ * the new shards are written next to the old database, and replace it only
+ * when they are complete. the old files are kept with a ".old" suffix. they
+ * have the layout of the old database.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "xattrfs.h"
+
+#define RESHARD_FILE		".xattr-reshard-%d.db"
+
+extern const char xdb_dentry_sqlstr[];
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-n N] <basedir>\n\n"
+	       "Splits the xattr database of <basedir> into N shards (1).\n"
+	       "Unmount the file system first.\n", prog);
+}
+
+static sqlite3 *open_db(const char *path, int flags)
+{
+	sqlite3 *db;
+
+	if (sqlite3_open_v2(path, &db, flags, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	return db;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql)
+{
+	char *err = NULL;
+
+	if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", sql, err);
+		sqlite3_free(err);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct target {
+	sqlite3 *db;
+	sqlite3_stmt *name;		/* rows only */
+	sqlite3_stmt *blob;
+	sqlite3_stmt *insert;
+	char path[PATH_MAX];
+};
+
+static int prepare(struct target *t, const char *sql, sqlite3_stmt **stmt)
+{
+	if (sqlite3_prepare_v2(t->db, sql, -1, stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", t->path, sqlite3_errmsg(t->db));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void close_target(struct target *t)
+{
+	sqlite3_finalize(t->name);
+	sqlite3_finalize(t->blob);
+	sqlite3_finalize(t->insert);
+	t->name = NULL;
+	t->blob = NULL;
+	t->insert = NULL;
+}
+
+static int open_target(struct target *t, const char *dir, int shard,
+			int layout)
+{
+	char file[32];
+
+	snprintf(file, sizeof(file), RESHARD_FILE, shard);
+	snprintf(t->path, sizeof(t->path), "%s/%s", dir, file);
+
+	/* left by an interrupted run */
+	unlink(t->path);
+
+	t->db = open_db(t->path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+	if (!t->db)
+		return -1;
+
+	if (xdb_schema_upgrade(t->db, layout) ||
+	    (shard == 0 && exec_sql(t->db, xdb_dentry_sqlstr)) ||
+	    exec_sql(t->db, "BEGIN TRANSACTION"))
+		return -1;
+
+	/* the blobs are numbered again in each target */
+	if (prepare(t, "INSERT INTO xdb_blob (data) VALUES (?)", &t->blob))
+		return -1;
+
+	if (layout == XDB_LAYOUT_PACKED)
+		return prepare(t, "INSERT INTO xdb_packed (ino, rec) "
+				  "VALUES (?,?)", &t->insert);
+
+	/* and so are the names */
+	return prepare(t, "INSERT OR IGNORE INTO xdb_name (nid, name) "
+			  "VALUES (?,?)", &t->name) ||
+	       prepare(t, "INSERT INTO xdb_xattr (ino, kid, value, bid) "
+			  "VALUES (?1, (SELECT kid FROM xdb_name WHERE nid=?2 "
+			  "AND name=?3), ?4, ?5)", &t->insert);
+}
+
+/* the blob in column @col of @src into the target, under a new *@bid */
+static int copy_blob(struct target *t, sqlite3_stmt *src, int col,
+			sqlite3_int64 *bid)
+{
+	int ret;
+
+	sqlite3_bind_value(t->blob, 1, sqlite3_column_value(src, col));
+	ret = sqlite3_step(t->blob);
+	sqlite3_reset(t->blob);
+	*bid = sqlite3_last_insert_rowid(t->db);
+
+	return ret;
+}
+
+/**
+ * copies the records of a packed source, with the blobs they point to. the
+ * bids in a record change to those of the blobs in the target.
+ */
+static long copy_records(sqlite3 *db, const char *path,
+			struct target *targets, int nshards)
+{
+	int ret;
+	long rows = 0;
+	size_t len, pos;
+	unsigned char *buf = NULL;
+	sqlite3_int64 bid;
+	struct xdb_packed_entry e;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *blob = NULL;
+
+	if (sqlite3_prepare_v2(db, "SELECT ino, rec FROM xdb_packed",
+			       -1, &stmt, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, "SELECT data FROM xdb_blob WHERE bid=?",
+			       -1, &blob, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		rows = -1;
+		goto out;
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_int64 ino = sqlite3_column_int64(stmt, 0);
+		struct target *t = &targets[xdb_shard_of(ino, nshards)];
+
+		len = sqlite3_column_bytes(stmt, 1);
+		free(buf);
+		buf = malloc(len + 1);
+		if (!buf) {
+			perror("malloc");
+			rows = -1;
+			goto out;
+		}
+		memcpy(buf, sqlite3_column_blob(stmt, 1), len);
+
+		for (pos = 0; (ret = xdb_packed_next(buf, len, &pos, &e)) == 1;
+		     rows++) {
+			if (!e.blob)
+				continue;
+
+			/* a bid without its blob is a bad record */
+			sqlite3_bind_int64(blob, 1, xdb_packed_bid(buf, &e));
+			ret = sqlite3_step(blob);
+			if (ret == SQLITE_ROW)
+				ret = copy_blob(t, blob, 0, &bid);
+			else
+				ret = -EIO;
+			sqlite3_reset(blob);
+			if (ret != SQLITE_DONE)
+				break;
+
+			xdb_packed_set_bid(buf, &e, bid);
+		}
+
+		if (ret == 0) {
+			sqlite3_bind_int64(t->insert, 1, ino);
+			sqlite3_bind_blob(t->insert, 2, buf, (int) len,
+					  SQLITE_STATIC);
+			ret = sqlite3_step(t->insert);
+			sqlite3_reset(t->insert);
+		}
+		if (ret != SQLITE_DONE) {
+			fprintf(stderr, "%s: inode %lld: %s\n",
+				ret < 0 ? path : t->path, ino,
+				ret < 0 ? "bad record" : sqlite3_errmsg(t->db));
+			rows = -1;
+			goto out;
+		}
+	}
+
+	if (ret != SQLITE_DONE) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		rows = -1;
+	}
+
+out:
+	free(buf);
+	sqlite3_finalize(blob);
+	sqlite3_finalize(stmt);
+	return rows;
+}
+
+/* copies every row of a source database into the target of its inode */
+static long copy_rows(const char *path, struct target *targets, int nshards,
+			int layout)
+{
+	int ret;
+	long rows = 0;
+	sqlite3 *db;
+	sqlite3_int64 bid;
+	sqlite3_stmt *stmt = NULL;
+
+	db = open_db(path, SQLITE_OPEN_READWRITE);
+	if (!db)
+		return -1;
+
+	/* also fails while the file system is still mounted */
+	if (exec_sql(db, "PRAGMA journal_mode=DELETE")) {
+		rows = -1;
+		goto out;
+	}
+
+	if (xdb_schema_upgrade(db, layout)) {
+		fprintf(stderr, "%s: cannot upgrade the database\n", path);
+		rows = -1;
+		goto out;
+	}
+
+	if (xdb_schema_layout(db) != layout) {
+		fprintf(stderr, "%s: not in the layout of the first shard\n",
+			path);
+		rows = -1;
+		goto out;
+	}
+
+	if (layout == XDB_LAYOUT_PACKED) {
+		rows = copy_records(db, path, targets, nshards);
+		goto out;
+	}
+
+	/* out-of-line values stay out of line, under a new bid */
+	if (sqlite3_prepare_v2(db, "SELECT x.ino, n.nid, n.name, x.value, "
+				   "x.bid, b.data FROM xdb_xattr x "
+				   "JOIN xdb_name n ON n.kid=x.kid "
+				   "LEFT JOIN xdb_blob b ON b.bid=x.bid",
+			       -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		rows = -1;
+		goto out;
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_int64 ino = sqlite3_column_int64(stmt, 0);
+		struct target *t = &targets[xdb_shard_of(ino, nshards)];
+
+		sqlite3_bind_value(t->name, 1, sqlite3_column_value(stmt, 1));
+		sqlite3_bind_value(t->name, 2, sqlite3_column_value(stmt, 2));
+
+		ret = sqlite3_step(t->name);
+		sqlite3_reset(t->name);
+
+		sqlite3_bind_int64(t->insert, 1, ino);
+		sqlite3_bind_value(t->insert, 2, sqlite3_column_value(stmt, 1));
+		sqlite3_bind_value(t->insert, 3, sqlite3_column_value(stmt, 2));
+		sqlite3_bind_value(t->insert, 4, sqlite3_column_value(stmt, 3));
+		sqlite3_bind_null(t->insert, 5);
+
+		if (ret == SQLITE_DONE &&
+		    sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+			if (sqlite3_column_type(stmt, 5) == SQLITE_NULL) {
+				fprintf(stderr, "%s: inode %lld: no blob\n",
+					path, ino);
+				rows = -1;
+				goto out;
+			}
+
+			ret = copy_blob(t, stmt, 5, &bid);
+			sqlite3_bind_int64(t->insert, 5, bid);
+		}
+
+		if (ret == SQLITE_DONE)
+			ret = sqlite3_step(t->insert);
+		sqlite3_reset(t->insert);
+		if (ret != SQLITE_DONE) {
+			fprintf(stderr, "%s: %s\n", t->path,
+				sqlite3_errmsg(t->db));
+			rows = -1;
+			goto out;
+		}
+
+		rows++;
+	}
+
+	if (ret != SQLITE_DONE) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		rows = -1;
+	}
+
+out:
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return rows;
+}
+
+/* the names of the query index stay in the first shard */
+static long copy_dentries(const char *path, struct target *t)
+{
+	int ret;
+	long rows = 0;
+	sqlite3 *db;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *insert = NULL;
+
+	db = open_db(path, SQLITE_OPEN_READONLY);
+	if (!db)
+		return -1;
+
+	/* not mounted with -o query yet */
+	if (sqlite3_prepare_v2(db, "SELECT parent, name, ino FROM xdb_dentry",
+			       -1, &stmt, NULL) != SQLITE_OK)
+		goto out;
+
+	if (sqlite3_prepare_v2(t->db, "INSERT INTO xdb_dentry "
+				      "(parent, name, ino) VALUES (?,?,?)",
+			       -1, &insert, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", t->path, sqlite3_errmsg(t->db));
+		rows = -1;
+		goto out;
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_bind_value(insert, 1, sqlite3_column_value(stmt, 0));
+		sqlite3_bind_value(insert, 2, sqlite3_column_value(stmt, 1));
+		sqlite3_bind_value(insert, 3, sqlite3_column_value(stmt, 2));
+
+		ret = sqlite3_step(insert);
+		sqlite3_reset(insert);
+		if (ret != SQLITE_DONE) {
+			fprintf(stderr, "%s: %s\n", t->path,
+				sqlite3_errmsg(t->db));
+			rows = -1;
+			goto out;
+		}
+
+		rows++;
+	}
+
+	if (ret != SQLITE_DONE) {
+		fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+		rows = -1;
+	}
+
+out:
+	sqlite3_finalize(insert);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return rows;
+}
+
+/* the layout of the targets, which is that of the first shard */
+static int source_layout(const char *dir, int nshards)
+{
+	int ret;
+	sqlite3 *db;
+	char *path = xdb_shard_path(dir, 0, nshards);
+
+	if (!path)
+		return -1;
+
+	db = open_db(path, SQLITE_OPEN_READONLY);
+	free(path);
+	if (!db)
+		return -1;
+
+	ret = xdb_schema_layout(db);
+	if (ret < 0)
+		fprintf(stderr, "%s: %s\n", dir, sqlite3_errmsg(db));
+	sqlite3_close(db);
+
+	return ret;
+}
+
+static int rename_file(const char *from, const char *to)
+{
+	if (rename(from, to) < 0) {
+		fprintf(stderr, "rename %s to %s: %s\n", from, to,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, op;
+	int ret = 1;
+	int nshards = 1;
+	int old;
+	int layout;
+	int swapping = 0;
+	long rows, total = 0;
+	char *dir;
+	char *path;
+	char buf[PATH_MAX];
+	struct target *targets;
+
+	while ((op = getopt(argc, argv, "n:h")) != -1) {
+		switch (op) {
+		case 'n':
+			nshards = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return op == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1 || nshards < 1 || nshards > XDB_MAX_SHARDS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	dir = argv[optind];
+
+	old = xdb_shard_probe(dir);
+	if (old < 0) {
+		fprintf(stderr, "%s: both a single and a sharded xattr "
+				"database found\n", dir);
+		return 1;
+	}
+	if (old == 0) {
+		fprintf(stderr, "%s: no xattr database found\n", dir);
+		return 1;
+	}
+	if (old == nshards) {
+		printf("%s: already in %d shard(s)\n", dir, nshards);
+		return 0;
+	}
+
+	layout = source_layout(dir, old);
+	if (layout < 0)
+		return 1;
+
+	targets = calloc(nshards, sizeof(*targets));
+	if (!targets) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < nshards; i++)
+		if (open_target(&targets[i], dir, i, layout))
+			goto out;
+
+	for (i = 0; i < old; i++) {
+		path = xdb_shard_path(dir, i, old);
+		if (!path)
+			goto out;
+
+		rows = copy_rows(path, targets, nshards, layout);
+		if (rows >= 0 && i == 0 && copy_dentries(path, targets) < 0)
+			rows = -1;
+		free(path);
+		if (rows < 0)
+			goto out;
+
+		total += rows;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		close_target(&targets[i]);
+		if (exec_sql(targets[i].db, "END TRANSACTION"))
+			goto out;
+
+		sqlite3_close(targets[i].db);
+		targets[i].db = NULL;
+	}
+
+	/* the new shards are complete, swap them in */
+	swapping = 1;
+
+	for (i = 0; i < old; i++) {
+		path = xdb_shard_path(dir, i, old);
+		if (!path)
+			goto out;
+
+		snprintf(buf, sizeof(buf), "%s.old", path);
+		op = rename_file(path, buf);
+		free(path);
+		if (op)
+			goto out;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		path = xdb_shard_path(dir, i, nshards);
+		if (!path)
+			goto out;
+
+		op = rename_file(targets[i].path, path);
+		free(path);
+		if (op)
+			goto out;
+	}
+
+	printf("%s: %ld xattrs moved from %d to %d shard(s), the old "
+	       "database is kept in *.old\n", dir, total, old, nshards);
+	ret = 0;
+
+out:
+	for (i = 0; i < nshards; i++) {
+		close_target(&targets[i]);
+		sqlite3_close(targets[i].db);
+		if (ret && !swapping)
+			unlink(targets[i].path);
+	}
+	free(targets);
+
+	return ret;
+}
@@ -1,9 +1,8 @@
 -- xattrfs-schema.sql
-
-begin transaction;
-
-drop table if exists xdb_ns;
-drop table if exists xdb_xattr;
+--
+-- the current schema (XDB_SCHEMA_VERSION in xattrfs-xdb.c), created in an
+-- empty database. older databases are brought to it by the migrations in
+-- xattrfs-xdb.c.
 
 create table xdb_ns (
   nid integer not null,
@@ -17,17 +16,37 @@ insert into xdb_ns (nid, ns) values (2, 'security');
 insert into xdb_ns (nid, ns) values (3, 'trusted');
 insert into xdb_ns (nid, ns) values (4, 'user');
 
-create table xdb_xattr (
-  xid integer not null,
-  ino integer not null,
+-- each name once, the rows and indexes of xdb_xattr only have its kid
+create table xdb_name (
+  kid integer not null,
   nid integer not null references xdb_ns(nid),
   name text not null,
-  value blob not null,
-  primary key (xid)
+  primary key (kid)
 );
 
-create unique index idx_xattr_path on xdb_xattr(ino, nid, name);
-create index idx_xattr_nid  on xdb_xattr(nid, name);
+create unique index idx_name on xdb_name(nid, name);
+
+-- clustered on the key, so the xattrs of an inode are next to each other.
+-- a value kept out of line is in xdb_blob under bid, and value is its size.
+create table xdb_xattr (
+  ino integer not null,
+  kid integer not null references xdb_name(kid),
+  value blob not null,
+  bid integer,
+  primary key (ino, kid)
+) without rowid;
+
+create index idx_xattr_kid on xdb_xattr(kid);
+
+create table xdb_blob (
+  bid integer primary key,
+  data blob not null
+);
 
-end transaction;
+create trigger xdb_blob_delete after delete on xdb_xattr
+when old.bid is not null
+begin delete from xdb_blob where bid = old.bid; end;
 
+create trigger xdb_blob_update after update of bid on xdb_xattr
+when old.bid is not null and old.bid is not new.bid
+begin delete from xdb_blob where bid = old.bid; end;
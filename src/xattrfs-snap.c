@@ -0,0 +1,319 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * snapshots of the in-memory database (-o memdb): each shard lives in a memdb
+ * of its own (shard->memdb), which is loaded from the shard file at mount and
+ * copied back into it with the backup api, every @interval seconds if it has
+ * changed, and once more at unmount.
+ *
+ * a snapshot copies SNAP_PAGES pages per step, and holds the read lock of the
+ * memdb only within a step, so the writer commits in between. a commit
+ * restarts the copy, though, and a snapshot that restarted SNAP_RESTARTS
+ * times copies what is left in one step.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xattrfs.h"
+
+#define SNAP_PAGES		256
+#define SNAP_PAUSE		2		/* msec between two steps */
+#define SNAP_RESTARTS		8
+
+struct snap_shard {
+	sqlite3 *src;			/* the memdb, read-only */
+	sqlite3 *dst;			/* the shard file */
+	int version;			/* data_version of the last snapshot */
+};
+
+struct xdb_snap {
+	struct xdb *xdb;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int stop;
+	int interval;			/* sec between two snapshots */
+	int nshards;
+	struct snap_shard shards[];
+};
+
+static int open_db(const char *path, int flags, sqlite3 **db)
+{
+	if (sqlite3_open_v2(path, db, flags | SQLITE_OPEN_NOMUTEX |
+			    SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+		sqlite3_close(*db);
+		*db = NULL;
+		return -EIO;
+	}
+
+	sqlite3_busy_timeout(*db, 100);
+
+	return 0;
+}
+
+static int pragma_int(sqlite3 *db, const char *sql)
+{
+	int ret = -1;
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/* changes with every commit of another connection */
+static inline int data_version(sqlite3 *db)
+{
+	return pragma_int(db, "PRAGMA data_version");
+}
+
+/* returns 1 if stopped */
+static int pause_for(struct xdb_snap *snap, long msec)
+{
+	int ret;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000L;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+
+	pthread_mutex_lock(&snap->lock);
+	for (ret = 0; !snap->stop && ret != ETIMEDOUT; )
+		ret = pthread_cond_timedwait(&snap->wakeup, &snap->lock, &ts);
+	ret = snap->stop;
+	pthread_mutex_unlock(&snap->lock);
+
+	return ret;
+}
+
+/**
+ * copies the memdb of @s into its file, in steps of @pages (-1: all at once,
+ * without pauses). returns 1 if stopped before the end.
+ */
+static int save(struct xdb_snap *snap, struct snap_shard *s, int pages)
+{
+	int ret;
+	int restarts = 0;
+	int remaining = -1;
+	int version = data_version(s->src);
+	sqlite3_backup *b;
+
+	if (version == s->version)
+		return 0;
+
+	b = sqlite3_backup_init(s->dst, "main", s->src, "main");
+	if (!b)
+		return -EIO;
+
+	for (;;) {
+		ret = sqlite3_backup_step(b, restarts < SNAP_RESTARTS ?
+					     pages : -1);
+		if (ret != SQLITE_OK && ret != SQLITE_BUSY &&
+		    ret != SQLITE_LOCKED)
+			break;
+
+		if (remaining >= 0 && sqlite3_backup_remaining(b) > remaining)
+			restarts++;
+		remaining = sqlite3_backup_remaining(b);
+
+		if (pages > 0 && pause_for(snap, SNAP_PAUSE)) {
+			sqlite3_backup_finish(b);
+			return 1;
+		}
+	}
+
+	ret = sqlite3_backup_finish(b);
+	if (ret != SQLITE_OK)
+		return -EIO;
+
+	s->version = version;
+
+	return 0;
+}
+
+static void *snap_thread(void *arg)
+{
+	int i, ret;
+	struct xdb_snap *snap = (struct xdb_snap *) arg;
+
+	while (!pause_for(snap, snap->interval * 1000L)) {
+		for (i = 0; i < snap->nshards; i++) {
+			ret = save(snap, &snap->shards[i], SNAP_PAGES);
+			if (ret < 0)
+				fprintf(stderr, "xattrfs: snapshot of shard %d "
+						"failed (%d)\n", i, ret);
+			if (ret == 1)
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * external interface
+ */
+
+/* before anything else uses the memdb of @shard */
+int xdb_snap_load(struct xdb_shard *shard)
+{
+	int ret;
+	sqlite3 *src, *dst;
+	sqlite3_backup *b;
+	char sql[64];
+
+	if (access(shard->dbpath, F_OK))
+		return errno == ENOENT ? 0 : -errno;
+
+	ret = open_db(shard->dbpath, SQLITE_OPEN_READWRITE, &src);
+	if (ret)
+		return ret;
+
+	/**
+	 * the backup copies the header, and a memdb cannot be in wal mode.
+	 * this is persistent, but a mount without -o memdb sets it back.
+	 */
+	if (sqlite3_exec(src, "PRAGMA journal_mode=delete", NULL, NULL, NULL)
+	    != SQLITE_OK) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = open_db(shard->memdb, SQLITE_OPEN_READWRITE, &dst);
+	if (ret)
+		goto out;
+
+	/* nor can it change the page size of a memdb */
+	snprintf(sql, sizeof(sql), "PRAGMA page_size=%d",
+		 pragma_int(src, "PRAGMA page_size"));
+	if (sqlite3_exec(dst, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		ret = -EIO;
+		goto out_dst;
+	}
+
+	b = sqlite3_backup_init(dst, "main", src, "main");
+	if (!b || sqlite3_backup_step(b, -1) != SQLITE_DONE)
+		ret = -EIO;
+	if (b && sqlite3_backup_finish(b) != SQLITE_OK)
+		ret = -EIO;
+
+out_dst:
+	sqlite3_close(dst);
+out:
+	sqlite3_close(src);
+	return ret;
+}
+
+int xdb_snap_init(struct xdb_snap **snap, struct xdb *xdb, int interval)
+{
+	int i;
+	int ret = 0;
+	pthread_condattr_t attr;
+	struct xdb_snap *self;
+
+	self = calloc(1, sizeof(*self) + xdb->nshards * sizeof(self->shards[0]));
+	if (!self)
+		return -ENOMEM;
+
+	self->xdb = xdb;
+	self->interval = interval;
+	self->nshards = xdb->nshards;
+
+	for (i = 0; i < xdb->nshards; i++) {
+		struct snap_shard *s = &self->shards[i];
+
+		ret = open_db(xdb->shards[i].memdb, SQLITE_OPEN_READONLY,
+			      &s->src);
+		if (!ret)
+			ret = open_db(xdb->shards[i].dbpath,
+				      SQLITE_OPEN_READWRITE |
+				      SQLITE_OPEN_CREATE, &s->dst);
+		if (ret)
+			goto out;
+
+		/* as loaded, or empty */
+		s->version = data_version(s->src);
+	}
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&self->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* only at unmount */
+	if (!interval) {
+		*snap = self;
+		return 0;
+	}
+
+	ret = pthread_create(&self->thread, NULL, snap_thread, self);
+	if (ret) {
+		pthread_cond_destroy(&self->wakeup);
+		pthread_mutex_destroy(&self->lock);
+		ret = -ret;
+		goto out;
+	}
+
+	*snap = self;
+
+	return 0;
+
+out:
+	for (i = 0; i < self->nshards; i++) {
+		sqlite3_close(self->shards[i].src);
+		sqlite3_close(self->shards[i].dst);
+	}
+	free(self);
+	return ret;
+}
+
+/* the last snapshot, with nothing else using the database */
+int xdb_snap_exit(struct xdb_snap *snap)
+{
+	int i, ret;
+	int err = 0;
+
+	if (snap->interval) {
+		pthread_mutex_lock(&snap->lock);
+		snap->stop = 1;
+		pthread_cond_signal(&snap->wakeup);
+		pthread_mutex_unlock(&snap->lock);
+
+		pthread_join(snap->thread, NULL);
+	}
+
+	for (i = 0; i < snap->nshards; i++) {
+		ret = save(snap, &snap->shards[i], -1);
+		if (ret) {
+			fprintf(stderr, "xattrfs: snapshot of shard %d "
+					"failed (%d)\n", i, ret);
+			err = ret;
+		}
+
+		sqlite3_close(snap->shards[i].src);
+		sqlite3_close(snap->shards[i].dst);
+	}
+
+	pthread_cond_destroy(&snap->wakeup);
+	pthread_mutex_destroy(&snap->lock);
+	free(snap);
+
+	return err;
+}
@@ -0,0 +1,244 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * tiered xattrs: user and trusted xattrs are kept as native xattrs of the base
+ * file where the base file system takes them, and in the database otherwise
+ * (value too large, no xattr support, a file type or namespace it refuses).
+ * system and security xattrs always go to the database, since the kernel
+ * would interpret them (acls, selinux labels) on the base file.
+ *
+ * an xattr lives in one tier at a time: a set moves it to the native tier if
+ * it fits, and otherwise to the database, removing the copy in the other one.
+ *
+ * @path is the base file, or with @follow, a /proc/self/fd link to it (the
+ * low-level api), which is followed to the file it refers to.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <attr/xattr.h>		/* ENOATTR */
+
+#include "xattrfs.h"
+
+static inline int native_ns(const char *name)
+{
+	return 0 == strncmp(name, "user.", 5) ||
+	       0 == strncmp(name, "trusted.", 8);
+}
+
+/* the base file system does not keep it, but the database can */
+static inline int overflows(int err)
+{
+	switch (err) {
+	case E2BIG:
+	case ENOSPC:
+	case ERANGE:
+	case ENOTSUP:
+	case EPERM:
+	case EACCES:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static inline ssize_t n_get(const char *path, int follow, const char *name,
+				void *value, size_t size)
+{
+	ssize_t ret = follow ? getxattr(path, name, value, size)
+			     : lgetxattr(path, name, value, size);
+
+	return ret < 0 ? -errno : ret;
+}
+
+static inline int n_set(const char *path, int follow, const char *name,
+			const void *value, size_t size, int flags)
+{
+	int ret = follow ? setxattr(path, name, value, size, flags)
+			 : lsetxattr(path, name, value, size, flags);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static inline int n_remove(const char *path, int follow, const char *name)
+{
+	int ret = follow ? removexattr(path, name) : lremovexattr(path, name);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static inline ssize_t n_list(const char *path, int follow, char *list,
+				size_t size)
+{
+	ssize_t ret = follow ? listxattr(path, list, size)
+			     : llistxattr(path, list, size);
+
+	return ret < 0 ? -errno : ret;
+}
+
+/**
+ * the native names of the tiered namespaces, packed in a malloc'ed list. the
+ * list of the base file also has names of the other namespaces, which belong
+ * to the base file system and are not shown.
+ */
+static ssize_t native_list(const char *path, int follow, char **names)
+{
+	ssize_t ret, len;
+	char *list = NULL;
+	char *name, *pos;
+
+	do {
+		free(list);
+		list = NULL;
+
+		len = n_list(path, follow, NULL, 0);
+		if (len <= 0)
+			return len == 0 || overflows(-len) ? 0 : len;
+
+		list = malloc(len);
+		if (!list)
+			return -ENOMEM;
+
+		ret = n_list(path, follow, list, len);
+	} while (ret == -ERANGE);	/* grown in between */
+
+	if (ret < 0) {
+		free(list);
+		return overflows(-ret) ? 0 : ret;
+	}
+
+	pos = list;
+	for (name = list; name < &list[ret]; name += strlen(name) + 1) {
+		if (native_ns(name)) {
+			memmove(pos, name, strlen(name) + 1);
+			pos += strlen(pos) + 1;
+		}
+	}
+
+	*names = list;
+
+	return pos - list;
+}
+
+/**
+ * external interface
+ */
+
+int xattrfs_tier_getxattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, const char *name,
+			char *value, size_t size)
+{
+	ssize_t ret;
+
+	if (native_ns(name)) {
+		ret = n_get(path, follow, name, value, size);
+		if (ret >= 0 || ret == -ERANGE)
+			return ret;
+		if (ret != -ENODATA && !overflows(-ret))
+			return ret;
+	}
+
+	return xdb_getxattr(ctx->xdb, ino, name, value, size);
+}
+
+int xattrfs_tier_setxattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, const char *name,
+			const char *value, size_t size, int flags)
+{
+	int ret;
+	int indb, native;
+
+	if (!native_ns(name))
+		return xdb_setxattr(ctx->xdb, ino, name, value, size, flags);
+
+	ret = xdb_getxattr(ctx->xdb, ino, name, NULL, 0);
+	if (ret < 0 && ret != -ENODATA)
+		return ret;
+
+	indb = ret >= 0;
+	if (indb && (flags & XATTR_CREATE))
+		return -EEXIST;
+
+	ret = n_set(path, follow, name, value, size, indb ? 0 : flags);
+	if (ret == 0) {
+		/* fits in the native tier now */
+		if (indb)
+			xdb_removexattr(ctx->xdb, ino, name);
+		return 0;
+	}
+
+	if (!overflows(-ret))
+		return ret;
+
+	native = n_get(path, follow, name, NULL, 0) >= 0;
+	if (!indb && !native && (flags & XATTR_REPLACE))
+		return -ENOATTR;
+	if (native && (flags & XATTR_CREATE))
+		return -EEXIST;
+
+	ret = xdb_setxattr(ctx->xdb, ino, name, value, size,
+			   indb ? flags : flags & ~XATTR_REPLACE);
+	if (ret == 0 && native)
+		n_remove(path, follow, name);
+
+	return ret;
+}
+
+int xattrfs_tier_removexattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, const char *name)
+{
+	int ret;
+
+	if (native_ns(name)) {
+		ret = n_remove(path, follow, name);
+		if (ret == 0)
+			return 0;
+		if (ret != -ENODATA && !overflows(-ret))
+			return ret;
+	}
+
+	return xdb_removexattr(ctx->xdb, ino, name);
+}
+
+int xattrfs_tier_listxattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, char *list, size_t size)
+{
+	ssize_t ret, len;
+	char *names = NULL;
+
+	len = native_list(path, follow, &names);
+	if (len < 0)
+		return len;
+
+	if (size == 0) {
+		ret = xdb_listxattr(ctx->xdb, ino, NULL, 0);
+		goto out;
+	}
+
+	if (size < (size_t) len) {
+		free(names);
+		return -ERANGE;
+	}
+
+	if (len)
+		memcpy(list, names, len);
+
+	/* a zero size would be taken as a size probe */
+	if (size == (size_t) len) {
+		ret = xdb_listxattr(ctx->xdb, ino, NULL, 0);
+		if (ret > 0)
+			ret = -ERANGE;
+	}
+	else
+		ret = xdb_listxattr(ctx->xdb, ino, &list[len], size - len);
+
+out:
+	free(names);
+	return ret < 0 ? ret : ret + len;
+}
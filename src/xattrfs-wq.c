@@ -0,0 +1,489 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * group commit: setxattr and removexattr are queued and acknowledged at once,
+ * and a writer thread applies the queue in large transactions. a batch is
+ * committed when it reaches the batch size or when its first mutation has
+ * waited for the maximum delay.
+ *
+ * every queued mutation stays in a hash table (keyed by inode) until it is
+ * committed, so that readers and the XATTR_CREATE/XATTR_REPLACE checks see
+ * it. a mutation that is still queued is overwritten in place by a newer one
+ * for the same name.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/xattr.h>		/* XATTR_CREATE, XATTR_REPLACE */
+#include <attr/xattr.h>		/* ENOATTR */
+#include <pthread.h>
+
+#include "xattrfs.h"
+
+#define WQ_HASH_SIZE		1024
+
+struct wq_op {
+	struct wq_op *next;		/* queue order */
+	struct wq_op *hnext;		/* hash chain, newest first */
+	ino_t ino;
+	int removed;			/* removexattr */
+	int inflight;			/* taken by the writer */
+	unsigned long seq;		/* queue order */
+	size_t size;
+	char *value;
+	char name[];
+};
+
+struct xdb_wq {
+	struct xdb *xdb;
+	int shard;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;		/* to the writer */
+	pthread_cond_t done;		/* from the writer, after each batch */
+	struct wq_op *head;
+	struct wq_op **tail;
+	unsigned int nqueued;
+	unsigned int nflush;		/* threads waiting in xdb_wq_flush() */
+	unsigned long seq;		/* of the last queued mutation */
+	unsigned long retired;		/* of the last committed one */
+	int stop;
+	long delay;			/* nsec */
+	unsigned int batch;
+	struct wq_op *hash[WQ_HASH_SIZE];
+};
+
+/* setters wait while this many mutations are queued */
+#define wq_backlog(wq)		(4 * (wq)->batch)
+
+static inline unsigned int hash_ino(ino_t ino)
+{
+	return (unsigned int) ((ino * 2654435761UL) % WQ_HASH_SIZE);
+}
+
+static struct wq_op *lookup(struct xdb_wq *wq, ino_t ino, const char *name)
+{
+	struct wq_op *op;
+
+	for (op = wq->hash[hash_ino(ino)]; op; op = op->hnext)
+		if (op->ino == ino && 0 == strcmp(op->name, name))
+			return op;
+
+	return NULL;
+}
+
+static int has_ino(struct xdb_wq *wq, ino_t ino)
+{
+	struct wq_op *op;
+
+	for (op = wq->hash[hash_ino(ino)]; op; op = op->hnext)
+		if (op->ino == ino)
+			return 1;
+
+	return 0;
+}
+
+/* returns 1 if the xattr exists, counting queued mutations */
+static int exists(struct xdb_wq *wq, ino_t ino, const char *name)
+{
+	int ret;
+	struct wq_op *op = lookup(wq, ino, name);
+
+	if (op)
+		return !op->removed;
+
+	ret = xdb_db_getxattr(wq->xdb, ino, name, NULL, 0);
+	if (ret == -ENODATA)
+		return 0;
+
+	return ret < 0 ? ret : 1;
+}
+
+static struct wq_op *new_op(ino_t ino, const char *name,
+				const char *value, size_t size)
+{
+	struct wq_op *op = calloc(1, sizeof(*op) + strlen(name) + 1);
+
+	if (!op)
+		return NULL;
+
+	op->ino = ino;
+	strcpy(op->name, name);
+
+	if (value) {
+		op->value = malloc(size ? size : 1);
+		if (!op->value) {
+			free(op);
+			return NULL;
+		}
+		memcpy(op->value, value, size);
+		op->size = size;
+	}
+	else
+		op->removed = 1;
+
+	return op;
+}
+
+static inline void free_op(struct wq_op *op)
+{
+	free(op->value);
+	free(op);
+}
+
+static void enqueue(struct xdb_wq *wq, struct wq_op *op)
+{
+	struct wq_op *old = lookup(wq, op->ino, op->name);
+
+	if (old && !old->inflight) {
+		free(old->value);
+		old->value = op->value;
+		old->size = op->size;
+		old->removed = op->removed;
+		free(op);
+		return;
+	}
+
+	op->seq = ++wq->seq;
+	op->hnext = wq->hash[hash_ino(op->ino)];
+	wq->hash[hash_ino(op->ino)] = op;
+
+	*wq->tail = op;
+	wq->tail = &op->next;
+
+	if (++wq->nqueued == 1 || wq->nqueued >= wq->batch)
+		pthread_cond_signal(&wq->wakeup);
+}
+
+static inline void wait_backlog(struct xdb_wq *wq)
+{
+	while (wq->nqueued >= wq_backlog(wq) && !wq->stop)
+		pthread_cond_wait(&wq->done, &wq->lock);
+}
+
+/* detach up to a batch of queued mutations */
+static struct wq_op *take(struct xdb_wq *wq)
+{
+	unsigned int n;
+	struct wq_op *list = wq->head;
+	struct wq_op *op = list;
+
+	for (n = 1; ; n++) {
+		op->inflight = 1;
+		if (n == wq->batch || !op->next)
+			break;
+		op = op->next;
+	}
+
+	wq->head = op->next;
+	if (!wq->head)
+		wq->tail = &wq->head;
+	wq->nqueued -= n;
+	op->next = NULL;
+
+	return list;
+}
+
+static inline int apply(struct xdb *xdb, struct wq_op *op)
+{
+	int ret;
+
+	if (op->removed) {
+		ret = xdb_tx_removexattr(xdb, op->ino, op->name);
+		return ret == -ENOATTR ? 0 : ret;
+	}
+
+	return xdb_tx_setxattr(xdb, op->ino, op->name,
+			       op->value, op->size, 0);
+}
+
+static void commit(struct xdb_wq *wq, struct wq_op *list)
+{
+	int ret = 0;
+	struct wq_op *op;
+	struct xdb *xdb = wq->xdb;
+
+	if (0 == xdb_tx_begin(xdb, wq->shard)) {
+		for (op = list; op && !ret; op = op->next)
+			ret = apply(xdb, op);
+
+		/* a rolled back batch is retried below */
+		if (0 == xdb_tx_end(xdb, wq->shard, !ret) && !ret)
+			return;
+	}
+
+	/* fall back to one transaction per mutation, to isolate failures */
+	for (op = list; op; op = op->next) {
+		ret = xdb_tx_begin(xdb, wq->shard);
+		if (0 == ret) {
+			ret = apply(xdb, op);
+			ret |= xdb_tx_end(xdb, wq->shard, !ret);
+		}
+
+		if (ret)
+			fprintf(stderr, "xattrfs: failed to commit %s of "
+					"inode %llu (%d)\n",
+					op->name, _llu(op->ino), ret);
+	}
+}
+
+static void retire(struct xdb_wq *wq, struct wq_op *list)
+{
+	struct wq_op *op, *next, **pos;
+
+	for (op = list; op; op = next) {
+		next = op->next;
+
+		for (pos = &wq->hash[hash_ino(op->ino)]; *pos;
+		     pos = &(*pos)->hnext) {
+			if (*pos == op) {
+				*pos = op->hnext;
+				break;
+			}
+		}
+
+		/* the batches are taken in queue order */
+		wq->retired = op->seq;
+		free_op(op);
+	}
+}
+
+static void *wq_writer(void *arg)
+{
+	struct timespec deadline;
+	struct wq_op *list;
+	struct xdb_wq *wq = (struct xdb_wq *) arg;
+
+	pthread_mutex_lock(&wq->lock);
+
+	for (;;) {
+		while (!wq->head && !wq->stop)
+			pthread_cond_wait(&wq->wakeup, &wq->lock);
+
+		if (!wq->head)
+			break;		/* stopped, and the queue is drained */
+
+		/* let more mutations join the batch */
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += wq->delay;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		while (wq->nqueued < wq->batch && !wq->stop && !wq->nflush) {
+			if (pthread_cond_timedwait(&wq->wakeup, &wq->lock,
+						   &deadline) == ETIMEDOUT)
+				break;
+		}
+
+		list = take(wq);
+		pthread_mutex_unlock(&wq->lock);
+
+		commit(wq, list);
+
+		pthread_mutex_lock(&wq->lock);
+		retire(wq, list);
+		pthread_cond_broadcast(&wq->done);
+	}
+
+	pthread_mutex_unlock(&wq->lock);
+
+	return NULL;
+}
+
+/**
+ * external interface
+ */
+
+int xdb_wq_init(struct xdb_wq **wq, struct xdb *xdb, int shard, int delay,
+		int batch)
+{
+	int ret = 0;
+	pthread_condattr_t attr;
+	struct xdb_wq *self = calloc(1, sizeof(*self));
+
+	if (!self)
+		return -ENOMEM;
+
+	self->xdb = xdb;
+	self->shard = shard;
+	self->tail = &self->head;
+	self->delay = delay * 1000000L;
+	self->batch = batch;
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&self->wakeup, &attr);
+	pthread_cond_init(&self->done, NULL);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&self->writer, NULL, wq_writer, self);
+	if (ret) {
+		pthread_cond_destroy(&self->done);
+		pthread_cond_destroy(&self->wakeup);
+		pthread_mutex_destroy(&self->lock);
+		free(self);
+		return -ret;
+	}
+
+	*wq = self;
+
+	return 0;
+}
+
+void xdb_wq_exit(struct xdb_wq *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = 1;
+	pthread_cond_signal(&wq->wakeup);
+	pthread_cond_broadcast(&wq->done);
+	pthread_mutex_unlock(&wq->lock);
+
+	pthread_join(wq->writer, NULL);
+
+	pthread_cond_destroy(&wq->done);
+	pthread_cond_destroy(&wq->wakeup);
+	pthread_mutex_destroy(&wq->lock);
+	free(wq);
+}
+
+int xdb_wq_getxattr(struct xdb_wq *wq, ino_t ino, const char *name,
+			char *value, size_t size, int *pending)
+{
+	int ret = 0;
+	struct wq_op *op;
+
+	pthread_mutex_lock(&wq->lock);
+
+	op = lookup(wq, ino, name);
+	*pending = op != NULL;
+
+	if (!op)
+		goto out;
+
+	if (op->removed)
+		ret = -ENODATA;
+	else if (size == 0)
+		ret = op->size;
+	else if (size < op->size)
+		ret = -ERANGE;
+	else {
+		memcpy(value, op->value, op->size);
+		ret = op->size;
+	}
+
+out:
+	pthread_mutex_unlock(&wq->lock);
+	return ret;
+}
+
+int xdb_wq_setxattr(struct xdb_wq *wq, ino_t ino, const char *name,
+			const char *value, size_t size, int flags)
+{
+	int ret = 0;
+	struct wq_op *op = new_op(ino, name, value, size);
+
+	if (!op)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&wq->lock);
+
+	wait_backlog(wq);
+
+	if (flags & (XATTR_CREATE | XATTR_REPLACE)) {
+		ret = exists(wq, ino, name);
+		if (ret < 0)
+			goto out;
+		else if (ret && (flags & XATTR_CREATE))
+			ret = -EEXIST;
+		else if (!ret && (flags & XATTR_REPLACE))
+			ret = -ENOATTR;
+		else
+			ret = 0;
+
+		if (ret)
+			goto out;
+	}
+
+	enqueue(wq, op);
+	op = NULL;
+
+out:
+	pthread_mutex_unlock(&wq->lock);
+	if (op)
+		free_op(op);
+	return ret;
+}
+
+int xdb_wq_removexattr(struct xdb_wq *wq, ino_t ino, const char *name)
+{
+	int ret = 0;
+	struct wq_op *op = new_op(ino, name, NULL, 0);
+
+	if (!op)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&wq->lock);
+
+	wait_backlog(wq);
+
+	ret = exists(wq, ino, name);
+	if (ret <= 0) {
+		ret = ret == 0 ? -ENOATTR : ret;
+		goto out;
+	}
+
+	enqueue(wq, op);
+	op = NULL;
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&wq->lock);
+	if (op)
+		free_op(op);
+	return ret;
+}
+
+void xdb_wq_flush(struct xdb_wq *wq, ino_t ino)
+{
+	pthread_mutex_lock(&wq->lock);
+
+	if (has_ino(wq, ino)) {
+		wq->nflush++;
+		pthread_cond_signal(&wq->wakeup);
+
+		while (has_ino(wq, ino))
+			pthread_cond_wait(&wq->done, &wq->lock);
+
+		wq->nflush--;
+	}
+
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* commits what is queued now, of every inode */
+void xdb_wq_flush_all(struct xdb_wq *wq)
+{
+	unsigned long seq;
+
+	pthread_mutex_lock(&wq->lock);
+
+	seq = wq->seq;
+	if (wq->retired < seq) {
+		wq->nflush++;
+		pthread_cond_signal(&wq->wakeup);
+
+		while (wq->retired < seq)
+			pthread_cond_wait(&wq->done, &wq->lock);
+
+		wq->nflush--;
+	}
+
+	pthread_mutex_unlock(&wq->lock);
+}
@@ -10,12 +10,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <sqlite3.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>		/* XATTR_CREATE, XATTR_REPLACE */
 #include <attr/xattr.h>		/* ENOATTR */
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xattrfs.h"
 
@@ -56,46 +59,302 @@ static inline uint64_t get_nsstrlen(const int ns)
 enum {
 	INSERT_NEW_XATTR = 0,
 	UPDATE_XATTR,
+	UPSERT_XATTR,
 	SEARCH_XATTR,
 	SEARCH_LEN_XATTR,
 	REMOVE_XATTR,
 	LIST_XATTR,
+	PURGE_XATTR,
+	SCAN_INO,
+	INSERT_BLOB,
+	ADD_DENTRY,
+	REMOVE_DENTRY,
+	LOOKUP_DENTRY,
+	QUERY_EXISTS,
+	QUERY_EQUAL,
+	QUERY_PREFIX,
+	SEARCH_NAME,
+	INSERT_NAME,
+	REMOVE_BLOB,
+	PACKED_SEARCH,
+	PACKED_UPSERT,
+	PACKED_REMOVE,
+	PACKED_SCAN,
+	PACKED_QUERY_EXISTS,
+	PACKED_QUERY_EQUAL,
+	PACKED_QUERY_PREFIX,
 
 	N_XDB_SQLS
 };
 
 static const char *xdb_sqls[N_XDB_SQLS] = {
 /* [INSERT_NEW_XATTR] */
-	"INSERT INTO xdb_xattr (ino, nid, name, value) VALUES (?,?,?,?)",
+	"INSERT INTO xdb_xattr (ino, kid, value, bid) VALUES (?,?,?,?)",
 /* [UPDATE_XATTR] */
-	"UPDATE xdb_xattr SET value=? WHERE ino=? AND nid=? AND name=?",
+	"UPDATE xdb_xattr SET value=?3, bid=?4 WHERE ino=?1 AND kid=?2",
+/* [UPSERT_XATTR] */
+	"INSERT INTO xdb_xattr (ino, kid, value, bid) VALUES (?,?,?,?) "
+	"ON CONFLICT (ino, kid) DO UPDATE SET value=excluded.value, "
+	"bid=excluded.bid",
 /* [SEARCH_XATTR] */
-	"SELECT value FROM xdb_xattr WHERE ino=? AND nid=? AND name=?",
+	"SELECT value, bid FROM xdb_xattr WHERE ino=? AND kid=?",
 /* [SEARCH_LEN_XATTR] */
-	"SELECT length(value) FROM xdb_xattr WHERE ino=? AND nid=? AND name=?",
+	"SELECT CASE WHEN bid IS NULL THEN length(value) ELSE value END "
+	"FROM xdb_xattr WHERE ino=? AND kid=?",
 /* [REMOVE_XATTR] */
-	"DELETE FROM xdb_xattr WHERE ino=? AND nid=? AND name=?",
+	"DELETE FROM xdb_xattr WHERE ino=? AND kid=?",
 /* [LIST_XATTR] */
-	"SELECT nid,name FROM xdb_xattr WHERE ino=?",
+	"SELECT n.nid, n.name FROM xdb_xattr x "
+	"JOIN xdb_name n ON n.kid=x.kid WHERE x.ino=?",
+/* [PURGE_XATTR] */
+	"DELETE FROM xdb_xattr WHERE ino=?",
+/* [SCAN_INO] */
+	"SELECT DISTINCT ino FROM xdb_xattr WHERE ino>? ORDER BY ino LIMIT ?",
+/* [INSERT_BLOB] */
+	"INSERT INTO xdb_blob (data) VALUES (zeroblob(?))",
+/* [ADD_DENTRY] */
+	"INSERT OR REPLACE INTO xdb_dentry (parent, name, ino) VALUES (?,?,?)",
+/* [REMOVE_DENTRY] */
+	"DELETE FROM xdb_dentry WHERE parent=? AND name=?",
+/* [LOOKUP_DENTRY] */
+	"SELECT parent, name FROM xdb_dentry WHERE ino=? LIMIT 1",
+/* [QUERY_EXISTS] */
+	"SELECT DISTINCT ino FROM xdb_xattr WHERE kid=?",
+/* [QUERY_EQUAL] */
+	"SELECT DISTINCT ino FROM xdb_xattr x WHERE kid=?1 AND (value=?2 OR "
+	"(bid IS NOT NULL AND value=length(?2) AND "
+	"(SELECT data FROM xdb_blob b WHERE b.bid=x.bid)=?2))",
+/* [QUERY_PREFIX] */
+	"SELECT DISTINCT ino FROM xdb_xattr x WHERE kid=?1 AND "
+	"(bid IS NULL AND substr(value, 1, ?3)=?2 OR "
+	"(bid IS NOT NULL AND value>=?3 AND "
+	"(SELECT substr(data, 1, ?3) FROM xdb_blob b WHERE b.bid=x.bid)=?2))",
+/* [SEARCH_NAME] */
+	"SELECT kid FROM xdb_name WHERE nid=? AND name=?",
+/* [INSERT_NAME] */
+	"INSERT INTO xdb_name (kid, nid, name) "
+	"SELECT max(?1, ifnull(max(kid), 0) + 1), ?2, ?3 FROM xdb_name",
+/* [REMOVE_BLOB] */
+	"DELETE FROM xdb_blob WHERE bid=?",
+/* [PACKED_SEARCH] */
+	"SELECT rec FROM xdb_packed WHERE ino=?",
+/* [PACKED_UPSERT] */
+	"INSERT INTO xdb_packed (ino, rec) VALUES (?,?) "
+	"ON CONFLICT (ino) DO UPDATE SET rec=excluded.rec",
+/* [PACKED_REMOVE] */
+	"DELETE FROM xdb_packed WHERE ino=?",
+/* [PACKED_SCAN] */
+	"SELECT ino FROM xdb_packed WHERE ino>? ORDER BY ino LIMIT ?",
+/* [PACKED_QUERY_EXISTS] */
+	"SELECT ino FROM xdb_packed WHERE xdb_unpack(rec, ?1, ?2) IS NOT NULL",
+/* [PACKED_QUERY_EQUAL] */
+	"SELECT ino FROM (SELECT ino, xdb_unpack(rec, ?1, ?2) AS value, "
+	"xdb_unpack_bid(rec, ?1, ?2) AS bid FROM xdb_packed) x "
+	"WHERE value=?3 OR (bid IS NOT NULL AND value=length(?3) AND "
+	"(SELECT data FROM xdb_blob b WHERE b.bid=x.bid)=?3)",
+/* [PACKED_QUERY_PREFIX] */
+	"SELECT ino FROM (SELECT ino, xdb_unpack(rec, ?1, ?2) AS value, "
+	"xdb_unpack_bid(rec, ?1, ?2) AS bid FROM xdb_packed) x "
+	"WHERE bid IS NULL AND substr(value, 1, ?4)=?3 OR "
+	"(bid IS NOT NULL AND value>=?4 AND "
+	"(SELECT substr(data, 1, ?4) FROM xdb_blob b WHERE b.bid=x.bid)=?3)",
 };
 
-static inline int exec_simple_sql(struct xdb *self, const char *sql)
+static const char *xdb_layouts[] = {
+	[XDB_LAYOUT_ROWS]	= "rows",
+	[XDB_LAYOUT_PACKED]	= "packed",
+	NULL
+};
+
+/**
+ * values larger than cfg->blob_threshold are kept out of line, in xdb_blob
+ * under the bid of their row, and xdb_xattr.value holds their size. they are
+ * read and written with the incremental blob api, straight between the
+ * caller's buffer and the database pages. the triggers drop the blob with its
+ * row, or when the value is changed (see xattrfs-schema.sql). a query reads a
+ * blob only if its size can match.
+ */
+
+/**
+ * the reverse index of the namespace, for turning the inodes found by a query
+ * into paths: every (parent inode, name) entry created through the mount. it
+ * is kept in the first shard.
+ */
+const char xdb_dentry_sqlstr[] =
+	"CREATE TABLE IF NOT EXISTS xdb_dentry ("
+	"  parent INTEGER NOT NULL,"
+	"  name TEXT NOT NULL,"
+	"  ino INTEGER NOT NULL,"
+	"  PRIMARY KEY (parent, name)"
+	");"
+	"CREATE INDEX IF NOT EXISTS idx_dentry_ino ON xdb_dentry(ino);";
+
+/**
+ * the packed layout (see xattrfs-packed.c), which is added to the schema of a
+ * new database: the xattrs of an inode in one record, under the inode number,
+ * and the out-of-line values in xdb_blob. xdb_xattr and xdb_name stay empty.
+ */
+static const char xdb_packed_sqlstr[] =
+	"CREATE TABLE xdb_packed ("
+	"  ino INTEGER PRIMARY KEY,"
+	"  rec BLOB NOT NULL"
+	");";
+
+/**
+ * schema versions, in PRAGMA user_version. each migration brings a database
+ * from the version before to its own, in a transaction with the new version,
+ * so an interrupted upgrade goes on from where it stopped:
+ *  1	the name text in every xdb_xattr row (and 0, before versions)
+ *  2	names in xdb_name, xdb_xattr keyed by a rowid (xid)
+ *  3	xdb_xattr clustered on (ino, kid), without a rowid
+ *  4	the packed layout (xdb_packed), which the versions before would not see
+ * an empty database gets xattrfs-schema.sql, which is the last version.
+ */
+#define XDB_SCHEMA_VERSION	4
+
+/**
+ * [2] the rows are copied into a new table with the kid of their name instead
+ * of the name, keeping their xid, under which their out-of-line values are.
+ */
+static const char xdb_name_upgrade_sqlstr[] =
+	"CREATE TABLE xdb_name ("
+	"  kid INTEGER NOT NULL,"
+	"  nid INTEGER NOT NULL REFERENCES xdb_ns(nid),"
+	"  name TEXT NOT NULL,"
+	"  PRIMARY KEY (kid)"
+	");"
+	"CREATE UNIQUE INDEX idx_name ON xdb_name(nid, name);"
+	"INSERT INTO xdb_name (nid, name) SELECT DISTINCT nid, name "
+	"FROM xdb_xattr;"
+	"CREATE TABLE xdb_xattr_new ("
+	"  xid INTEGER NOT NULL,"
+	"  ino INTEGER NOT NULL,"
+	"  kid INTEGER NOT NULL REFERENCES xdb_name(kid),"
+	"  value BLOB NOT NULL,"
+	"  PRIMARY KEY (xid)"
+	");"
+	"INSERT INTO xdb_xattr_new (xid, ino, kid, value) "
+	"SELECT x.xid, x.ino, n.kid, x.value FROM xdb_xattr x "
+	"JOIN xdb_name n ON n.nid = x.nid AND n.name = x.name;"
+	"DROP TABLE xdb_xattr;"
+	"ALTER TABLE xdb_xattr_new RENAME TO xdb_xattr;"
+	"CREATE UNIQUE INDEX idx_xattr_path ON xdb_xattr(ino, kid);"
+	"CREATE INDEX idx_xattr_kid ON xdb_xattr(kid);";
+
+/**
+ * [3] the rows are copied in key order into the clustered table, which finds
+ * an xattr with one descent and lists an inode with one range scan. the xid
+ * of an out-of-line value becomes its bid.
+ */
+static const char xdb_cluster_upgrade_sqlstr[] =
+	"CREATE TABLE IF NOT EXISTS xdb_blob ("
+	"  bid INTEGER PRIMARY KEY,"
+	"  data BLOB NOT NULL"
+	");"
+	"DROP TRIGGER IF EXISTS xdb_blob_delete;"
+	"DROP TRIGGER IF EXISTS xdb_blob_update;"
+	"CREATE TABLE xdb_xattr_new ("
+	"  ino INTEGER NOT NULL,"
+	"  kid INTEGER NOT NULL REFERENCES xdb_name(kid),"
+	"  value BLOB NOT NULL,"
+	"  bid INTEGER,"
+	"  PRIMARY KEY (ino, kid)"
+	") WITHOUT ROWID;"
+	"INSERT INTO xdb_xattr_new (ino, kid, value, bid) "
+	"SELECT ino, kid, value, "
+	"CASE typeof(value) WHEN 'integer' THEN xid END "
+	"FROM xdb_xattr ORDER BY ino, kid;"
+	"DROP TABLE xdb_xattr;"
+	"ALTER TABLE xdb_xattr_new RENAME TO xdb_xattr;"
+	"CREATE INDEX idx_xattr_kid ON xdb_xattr(kid);"
+	"CREATE TRIGGER xdb_blob_delete AFTER DELETE ON xdb_xattr "
+	"WHEN old.bid IS NOT NULL "
+	"BEGIN DELETE FROM xdb_blob WHERE bid = old.bid; END;"
+	"CREATE TRIGGER xdb_blob_update AFTER UPDATE OF bid ON xdb_xattr "
+	"WHEN old.bid IS NOT NULL AND old.bid IS NOT new.bid "
+	"BEGIN DELETE FROM xdb_blob WHERE bid = old.bid; END;";
+
+static const char *xdb_migrations[XDB_SCHEMA_VERSION + 1] = {
+	[2] = xdb_name_upgrade_sqlstr,
+	[3] = xdb_cluster_upgrade_sqlstr,
+	[4] = "",	/* an older database has the rows layout */
+};
+
+/**
+ * a database connection with its own prepared statements. shard->writer is the
+ * only connection that modifies the shard, and it is used with shard->wlock
+ * held. every other thread reads through a private connection per shard, which
+ * is opened on its first use and goes back to shard->idle when the thread
+ * exits.
+ */
+struct xdb_conn {
+	sqlite3 *conn;
+	struct xdb *xdb;
+	struct xdb_shard *shard;
+	struct xdb_conn *next;		/* xdb->conns */
+	struct xdb_conn *next_idle;	/* shard->idle */
+	sqlite3_stmt *stmts[N_XDB_SQLS];
+	unsigned int uses;		/* counts to XDB_STATUS_INTERVAL */
+	struct xdb_status status;	/* as of the last sample */
+	uint64_t tx_start;		/* of xdb_tx_begin(), for the metrics */
+	ino_t key_ino;			/* the statement in progress, for */
+	const char *key_name;		/* the slow query log (see step()) */
+	unsigned int busy;		/* SQLITE_BUSY retries */
+	unsigned int rows;
+	uint64_t nsec;
+	int stepping;			/* in sqlite3_step() */
+	int timed;			/* profiled in sqlite3_step() */
+	sqlite3_int64 next_kid;		/* of the writer (see name_id()) */
+};
+
+#define XDB_BUSY_TIMEOUT	100	/* msec */
+#define XDB_STATUS_INTERVAL	64	/* uses between status samples */
+
+/**
+ * durability tiers:
+ *  strict	a commit is on disk when setxattr returns (wal, sync=full)
+ *  balanced	the database survives a crash, but the last commits may be
+ *		lost on power failure (wal, sync=normal)
+ *  fast	no fsync at all; an OS crash or power failure may corrupt the
+ *		database (wal, sync=off)
+ */
+static const struct {
+	const char *name;
+	const char *journal;
+	const char *sync;
+} xdb_tiers[] = {
+	{ "strict",	"wal",	"full" },
+	{ "balanced",	"wal",	"normal" },
+	{ "fast",	"wal",	"off" },
+};
+
+#define N_XDB_TIERS	(sizeof(xdb_tiers) / sizeof(xdb_tiers[0]))
+
+static const char *journal_modes[] = {
+	"delete", "truncate", "persist", "memory", "wal", "off", NULL
+};
+
+static const char *sync_modes[] = {
+	"off", "normal", "full", "extra", NULL
+};
+
+static inline int exec_simple_sql(struct xdb_conn *self, const char *sql)
 {
 	int ret = sqlite3_exec(self->conn, sql, NULL, NULL, NULL);
 	return ret == SQLITE_OK ? 0 : ret;
 }
 
-static inline int tx_begin(struct xdb *self)
+static inline int tx_begin(struct xdb_conn *self)
 {
 	return exec_simple_sql(self, "BEGIN TRANSACTION");
 }
 
-static inline int tx_end(struct xdb *self)
+static inline int tx_end(struct xdb_conn *self)
 {
 	return exec_simple_sql(self, "END TRANSACTION");
 }
 
-static inline int tx_abort(struct xdb *self)
+static inline int tx_abort(struct xdb_conn *self)
 {
 	return exec_simple_sql(self, "ROLLBACK");
 }
@@ -105,15 +364,6 @@ static inline int str_startswith(const char *str, char *pre)
 	return 0 == strncmp(str, pre, strlen(pre));
 }
 
-static inline char *get_db_path(const char *dir)
-{
-	char buf[1024];
-
-	sprintf(buf, "%s/%s", dir, XDB_FILE);
-
-	return strdup(buf);
-}
-
 /** returns 0 if the namespace is not valid.
  */
 static inline int get_ns(const char *name)
@@ -150,365 +400,2327 @@ static inline char *attr_name (const char *name)
 	return pos ? &pos[1] : (char *) name;
 }
 
-
-static int db_initialize(struct xdb *self)
+static int pragma_int(sqlite3 *db, const char *sql)
 {
-	int ret = 0;
-	int ntables = 0;
+	int ret;
 	sqlite3_stmt *stmt;
-	char *sql = "select count(type) from sqlite_master where type='table'"
-		    "and name='xdb_xattr' or name='xdb_ns';";
-
-	ret = sqlite3_prepare_v2(self->conn, sql, -1, &stmt, 0);
-	if (ret != SQLITE_OK) {
-		ret = -EIO;
-		goto out;
-	}
 
-	ret = sqlite3_step(stmt);
-	if (ret != SQLITE_ROW) {
-		ret = -EIO;
-		goto out;
-	}
-
-	ntables = sqlite3_column_int(stmt, 0);
-	if (ntables == 0) {
-		ret = exec_simple_sql(self, xdb_schema_sqlstr);
-		if (ret) {
-			ret = -EIO;
-			goto out;
-		}
-	}
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+		return -EIO;
 
+	ret = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0)
+					       : -EIO;
 	sqlite3_finalize(stmt);
-out:
+
 	return ret;
 }
 
-static ssize_t
-do_real_getxattr(struct xdb *self, const ino_t ino, const char *name,
-			char *value, size_t size)
+/* 0 for an empty database */
+static int schema_version(sqlite3 *db)
 {
-	ssize_t ret = 0;
-	const void *val = NULL;
-	int ns = get_ns(name);
-	sqlite3_stmt *stmt = NULL;
-	
-	ret = sqlite3_prepare_v2(self->conn, xdb_sqls[SEARCH_XATTR],
-				 -1, &stmt, NULL);
-	if (ret != SQLITE_OK)
-		return -EIO;
-
-	ret = sqlite3_bind_int64(stmt, 1, ino);
-	ret |= sqlite3_bind_int(stmt, 2, ns);
-	ret |= sqlite3_bind_text(stmt, 3, attr_name(name), -1, SQLITE_STATIC);
-	if (ret) {
-		ret = -EIO;
-		goto out;
-	}
-
-	do {
-		ret = sqlite3_step(stmt);
-	} while (ret == SQLITE_BUSY);
+	int ret = pragma_int(db, "PRAGMA user_version");
 
-	if (ret != SQLITE_ROW) {
-		ret = ret == SQLITE_DONE ? -ENODATA : -EIO;
-		goto out;
-	}
+	if (ret)
+		return ret;
 
-	ret = sqlite3_column_bytes(stmt, 0);
-	val = sqlite3_column_blob(stmt, 0);
+	ret = pragma_int(db, "SELECT count(*) FROM sqlite_master "
+			     "WHERE type='table' AND name='xdb_xattr'");
+	if (ret <= 0)
+		return ret;
 
-	if (size < ret) {
-		ret = -ERANGE;
-		goto out;
-	}
+	/* from before the versions */
+	ret = pragma_int(db, "SELECT count(*) FROM "
+			     "pragma_table_info('xdb_xattr') WHERE name='name'");
 
-	memcpy(value, val, ret);
-out:
-	sqlite3_finalize(stmt);
-	return ret;
+	return ret < 0 ? ret : ret ? 1 : 2;
 }
 
-
-static ssize_t
-do_len_getxattr(struct xdb *self, const ino_t ino, const char *name)
+static int migrate(sqlite3 *db, int layout, int *version)
 {
-	ssize_t ret = 0;
-	int ns = get_ns(name);
-	sqlite3_stmt *stmt = NULL;
-	
-	ret = sqlite3_prepare_v2(self->conn, xdb_sqls[SEARCH_LEN_XATTR],
-				 -1, &stmt, NULL);
-	if (ret != SQLITE_OK)
+	int ret;
+	const char *sql;
+	char buf[32];
+
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK)
 		return -EIO;
 
-	ret = sqlite3_bind_int64(stmt, 1, ino);
-	ret |= sqlite3_bind_int(stmt, 2, ns);
-	ret |= sqlite3_bind_text(stmt, 3, attr_name(name), -1, SQLITE_STATIC);
-	if (ret) {
-		ret = -EIO;
+	/* another process may have done it in the meantime */
+	ret = schema_version(db);
+	if (ret < 0 || ret >= XDB_SCHEMA_VERSION)
 		goto out;
-	}
 
-	do {
-		ret = sqlite3_step(stmt);
-	} while (ret == SQLITE_BUSY);
+	sql = ret ? xdb_migrations[ret + 1] : xdb_schema_sqlstr;
+	ret = ret ? ret + 1 : XDB_SCHEMA_VERSION;
+	snprintf(buf, sizeof(buf), "PRAGMA user_version=%d", ret);
 
-	if (ret != SQLITE_ROW) {
-		ret = ret == SQLITE_DONE ? -ENODATA : -EIO;
-		goto out;
+	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(db, buf, NULL, NULL, NULL) != SQLITE_OK)
+		ret = -EIO;
+
+	if (ret > 0 && sql == xdb_schema_sqlstr &&
+	    layout == XDB_LAYOUT_PACKED &&
+	    sqlite3_exec(db, xdb_packed_sqlstr, NULL, NULL, NULL) != SQLITE_OK)
+		ret = -EIO;
+out:
+	if (ret < 0 ||
+	    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -EIO;
 	}
 
-	ret = sqlite3_column_int(stmt, 0);
+	*version = ret;
 
-out:
-	sqlite3_finalize(stmt);
-	return ret;
+	return 0;
 }
 
-static
-int do_update_xattr(struct xdb *self, ino_t ino, const char *name,
-			const void *value, size_t size)
+/**
+ * creates the schema in an empty database, with @layout, or brings an older
+ * one to the current version, one migration at a time. a database of a newer
+ * version is -EPROTONOSUPPORT.
+ */
+int xdb_schema_upgrade(sqlite3 *db, int layout)
 {
-	int ret = 0;
-	int ns = get_ns(name);
-	sqlite3_stmt *stmt = NULL;
-
-	ret = sqlite3_prepare_v2(self->conn, xdb_sqls[UPDATE_XATTR],
-				 -1, &stmt, NULL);
-	if (ret != SQLITE_OK)
-		return -EIO;
+	int ret;
+	int version = 0;
 
-	ret = sqlite3_bind_blob(stmt, 1, value, (int) size, NULL);
-	ret |= sqlite3_bind_int64(stmt, 2, ino);
-	ret |= sqlite3_bind_int(stmt, 3, ns);
-	ret |= sqlite3_bind_text(stmt, 4, attr_name(name), -1, SQLITE_STATIC);
-	if (ret) {
-		ret = -EIO;
-		goto out;
+	do {
+		ret = migrate(db, layout, &version);
+		if (ret)
+			return ret;
+	} while (version < XDB_SCHEMA_VERSION);
+
+	if (version > XDB_SCHEMA_VERSION) {
+		fprintf(stderr, "xattrfs: the xattr database has schema "
+				"version %d, this xattrfs knows up to %d\n",
+			version, XDB_SCHEMA_VERSION);
+		return -EPROTONOSUPPORT;
 	}
 
-	do {
-		ret = sqlite3_step(stmt);
-	} while (ret == SQLITE_BUSY);
+	return 0;
+}
 
-	ret = ret == SQLITE_DONE ? 0 : -EIO;
+/* the layout of a database, XDB_LAYOUT_*, whatever its version */
+int xdb_schema_layout(sqlite3 *db)
+{
+	int ret = pragma_int(db, "SELECT count(*) FROM sqlite_master "
+				 "WHERE type='table' AND name='xdb_packed'");
 
-out:
-	sqlite3_finalize(stmt);
-	return ret;
+	return ret < 0 ? ret : ret ? XDB_LAYOUT_PACKED : XDB_LAYOUT_ROWS;
 }
 
-static
-int do_create_xattr(struct xdb *self, ino_t ino, const char *name,
-			const void *value, size_t size)
+static int layout_of(const char *name)
 {
-	int ret = 0;
-	int ns = get_ns(name);
-	sqlite3_stmt *stmt = NULL;
+	int i;
 
-	ret = sqlite3_prepare_v2(self->conn, xdb_sqls[INSERT_NEW_XATTR],
-				 -1, &stmt, NULL);
-	if (ret != SQLITE_OK)
-		return -EIO;
+	for (i = 0; xdb_layouts[i]; i++)
+		if (0 == strcmp(name, xdb_layouts[i]))
+			return i;
 
-	ret = sqlite3_bind_int64(stmt, 1, ino);
-	ret |= sqlite3_bind_int(stmt, 2, ns);
-	ret |= sqlite3_bind_text(stmt, 3, attr_name(name), -1, SQLITE_STATIC);
-	ret |= sqlite3_bind_blob(stmt, 4, value, (int) size, NULL);
-	if (ret) {
-		ret = -EIO;
-		goto out;
-	}
+	return -1;
+}
 
-	do {
-		ret = sqlite3_step(stmt);
-	} while (ret == SQLITE_BUSY);
+/* the shards have the layout of the first, which cfg->layout can only pick */
+static int db_initialize(struct xdb_conn *self)
+{
+	struct xdb *xdb = self->xdb;
+	const char *want = xdb->cfg.layout;
+	int ret = xdb_schema_upgrade(self->conn, want ? layout_of(want)
+						       : XDB_LAYOUT_ROWS);
 
-	ret = ret == SQLITE_DONE ? 0 : -EIO;
+	if (ret)
+		return ret;
 
-out:
-	sqlite3_finalize(stmt);
-	return ret;
+	ret = xdb_schema_layout(self->conn);
+	if (ret < 0)
+		return ret;
+
+	if (self->shard == xdb->shards)
+		xdb->layout = ret;
+	else if (ret != xdb->layout)
+		return -EINVAL;
+
+	if (want && layout_of(want) != xdb->layout) {
+		fprintf(stderr, "xattrfs: the xattr database has the %s "
+				"layout, which is only picked for a new one\n",
+			xdb_layouts[xdb->layout]);
+		return -EINVAL;
+	}
+
+	if (self->shard == self->xdb->shards &&
+	    exec_simple_sql(self, xdb_dentry_sqlstr))
+		return -EIO;
+
+	return 0;
 }
 
 /**
- * external interface
+ * prepared statement cache: each statement in xdb_sqls[] is prepared once per
+ * connection, on its first use, and kept in self->stmts[] until the connection
+ * is closed. put_stmt() resets the statement and drops its bindings (names and
+ * values are bound with SQLITE_STATIC).
  */
-
-int xdb_init(struct xdb **xdb, const char *dir)
+static sqlite3_stmt *get_stmt(struct xdb_conn *self, int op)
 {
-	int ret = 0;
-	char *dbpath = NULL;
-	sqlite3 *conn = NULL;
-	struct xdb *self = NULL;
+	sqlite3_stmt *stmt = self->stmts[op];
 
-	self = calloc(1, sizeof(*self) + N_XDB_SQLS * sizeof(sqlite3_stmt *));
-	if (!self)
-		return -1;
+	if (!stmt) {
+		int ret;
 
-	dbpath = get_db_path(dir);
-	if (!dbpath)
-		goto out;
+		while ((ret = sqlite3_prepare_v3(self->conn, xdb_sqls[op], -1,
+						 SQLITE_PREPARE_PERSISTENT,
+						 &stmt, NULL)) == SQLITE_BUSY)
+			xattrfs_metrics_busy();
 
-	ret = sqlite3_open(dbpath, &conn);
-	if (ret != SQLITE_OK) {
-		ret = -EIO;
-		goto out;
+		if (ret != SQLITE_OK)
+			return NULL;
+
+		self->stmts[op] = stmt;
 	}
 
-	self->conn = conn;
-	self->dbpath = dbpath;
+	return stmt;
+}
+
+static inline void put_stmt(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
 
-	ret = db_initialize(self);
-	if (ret)
-		goto out;
+static void trace_done(struct xdb_conn *self, sqlite3_stmt *stmt);
 
-	*xdb = self;
+static inline uint64_t now_nsec(void)
+{
+	struct timespec ts;
 
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-out:
-	free(self);
-	return ret;
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-void xdb_exit(struct xdb *xdb)
+/**
+ * retries while another connection holds the lock, counting each retry. the
+ * profile of sqlite (the slow query log) covers the first attempt only, so
+ * the retries are timed here, and the statement is logged once it is through.
+ */
+static inline int step(struct xdb_conn *self, sqlite3_stmt *stmt)
 {
-	if (xdb) {
-		if (xdb->dbpath)
-			free((void *) xdb->dbpath);
+	int ret;
+	uint64_t start;
+
+	self->stepping = 1;
+	ret = sqlite3_step(stmt);
 
-		if (xdb->conn)
-			sqlite3_close(xdb->conn);
-		free(xdb);
+	if (ret == SQLITE_BUSY) {
+		start = now_nsec();
+		do {
+			xattrfs_metrics_busy();
+			self->busy++;
+		} while ((ret = sqlite3_step(stmt)) == SQLITE_BUSY);
+		self->nsec += now_nsec() - start;
 	}
+
+	self->stepping = 0;
+
+	if (ret == SQLITE_ROW)
+		self->rows++;
+
+	if (self->timed)
+		trace_done(self, stmt);
+
+	return ret;
 }
 
-int xdb_getxattr(struct xdb *xdb, ino_t ino,
-			const char *name, char *value, size_t size)
+/* the key of the statement in progress, for the slow query log */
+static inline void trace_key(struct xdb_conn *self, ino_t ino,
+				const char *name)
 {
-	return size ? do_real_getxattr(xdb, ino, name, value, size)
-		    : do_len_getxattr(xdb, ino, name);
+	self->key_ino = ino;
+	self->key_name = name;
 }
 
-int xdb_setxattr(struct xdb *xdb, ino_t ino, const char *name,
-			const char *value, size_t size, int flags)
+static inline int bind_xattr_key(struct xdb_conn *self, sqlite3_stmt *stmt,
+				 int pos, const ino_t ino, const char *name,
+				 sqlite3_int64 kid)
 {
-	int ret = 0;
-	ssize_t len = 0;
+	int ret;
 
-	/* search if the given named attr is already set. */
-	len = do_len_getxattr(xdb, ino, name);
+	trace_key(self, ino, name);
 
-	if (len == -EIO) {
-		ret = -EIO;
-		goto out;
-	}
-	else if (len == -ENODATA) {
-		if (flags & XATTR_REPLACE) {
-			ret = -ENOATTR;
-			goto out;
-		}
+	ret = sqlite3_bind_int64(stmt, pos, ino);
+	ret |= sqlite3_bind_int64(stmt, pos + 1, kid);
 
-		len = 0;	/* set a new xattr */
-	}
-	else {
-		if (flags & XATTR_CREATE) {
-			ret = -EEXIST;
-			goto out;
-		}
-	}
+	return ret;
+}
+
+static inline int bind_name(sqlite3_stmt *stmt, int pos, const char *name)
+{
+	int ret;
 
-	return len ? do_update_xattr(xdb, ino, name, value, size)
-		   : do_create_xattr(xdb, ino, name, value, size);
+	ret = sqlite3_bind_int(stmt, pos, get_ns(name));
+	ret |= sqlite3_bind_text(stmt, pos + 1, attr_name(name), -1,
+				 SQLITE_STATIC);
 
-out:
 	return ret;
 }
 
-int xdb_removexattr(struct xdb *xdb, ino_t ino, const char *name)
+/**
+ * the kid of @name in the shard of @self: from the name map, or else from
+ * xdb_name, which the writer adds it to if @create. returns 0 if the name has
+ * no kid.
+ *
+ * a new kid is at least next_kid, so that a name rolled back with its
+ * transaction does not leave its kid to another one, in case a reader still
+ * has it from the map.
+ */
+static sqlite3_int64 name_id(struct xdb_conn *self, const char *name,
+				int create)
 {
-	int ret = 0;
-	int ns = get_ns(name);
-	sqlite3_stmt *stmt = NULL;
+	sqlite3_int64 kid = xdb_names_lookup(self->shard->names, name);
+	sqlite3_stmt *stmt;
+	int ret;
 
-	ret = sqlite3_prepare_v2(xdb->conn, xdb_sqls[REMOVE_XATTR],
-				 -1, &stmt, NULL);
-	if (ret != SQLITE_OK)
+	if (kid)
+		return kid;
+
+	stmt = get_stmt(self, SEARCH_NAME);
+	if (!stmt)
 		return -EIO;
 
-	ret = sqlite3_bind_int64(stmt, 1, ino);
-	ret |= sqlite3_bind_int(stmt, 2, ns);
-	ret |= sqlite3_bind_text(stmt, 3, attr_name(name), -1, SQLITE_STATIC);
-	if (ret) {
-		ret = -EIO;
-		goto out;
+	trace_key(self, 0, name);
+	if (bind_name(stmt, 1, name)) {
+		put_stmt(stmt);
+		return -EIO;
 	}
 
-	do {
-		ret = sqlite3_step(stmt);
-	} while (ret == SQLITE_BUSY);
+	ret = step(self, stmt);
+	if (ret == SQLITE_ROW)
+		kid = sqlite3_column_int64(stmt, 0);
+	put_stmt(stmt);
 
-	if (ret != SQLITE_DONE) {
-		ret = -EIO;
-		goto out;
-	}
+	if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+		return -EIO;
 
-	if (sqlite3_changes(xdb->conn) == 0) {
-		ret = -ENOENT;
-		goto out;
+	if (!kid && create) {
+		stmt = get_stmt(self, INSERT_NAME);
+		if (!stmt)
+			return -EIO;
+
+		ret = sqlite3_bind_int64(stmt, 1, self->next_kid);
+		ret |= bind_name(stmt, 2, name);
+		if (ret == 0)
+			ret = step(self, stmt) == SQLITE_DONE ? 0 : -EIO;
+		put_stmt(stmt);
+		if (ret)
+			return -EIO;
+
+		kid = sqlite3_last_insert_rowid(self->conn);
+		self->next_kid = kid + 1;
 	}
-	ret = 0;
 
-out:
-	sqlite3_finalize(stmt);
-	return ret;
+	if (kid)
+		xdb_names_insert(self->shard->names, name, kid);
+
+	return kid;
 }
 
-int xdb_listxattr(struct xdb *xdb, ino_t ino, char *list, size_t size)
+static ssize_t read_blob(struct xdb_conn *self, sqlite3_int64 bid,
+			char *value, size_t size)
 {
-	int ret = 0;
-	ssize_t bytes = 0;
-	sqlite3_stmt *stmt = NULL;
-	char *pos = list;
-	int mode_fill = (list != NULL && size > 0);
+	int ret;
+	sqlite3_blob *blob;
 
-	ret = sqlite3_prepare_v2(xdb->conn, xdb_sqls[LIST_XATTR],
-				 -1, &stmt, NULL);
+	ret = sqlite3_blob_open(self->conn, "main", "xdb_blob", "data", bid, 0,
+				&blob);
 	if (ret != SQLITE_OK)
 		return -EIO;
 
-	ret = sqlite3_bind_int64(stmt, 1, ino);
-	if (ret) {
+	if ((size_t) sqlite3_blob_bytes(blob) != size ||
+	    sqlite3_blob_read(blob, value, size, 0) != SQLITE_OK)
 		ret = -EIO;
-		goto out;
-	}
+	else
+		ret = size;
 
-	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
-		int ns = sqlite3_column_int(stmt, 0);
-		const char *name = (char *) sqlite3_column_text(stmt, 1);
+	sqlite3_blob_close(blob);
 
-		/** FIXME!! handle exceptions here accordingly */
+	return ret;
+}
 
-		if (mode_fill) {
-			bytes += sprintf(pos, "%s%s%c",
-					get_nsstr(ns), name, '\0');
-			pos = &list[bytes];
+/**
+ * a blob row of @size bytes is allocated with zeroblob(), and the value is
+ * written into its pages in place. the xattr row that points to it with *@bid
+ * is written after.
+ */
+static int write_blob(struct xdb_conn *self, const void *value, size_t size,
+			sqlite3_int64 *bid)
+{
+	int ret;
+	sqlite3_stmt *stmt;
+	sqlite3_blob *blob;
+
+	stmt = get_stmt(self, INSERT_BLOB);
+	if (!stmt)
+		return -EIO;
+
+	ret = sqlite3_bind_int64(stmt, 1, size);
+	if (ret == 0)
+		ret = step(self, stmt) == SQLITE_DONE ? 0 : -EIO;
+	put_stmt(stmt);
+	if (ret)
+		return -EIO;
+
+	*bid = sqlite3_last_insert_rowid(self->conn);
+
+	ret = sqlite3_blob_open(self->conn, "main", "xdb_blob", "data", *bid, 1,
+				&blob);
+	if (ret != SQLITE_OK)
+		return -EIO;
+
+	ret = sqlite3_blob_write(blob, value, size, 0);
+	ret |= sqlite3_blob_close(blob);
+
+	return ret == SQLITE_OK ? 0 : -EIO;
+}
+
+static int remove_blob(struct xdb_conn *self, sqlite3_int64 bid)
+{
+	int ret;
+	sqlite3_stmt *stmt = get_stmt(self, REMOVE_BLOB);
+
+	if (!stmt)
+		return -EIO;
+
+	ret = sqlite3_bind_int64(stmt, 1, bid);
+	if (ret == 0)
+		ret = step(self, stmt) == SQLITE_DONE ? 0 : -EIO;
+	put_stmt(stmt);
+
+	return ret ? -EIO : 0;
+}
+
+/**
+ * the packed layout (-o layout=packed): the record of an inode is read whole,
+ * and a listxattr puts the values that came with it in the value cache, for
+ * the getxattrs that usually follow. a change writes the record back whole,
+ * with the entry where it was: a value of the same size leaves the record the
+ * same size, which sqlite overwrites in place, writing only the pages that
+ * changed.
+ */
+
+static inline int packed(struct xdb_conn *self)
+{
+	return self->xdb->layout == XDB_LAYOUT_PACKED;
+}
+
+/* the record of @ino, in @stmt (PACKED_SEARCH) until it is put */
+static int packed_fetch(struct xdb_conn *self, sqlite3_stmt *stmt, ino_t ino,
+			const char *name, const unsigned char **rec,
+			size_t *len)
+{
+	int ret;
+
+	trace_key(self, ino, name);
+	if (sqlite3_bind_int64(stmt, 1, ino))
+		return -EIO;
+
+	*rec = NULL;
+	*len = 0;
+
+	ret = step(self, stmt);
+	if (ret == SQLITE_DONE)
+		return 0;
+	if (ret != SQLITE_ROW)
+		return -EIO;
+
+	*rec = sqlite3_column_blob(stmt, 0);
+	*len = sqlite3_column_bytes(stmt, 0);
+
+	return 0;
+}
+
+/* "user.foo" of an entry, into a buffer of PACKED_NAME_MAX */
+#define PACKED_NAME_MAX		(sizeof("security.") + UINT8_MAX)
+
+static int packed_name(const struct xdb_packed_entry *e, char *buf)
+{
+	size_t nslen;
+
+	if (e->nid >= N_XATTR_NS)
+		return -EIO;
+
+	nslen = get_nsstrlen(e->nid);
+	if (nslen)
+		memcpy(buf, get_nsstr(e->nid), nslen);
+	memcpy(&buf[nslen], e->name, e->namelen);
+	buf[nslen + e->namelen] = '\0';
+
+	return nslen + e->namelen;
+}
+
+/**
+ * the values of a record, but those out of line, into the value cache. not
+ * with the group commit: the queue may have newer values of these names, and
+ * only the names asked for are looked up there (see sql_getxattr()).
+ */
+static inline int packed_prefills(struct xdb_conn *self)
+{
+	return self->xdb->cache && !self->shard->wq;
+}
+
+static void packed_prefill(struct xdb_conn *self, ino_t ino,
+			const unsigned char *rec, size_t len, uint64_t gen)
+{
+	size_t pos = 0;
+	struct xdb_packed_entry e;
+	char name[PACKED_NAME_MAX];
+
+	while (xdb_packed_next(rec, len, &pos, &e) == 1) {
+		if (e.blob || packed_name(&e, name) < 0)
+			continue;
+
+		xdb_cache_prefill(self->xdb->cache, ino, name,
+				  (const char *) &rec[e.voff], e.size, gen);
+	}
+}
+
+/* a @size of 0 returns the size of the value */
+static ssize_t packed_getxattr(struct xdb_conn *self, ino_t ino,
+			const char *name, char *value, size_t size)
+{
+	ssize_t ret;
+	size_t len;
+	const unsigned char *rec;
+	struct xdb_packed_entry e;
+	sqlite3_stmt *stmt = get_stmt(self, PACKED_SEARCH);
+
+	if (!stmt)
+		return -EIO;
+
+	ret = packed_fetch(self, stmt, ino, name, &rec, &len);
+	if (ret)
+		goto out;
+
+	ret = xdb_packed_find(rec, len, get_ns(name), attr_name(name), &e);
+	if (ret <= 0) {
+		ret = ret ? ret : -ENODATA;
+		goto out;
+	}
+
+	if (size == 0)
+		ret = e.size;
+	else if (size < e.size)
+		ret = -ERANGE;
+	else if (e.blob)	/* read while the statement holds the snapshot */
+		ret = read_blob(self, xdb_packed_bid(rec, &e), value, e.size);
+	else {
+		memcpy(value, &rec[e.voff], e.size);
+		ret = e.size;
+	}
+out:
+	put_stmt(stmt);
+	return ret;
+}
+
+/* the record of @ino becomes @len bytes of @buf, or goes if it is empty */
+static int packed_store(struct xdb_conn *self, ino_t ino,
+			const unsigned char *buf, size_t len)
+{
+	int ret;
+	sqlite3_stmt *stmt = get_stmt(self, len ? PACKED_UPSERT
+						: PACKED_REMOVE);
+
+	if (!stmt)
+		return -EIO;
+
+	ret = sqlite3_bind_int64(stmt, 1, ino);
+	if (len)
+		ret |= sqlite3_bind_blob(stmt, 2, buf, (int) len,
+					 SQLITE_STATIC);
+	if (ret == 0)
+		ret = step(self, stmt) == SQLITE_DONE ? 0 : -EIO;
+	put_stmt(stmt);
+
+	return ret ? -EIO : 0;
+}
+
+/**
+ * setxattr, or removexattr with @remove. the entry of the name is replaced
+ * where it is in the record, or added at its end, and the flags are checked
+ * against the record, which only the writer changes.
+ */
+static int packed_update(struct xdb_conn *self, ino_t ino, const char *name,
+			const void *value, size_t size, int flags, int remove)
+{
+	int ret;
+	int found = 0;
+	int nid = get_ns(name);
+	const char *aname = attr_name(name);
+	size_t namelen = strlen(aname);
+	size_t threshold = self->xdb->cfg.blob_threshold;
+	int blob = !remove && threshold && size > threshold;
+	size_t elen = remove ? 0 : xdb_packed_len(namelen, size, blob);
+	size_t len, off, tail;
+	int savepoint = 0;
+	sqlite3_int64 bid = 0;
+	sqlite3_int64 old_bid = 0;
+	const unsigned char *rec;
+	unsigned char *buf = NULL;
+	struct xdb_packed_entry e;
+	sqlite3_stmt *stmt;
+
+	if (!remove && !elen)
+		return -ERANGE;
+
+	stmt = get_stmt(self, PACKED_SEARCH);
+	if (!stmt)
+		return -EIO;
+
+	ret = packed_fetch(self, stmt, ino, name, &rec, &len);
+	if (ret == 0)
+		ret = found = xdb_packed_find(rec, len, nid, aname, &e);
+	if (ret < 0)
+		goto out;
+
+	ret = 0;
+	if (!found && (remove || (flags & XATTR_REPLACE)))
+		ret = -ENOATTR;
+	else if (found && !remove && (flags & XATTR_CREATE))
+		ret = -EEXIST;
+	if (ret)
+		goto out;
+
+	off = found ? e.off : len;
+	tail = found ? len - e.off - e.len : 0;
+
+	buf = malloc(off + elen + tail + 1);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (off)
+		memcpy(buf, rec, off);
+	if (tail)
+		memcpy(&buf[off + elen], &rec[e.off + e.len], tail);
+	if (found && e.blob)
+		old_bid = xdb_packed_bid(rec, &e);
+
+	put_stmt(stmt);
+	stmt = NULL;
+
+	/* the record and its blobs go together, also outside a transaction */
+	if (blob || old_bid) {
+		if (exec_simple_sql(self, "SAVEPOINT xdb_blob")) {
+			ret = -EIO;
+			goto out;
 		}
+		savepoint = 1;
+	}
+
+	if (old_bid)
+		ret = remove_blob(self, old_bid);
+	if (ret == 0 && blob)
+		ret = write_blob(self, value, size, &bid);
+	if (ret)
+		goto out;
+
+	if (!remove)
+		xdb_packed_put(&buf[off], nid, aname, namelen, value, size,
+			       blob, bid);
+
+	ret = packed_store(self, ino, buf, off + elen + tail);
+out:
+	if (stmt)
+		put_stmt(stmt);
+	if (savepoint) {
+		if (ret)
+			exec_simple_sql(self, "ROLLBACK TO xdb_blob");
+		exec_simple_sql(self, "RELEASE xdb_blob");
+	}
+	free(buf);
+	return ret;
+}
+
+static ssize_t packed_listxattr(struct xdb_conn *self, ino_t ino, char **list)
+{
+	ssize_t ret;
+	size_t len, pos;
+	size_t total = 0;
+	uint64_t gen = 0;
+	char *buf = NULL;
+	const unsigned char *rec;
+	struct xdb_packed_entry e;
+	char name[PACKED_NAME_MAX];
+	sqlite3_stmt *stmt = get_stmt(self, PACKED_SEARCH);
+
+	if (!stmt)
+		return -EIO;
+
+	if (packed_prefills(self))
+		gen = xdb_cache_gen(self->xdb->cache);
+
+	ret = packed_fetch(self, stmt, ino, NULL, &rec, &len);
+	if (ret || !rec)
+		goto out;
+
+	if (packed_prefills(self))
+		packed_prefill(self, ino, rec, len, gen);
+
+	/* the sizes first, then the names */
+	for (pos = 0; (ret = xdb_packed_next(rec, len, &pos, &e)) == 1; )
+		total += get_nsstrlen(e.nid < N_XATTR_NS ? e.nid : 0) +
+			 e.namelen + 1;
+	if (ret < 0)
+		goto out;
+
+	buf = malloc(total);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (pos = 0, total = 0; xdb_packed_next(rec, len, &pos, &e) == 1; ) {
+		ret = packed_name(&e, name);
+		if (ret < 0)
+			goto out;
+
+		memcpy(&buf[total], name, ret + 1);
+		total += ret + 1;
+	}
+
+	*list = buf;
+	buf = NULL;
+	ret = total;
+out:
+	free(buf);
+	put_stmt(stmt);
+	return ret;
+}
+
+/* the number of xattrs removed */
+static int packed_purge(struct xdb_conn *self, ino_t ino)
+{
+	int ret;
+	int n = 0;
+	size_t len, pos = 0;
+	const unsigned char *rec;
+	struct xdb_packed_entry e;
+	sqlite3_stmt *stmt = get_stmt(self, PACKED_SEARCH);
+
+	if (!stmt)
+		return -EIO;
+
+	if (exec_simple_sql(self, "SAVEPOINT xdb_blob")) {
+		put_stmt(stmt);
+		return -EIO;
+	}
+
+	ret = packed_fetch(self, stmt, ino, NULL, &rec, &len);
+
+	while (ret == 0 && (ret = xdb_packed_next(rec, len, &pos, &e)) == 1) {
+		ret = e.blob ? remove_blob(self, xdb_packed_bid(rec, &e)) : 0;
+		n++;
+	}
+
+	put_stmt(stmt);
+
+	if (ret == 0 && n)
+		ret = packed_store(self, ino, NULL, 0);
+
+	if (ret)
+		exec_simple_sql(self, "ROLLBACK TO xdb_blob");
+	exec_simple_sql(self, "RELEASE xdb_blob");
+
+	return ret ? ret : n;
+}
+
+static ssize_t
+do_real_getxattr(struct xdb_conn *self, const ino_t ino, const char *name,
+			char *value, size_t size)
+{
+	ssize_t ret = 0;
+	const void *val = NULL;
+	sqlite3_int64 kid;
+	sqlite3_stmt *stmt = NULL;
+
+	if (packed(self))
+		return packed_getxattr(self, ino, name, value, size);
+
+	kid = name_id(self, name, 0);
+	if (kid <= 0)
+		return kid ? kid : -ENODATA;
+
+	stmt = get_stmt(self, SEARCH_XATTR);
+	if (!stmt)
+		return -EIO;
+
+	ret = bind_xattr_key(self, stmt, 1, ino, name, kid);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = step(self, stmt);
+
+	if (ret != SQLITE_ROW) {
+		ret = ret == SQLITE_DONE ? -ENODATA : -EIO;
+		goto out;
+	}
+
+	/* out of line, read while the statement holds the snapshot */
+	if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+		ret = sqlite3_column_int64(stmt, 0);
+		if (size < ret)
+			ret = -ERANGE;
 		else
-			bytes += get_nsstrlen(ns) + strlen(name) + 1;
+			ret = read_blob(self, sqlite3_column_int64(stmt, 1),
+					value, ret);
+		goto out;
 	}
 
-	if (ret != SQLITE_DONE) {
-		errno = -EIO;
+	ret = sqlite3_column_bytes(stmt, 0);
+	val = sqlite3_column_blob(stmt, 0);
+
+	if (size < ret) {
+		ret = -ERANGE;
 		goto out;
 	}
 
-	ret = bytes;
+	if (ret)
+		memcpy(value, val, ret);
 out:
-	sqlite3_finalize(stmt);
+	put_stmt(stmt);
+	return ret;
+}
+
+
+static ssize_t
+do_len_getxattr(struct xdb_conn *self, const ino_t ino, const char *name)
+{
+	ssize_t ret = 0;
+	sqlite3_int64 kid;
+	sqlite3_stmt *stmt = NULL;
+
+	if (packed(self))
+		return packed_getxattr(self, ino, name, NULL, 0);
+
+	kid = name_id(self, name, 0);
+	if (kid <= 0)
+		return kid ? kid : -ENODATA;
+
+	stmt = get_stmt(self, SEARCH_LEN_XATTR);
+	if (!stmt)
+		return -EIO;
+
+	ret = bind_xattr_key(self, stmt, 1, ino, name, kid);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = step(self, stmt);
+
+	if (ret != SQLITE_ROW) {
+		ret = ret == SQLITE_DONE ? -ENODATA : -EIO;
+		goto out;
+	}
+
+	ret = sqlite3_column_int(stmt, 0);
+
+out:
+	put_stmt(stmt);
 	return ret;
 }
 
+/**
+ * a single statement per setxattr, so the existence check and the write are
+ * atomic: INSERT fails on the unique (ino, kid) index for XATTR_CREATE,
+ * UPDATE changes no row for XATTR_REPLACE, and UPSERT does either otherwise.
+ */
+static int set_op(int flags)
+{
+	if (flags & XATTR_CREATE)
+		return INSERT_NEW_XATTR;
+	else if (flags & XATTR_REPLACE)
+		return UPDATE_XATTR;
+	else
+		return UPSERT_XATTR;
+}
+
+static
+int do_setxattr(struct xdb_conn *self, ino_t ino, const char *name,
+			const void *value, size_t size, int flags)
+{
+	int ret = 0;
+	int op = set_op(flags);
+	size_t threshold = self->xdb->cfg.blob_threshold;
+	int blob = threshold && size > threshold;
+	int txn;
+	int created;
+	sqlite3_int64 kid;
+	sqlite3_int64 bid = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	if (packed(self))
+		return packed_update(self, ino, name, value, size, flags, 0);
+
+	/* a name to replace has a kid already */
+	kid = name_id(self, name, 0);
+	if (kid < 0)
+		return kid;
+	if (!kid && op == UPDATE_XATTR)
+		return -ENOATTR;
+
+	/* a new name, the row and its blob go together, also outside a txn */
+	created = !kid;
+	txn = blob || created;
+	if (txn && exec_simple_sql(self, "SAVEPOINT xdb_set"))
+		return -EIO;
+
+	if (created) {
+		kid = name_id(self, name, 1);
+		if (kid <= 0) {
+			ret = kid ? kid : -EIO;
+			goto out_txn;
+		}
+	}
+
+	if (blob) {
+		ret = write_blob(self, value, size, &bid);
+		if (ret)
+			goto out_txn;
+	}
+
+	stmt = get_stmt(self, op);
+	if (!stmt) {
+		ret = -EIO;
+		goto out_txn;
+	}
+
+	ret = bind_xattr_key(self, stmt, 1, ino, name, kid);
+	if (blob) {
+		ret |= sqlite3_bind_int64(stmt, 3, size);
+		ret |= sqlite3_bind_int64(stmt, 4, bid);
+	}
+	else
+		ret |= sqlite3_bind_blob(stmt, 3, value, (int) size,
+					 SQLITE_STATIC);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = step(self, stmt);
+
+	if (ret == SQLITE_DONE)
+		ret = op == UPDATE_XATTR && sqlite3_changes(self->conn) == 0 ?
+			-ENOATTR : 0;
+	else if ((ret & 0xff) == SQLITE_CONSTRAINT)
+		ret = -EEXIST;
+	else
+		ret = -EIO;
+
+out:
+	put_stmt(stmt);
+out_txn:
+	if (txn) {
+		if (ret)
+			exec_simple_sql(self, "ROLLBACK TO xdb_set");
+		exec_simple_sql(self, "RELEASE xdb_set");
+	}
+
+	/* the name map has the kid of the name that is gone */
+	if (ret && created)
+		xdb_names_clear(self->shard->names);
+
+	return ret;
+}
+
+static int do_removexattr(struct xdb_conn *self, ino_t ino, const char *name)
+{
+	int ret = 0;
+	sqlite3_int64 kid;
+	sqlite3_stmt *stmt = NULL;
+
+	if (packed(self))
+		return packed_update(self, ino, name, NULL, 0, 0, 1);
+
+	kid = name_id(self, name, 0);
+	if (kid <= 0)
+		return kid ? kid : -ENOATTR;
+
+	stmt = get_stmt(self, REMOVE_XATTR);
+	if (!stmt)
+		return -EIO;
+
+	ret = bind_xattr_key(self, stmt, 1, ino, name, kid);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = step(self, stmt);
+
+	if (ret != SQLITE_DONE) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = sqlite3_changes(self->conn) == 0 ? -ENOATTR : 0;
+
+out:
+	put_stmt(stmt);
+	return ret;
+}
+
+/**
+ * builds the packed list of names ("user.a\0security.b\0..") in a new buffer,
+ * which the caller should free.
+ */
+static ssize_t do_listxattr(struct xdb_conn *self, ino_t ino, char **list)
+{
+	ssize_t ret = 0;
+	size_t len = 0;
+	size_t bufsize = 0;
+	char *buf = NULL;
+	sqlite3_stmt *stmt = NULL;
+
+	if (packed(self))
+		return packed_listxattr(self, ino, list);
+
+	stmt = get_stmt(self, LIST_XATTR);
+	if (!stmt)
+		return -EIO;
+
+	trace_key(self, ino, NULL);
+	ret = sqlite3_bind_int64(stmt, 1, ino);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	while (SQLITE_ROW == (ret = step(self, stmt))) {
+		int ns = sqlite3_column_int(stmt, 0);
+		const char *name = (char *) sqlite3_column_text(stmt, 1);
+		size_t nslen = get_nsstrlen(ns);
+		size_t namelen = sqlite3_column_bytes(stmt, 1);
+
+		if (len + nslen + namelen + 1 > bufsize) {
+			char *tmp;
+
+			do {
+				bufsize = bufsize ? bufsize << 1 : 256;
+			} while (len + nslen + namelen + 1 > bufsize);
+
+			tmp = realloc(buf, bufsize);
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			buf = tmp;
+		}
+
+		if (nslen)
+			memcpy(&buf[len], get_nsstr(ns), nslen);
+		memcpy(&buf[len + nslen], name, namelen);
+		len += nslen + namelen;
+		buf[len++] = '\0';
+	}
+
+	if (ret != SQLITE_DONE) {
+		ret = -EIO;
+		goto out;
+	}
+
+	*list = buf;
+	buf = NULL;
+	ret = len;
+
+out:
+	free(buf);
+	put_stmt(stmt);
+	return ret;
+}
+
+static int do_purge(struct xdb_conn *self, ino_t ino)
+{
+	int ret = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	if (packed(self))
+		return packed_purge(self, ino);
+
+	stmt = get_stmt(self, PURGE_XATTR);
+	if (!stmt)
+		return -EIO;
+
+	trace_key(self, ino, NULL);
+	ret = sqlite3_bind_int64(stmt, 1, ino);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = step(self, stmt);
+
+	ret = ret == SQLITE_DONE ? sqlite3_changes(self->conn) : -EIO;
+
+out:
+	put_stmt(stmt);
+	return ret;
+}
+
+static int do_scan_ino(struct xdb_conn *self, ino_t after, ino_t *inos,
+			int count)
+{
+	int ret = 0;
+	int n = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	stmt = get_stmt(self, packed(self) ? PACKED_SCAN : SCAN_INO);
+	if (!stmt)
+		return -EIO;
+
+	trace_key(self, after, NULL);
+	ret = sqlite3_bind_int64(stmt, 1, after);
+	ret |= sqlite3_bind_int(stmt, 2, count);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	while (SQLITE_ROW == (ret = step(self, stmt)))
+		inos[n++] = sqlite3_column_int64(stmt, 0);
+
+	ret = ret == SQLITE_DONE ? n : -EIO;
+
+out:
+	put_stmt(stmt);
+	return ret;
+}
+
+/* appends the inodes matching a query to *@inos, which grows as needed */
+static int do_query(struct xdb_conn *self, const char *name,
+			const char *value, size_t len, int prefix,
+			ino_t **inos, int *count, int *size)
+{
+	int ret = 0;
+	int op = !value ? QUERY_EXISTS : prefix ? QUERY_PREFIX : QUERY_EQUAL;
+	int pos = 2;		/* of the value */
+	sqlite3_int64 kid = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	/* no file has it */
+	if (!packed(self) && (kid = name_id(self, name, 0)) <= 0)
+		return kid;
+
+	/* a scan of the records, which are matched by name */
+	if (packed(self)) {
+		op += PACKED_QUERY_EXISTS - QUERY_EXISTS;
+		pos = 3;
+	}
+
+	stmt = get_stmt(self, op);
+	if (!stmt)
+		return -EIO;
+
+	trace_key(self, 0, name);
+	if (packed(self))
+		ret = bind_name(stmt, 1, name);
+	else
+		ret = sqlite3_bind_int64(stmt, 1, kid);
+	if (value)
+		ret |= sqlite3_bind_blob(stmt, pos, value, (int) len,
+					 SQLITE_STATIC);
+	if (prefix)
+		ret |= sqlite3_bind_int64(stmt, pos + 1, len);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	while (SQLITE_ROW == (ret = step(self, stmt))) {
+		if (*count == *size) {
+			int n = *size ? *size * 2 : 64;
+			ino_t *tmp = realloc(*inos, sizeof(*tmp) * n);
+
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto out;
+			}
+
+			*inos = tmp;
+			*size = n;
+		}
+
+		(*inos)[(*count)++] = sqlite3_column_int64(stmt, 0);
+	}
+
+	ret = ret == SQLITE_DONE ? 0 : -EIO;
+
+out:
+	put_stmt(stmt);
+	return ret;
+}
+
+static int do_dentry(struct xdb_conn *self, int op, ino_t parent,
+			const char *name, ino_t ino)
+{
+	int ret = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	stmt = get_stmt(self, op);
+	if (!stmt)
+		return -EIO;
+
+	trace_key(self, parent, name);
+	ret = sqlite3_bind_int64(stmt, 1, parent);
+	ret |= sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+	if (op == ADD_DENTRY)
+		ret |= sqlite3_bind_int64(stmt, 3, ino);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = step(self, stmt);
+
+	ret = ret == SQLITE_DONE ? 0 : -EIO;
+
+out:
+	put_stmt(stmt);
+	return ret;
+}
+
+static inline int str_oneof(const char *str, const char **list)
+{
+	for ( ; *list; list++)
+		if (0 == strcmp(str, *list))
+			return 1;
+	return 0;
+}
+
+static int apply_config(struct xdb_conn *c, const struct xdb_config *cfg,
+			int writer)
+{
+	int ret = 0;
+	char sql[128];
+
+	/* the journal mode is persistent, and readers cannot change it */
+	if (writer) {
+		sprintf(sql, "PRAGMA journal_mode=%s", cfg->journal);
+		ret |= exec_simple_sql(c, sql);
+
+		if (cfg->checkpoint >= 0) {
+			sprintf(sql, "PRAGMA wal_autocheckpoint=%d",
+				cfg->checkpoint);
+			ret |= exec_simple_sql(c, sql);
+		}
+	}
+
+	sprintf(sql, "PRAGMA synchronous=%s", cfg->sync);
+	ret |= exec_simple_sql(c, sql);
+
+	if (cfg->cache_size > 0) {
+		sprintf(sql, "PRAGMA cache_size=-%ld", cfg->cache_size);
+		ret |= exec_simple_sql(c, sql);
+	}
+
+	if (cfg->mmap_size > 0) {
+		sprintf(sql, "PRAGMA mmap_size=%lld", cfg->mmap_size);
+		ret |= exec_simple_sql(c, sql);
+	}
+
+	return ret ? -EIO : 0;
+}
+
+static void close_conn(struct xdb_conn *c)
+{
+	int i;
+
+	for (i = 0; i < N_XDB_SQLS; i++)
+		sqlite3_finalize(c->stmts[i]);
+
+	sqlite3_close(c->conn);
+	free(c);
+}
+
+/**
+ * the slow query log (-o slow_log): sqlite times every statement of a
+ * connection, and only those over the threshold cost more than a comparison,
+ * so the log can stay on. a statement is profiled when it is done, or reset
+ * after a row.
+ */
+
+/* quoted, with the bytes that would break the line escaped */
+static void log_str(FILE *fp, const char *str)
+{
+	const unsigned char *c;
+
+	fputc('"', fp);
+	for (c = (const unsigned char *) str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fprintf(fp, "\\%c", *c);
+		else if (*c < 0x20 || *c == 0x7f)
+			fprintf(fp, "\\x%02x", *c);
+		else
+			fputc(*c, fp);
+	}
+	fputc('"', fp);
+}
+
+static int is_cached(struct xdb_conn *self, sqlite3_stmt *stmt)
+{
+	int i;
+
+	for (i = 0; i < N_XDB_SQLS; i++)
+		if (self->stmts[i] == stmt)
+			return 1;
+
+	return 0;
+}
+
+static void log_slow(struct xdb_conn *self, sqlite3_stmt *stmt,
+			uint64_t nsec, unsigned int busy, unsigned int rows)
+{
+	FILE *fp = self->xdb->slow_log;
+	int cached = is_cached(self, stmt);
+	struct timespec now;
+	struct tm tm;
+	char date[32];
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	localtime_r(&now.tv_sec, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	/* the changes of a write, or the rows a read returned */
+	if (cached && !sqlite3_stmt_readonly(stmt))
+		rows = sqlite3_changes(self->conn);
+
+	flockfile(fp);
+	fprintf(fp, "%s.%03ld shard=%d ms=%.3f busy=%u rows=%u", date,
+		now.tv_nsec / 1000000, (int) (self->shard - self->xdb->shards),
+		nsec / 1e6, busy, rows);
+
+	/* BEGIN, COMMIT and the like have no key */
+	if (cached) {
+		if (self->key_ino)
+			fprintf(fp, " ino=%llu", _llu(self->key_ino));
+		if (self->key_name) {
+			fputs(" name=", fp);
+			log_str(fp, self->key_name);
+		}
+	}
+
+	fputs(" sql=", fp);
+	log_str(fp, sqlite3_sql(stmt));
+	fputc('\n', fp);
+	funlockfile(fp);
+}
+
+static void trace_done(struct xdb_conn *self, sqlite3_stmt *stmt)
+{
+	if (self->nsec >= (uint64_t) self->xdb->cfg.slow_ms * 1000000ULL)
+		log_slow(self, stmt, self->nsec, self->busy, self->rows);
+
+	self->nsec = 0;
+	self->busy = 0;
+	self->rows = 0;
+	self->timed = 0;
+}
+
+static int trace_slow(unsigned int type, void *ctx, void *p, void *x)
+{
+	struct xdb_conn *self = ctx;
+
+	self->nsec += *(sqlite3_int64 *) x;
+
+	/* step() may still retry it */
+	if (self->stepping)
+		self->timed = 1;
+	else
+		trace_done(self, p);
+
+	return 0;
+}
+
+static struct xdb_conn *open_conn(struct xdb *xdb, struct xdb_shard *shard,
+				  int flags)
+{
+	struct xdb_conn *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return NULL;
+
+	/* a connection is never used by two threads at once */
+	flags |= SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI;
+
+	if (sqlite3_open_v2(shard->memdb ? shard->memdb : shard->dbpath,
+			    &c->conn, flags, NULL) != SQLITE_OK) {
+		sqlite3_close(c->conn);
+		free(c);
+		return NULL;
+	}
+
+	sqlite3_busy_timeout(c->conn, XDB_BUSY_TIMEOUT);
+	c->xdb = xdb;
+	c->shard = shard;
+
+	/* for the queries of the packed layout */
+	if (xdb_packed_register(c->conn)) {
+		sqlite3_close(c->conn);
+		free(c);
+		return NULL;
+	}
+
+	if (apply_config(c, &xdb->cfg, flags & SQLITE_OPEN_READWRITE)) {
+		close_conn(c);
+		return NULL;
+	}
+
+	if (xdb->slow_log)
+		sqlite3_trace_v2(c->conn, SQLITE_TRACE_PROFILE, trace_slow, c);
+
+	pthread_mutex_lock(&xdb->lock);
+	c->next = xdb->conns;
+	xdb->conns = c;
+	pthread_mutex_unlock(&xdb->lock);
+
+	return c;
+}
+
+/* thread exit: keep the connection for the next thread */
+static void release_reader(void *data)
+{
+	struct xdb_conn *c = (struct xdb_conn *) data;
+	struct xdb *xdb = c->xdb;
+
+	pthread_mutex_lock(&xdb->lock);
+	c->next_idle = c->shard->idle;
+	c->shard->idle = c;
+	pthread_mutex_unlock(&xdb->lock);
+}
+
+static inline struct xdb_shard *get_shard(struct xdb *xdb, ino_t ino)
+{
+	return &xdb->shards[xdb_shard_of(ino, xdb->nshards)];
+}
+
+static inline void set_counter(uint64_t *counter, uint64_t val)
+{
+	__atomic_store_n(counter, val, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t get_counter(uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * connections are opened without a mutex (SQLITE_OPEN_NOMUTEX), so only the
+ * thread using a connection may ask for its status. it does every
+ * XDB_STATUS_INTERVAL uses, and xdb_status() sums the samples.
+ */
+static void sample_status(struct xdb_conn *self)
+{
+	int cur, hi;
+	struct xdb_status *st = &self->status;
+
+	if (++self->uses < XDB_STATUS_INTERVAL)
+		return;
+
+	self->uses = 0;
+
+	sqlite3_db_status(self->conn, SQLITE_DBSTATUS_CACHE_USED, &cur, &hi, 0);
+	set_counter(&st->cache_used, cur);
+	sqlite3_db_status(self->conn, SQLITE_DBSTATUS_SCHEMA_USED, &cur, &hi,
+			  0);
+	set_counter(&st->schema_used, cur);
+	sqlite3_db_status(self->conn, SQLITE_DBSTATUS_STMT_USED, &cur, &hi, 0);
+	set_counter(&st->stmt_used, cur);
+
+	/* these are reset by each sample, and accumulate here */
+	sqlite3_db_status(self->conn, SQLITE_DBSTATUS_CACHE_HIT, &cur, &hi, 1);
+	set_counter(&st->cache_hits, st->cache_hits + cur);
+	sqlite3_db_status(self->conn, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hi,
+			  1);
+	set_counter(&st->cache_misses, st->cache_misses + cur);
+	sqlite3_db_status(self->conn, SQLITE_DBSTATUS_CACHE_WRITE, &cur, &hi,
+			  1);
+	set_counter(&st->cache_writes, st->cache_writes + cur);
+}
+
+static struct xdb_conn *get_reader(struct xdb *xdb, struct xdb_shard *shard)
+{
+	struct xdb_conn *c = pthread_getspecific(shard->key);
+
+	if (c) {
+		sample_status(c);
+		return c;
+	}
+
+	pthread_mutex_lock(&xdb->lock);
+	c = shard->idle;
+	if (c)
+		shard->idle = c->next_idle;
+	pthread_mutex_unlock(&xdb->lock);
+
+	if (!c) {
+		c = open_conn(xdb, shard, SQLITE_OPEN_READONLY);
+		if (!c)
+			return NULL;
+	}
+
+	pthread_setspecific(shard->key, c);
+
+	return c;
+}
+
+static inline struct xdb_conn *get_writer(struct xdb_shard *shard)
+{
+	pthread_mutex_lock(&shard->wlock);
+	sample_status(shard->writer);
+	return shard->writer;
+}
+
+static inline void put_writer(struct xdb_shard *shard)
+{
+	pthread_mutex_unlock(&shard->wlock);
+}
+
+static int cmp_ino(const void *a, const void *b)
+{
+	ino_t x = *(const ino_t *) a;
+	ino_t y = *(const ino_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * external interface
+ */
+
+int xdb_config_init(struct xdb_config *cfg, const char *tier)
+{
+	unsigned int i;
+
+	if (!tier)
+		tier = xdb_tiers[0].name;
+
+	for (i = 0; i < N_XDB_TIERS; i++)
+		if (0 == strcmp(tier, xdb_tiers[i].name))
+			break;
+
+	if (i == N_XDB_TIERS)
+		return -EINVAL;
+
+	cfg->backend = "sqlite";
+	cfg->journal = xdb_tiers[i].journal;
+	cfg->sync = xdb_tiers[i].sync;
+	cfg->cache_size = 0;
+	cfg->mmap_size = 0;
+	cfg->checkpoint = -1;
+	cfg->group_commit = 0;
+	cfg->commit_delay = 10;
+	cfg->commit_batch = 256;
+	cfg->value_cache = 16384;
+	cfg->shards = 1;
+	cfg->slow_log = NULL;
+	cfg->slow_ms = 100;
+	cfg->memdb = 0;
+	cfg->snapshot = 60;
+	cfg->blob_threshold = 512;
+	cfg->layout = NULL;
+
+	return 0;
+}
+
+int xdb_config_check(const struct xdb_config *cfg)
+{
+	if (!xdb_backend(cfg->backend))
+		return -EINVAL;
+	/* the kv backend has a log of its own, and no background writer */
+	if (0 == strcmp(cfg->backend, "kv") &&
+	    (cfg->group_commit || cfg->memdb || cfg->shards != 1 ||
+	     cfg->layout || cfg->value_cache))
+		return -EINVAL;
+	if (cfg->layout && layout_of(cfg->layout) < 0)
+		return -EINVAL;
+	if (!str_oneof(cfg->journal, journal_modes))
+		return -EINVAL;
+	if (!str_oneof(cfg->sync, sync_modes))
+		return -EINVAL;
+	if (cfg->cache_size < 0 || cfg->mmap_size < 0 || cfg->checkpoint < -1)
+		return -EINVAL;
+	if (cfg->commit_delay < 0 || cfg->commit_batch <= 0)
+		return -EINVAL;
+	if (cfg->value_cache < 0)
+		return -EINVAL;
+	if (cfg->shards < 1 || cfg->shards > XDB_MAX_SHARDS)
+		return -EINVAL;
+	if (cfg->blob_threshold < 0 || cfg->blob_threshold > INT_MAX)
+		return -EINVAL;
+	if (cfg->slow_ms < 0)
+		return -EINVAL;
+	if (cfg->snapshot < 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * a single shard keeps the original XDB_FILE, so that an existing database
+ * is used as it is. more shards are named after XDB_SHARD_FILE.
+ */
+char *xdb_shard_path(const char *dir, int shard, int nshards)
+{
+	char buf[PATH_MAX];
+
+	if (nshards == 1)
+		snprintf(buf, sizeof(buf), "%s/%s", dir, XDB_FILE);
+	else
+		snprintf(buf, sizeof(buf), "%s/" XDB_SHARD_FILE, dir, shard);
+
+	return strdup(buf);
+}
+
+/**
+ * the memdb of a shard (-o memdb), shared by the connections of this xdb. a
+ * memdb is not journaled to disk, so the journal and sync options do not
+ * apply, and it is only limited by the memory.
+ */
+static int open_memdb(struct xdb *xdb, struct xdb_shard *shard, int i)
+{
+	int ret;
+	sqlite3_int64 limit = LLONG_MAX;
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "file:/xattrfs-%d-%p-%d?vfs=memdb",
+		 (int) getpid(), (void *) xdb, i);
+
+	shard->memdb = strdup(buf);
+	if (!shard->memdb)
+		return -ENOMEM;
+
+	shard->writer = open_conn(xdb, shard, SQLITE_OPEN_READWRITE |
+					      SQLITE_OPEN_CREATE);
+	if (!shard->writer)
+		return -EIO;
+
+	ret = sqlite3_file_control(shard->writer->conn, "main",
+				   SQLITE_FCNTL_SIZE_LIMIT, &limit);
+	if (ret != SQLITE_OK)
+		return -EIO;
+
+	return xdb_snap_load(shard);
+}
+
+static int db_exists(const char *dir, int shard, int nshards)
+{
+	int ret;
+	char *path = xdb_shard_path(dir, shard, nshards);
+
+	if (!path)
+		return -ENOMEM;
+
+	ret = access(path, F_OK) == 0;
+	free(path);
+
+	return ret;
+}
+
+/**
+ * returns the number of shards of the database in @dir, or 0 if there is no
+ * database yet. a mix of a single file and shard files is -EINVAL.
+ */
+int xdb_shard_probe(const char *dir)
+{
+	int ret;
+	int n = 0;
+
+	while (n <= XDB_MAX_SHARDS) {
+		ret = db_exists(dir, n, XDB_MAX_SHARDS);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;
+		n++;
+	}
+
+	ret = db_exists(dir, 0, 1);
+	if (ret <= 0)
+		return ret < 0 ? ret : n;
+
+	return n ? -EINVAL : 1;
+}
+
+static void sql_exit(struct xdb *xdb);
+
+static int sql_init(struct xdb **xdb, const char *dir,
+		const struct xdb_config *cfg)
+{
+	int i;
+	int ret = 0;
+	int nshards = cfg->shards;
+	struct xdb *self = NULL;
+
+	/* routing depends on the number of shards, so it cannot change */
+	ret = xdb_shard_probe(dir);
+	if (ret < 0)
+		return ret;
+	if (ret && ret != nshards)
+		return -EINVAL;
+
+	self = calloc(1, sizeof(*self) + nshards * sizeof(self->shards[0]));
+	if (!self)
+		return -ENOMEM;
+
+	self->cfg = *cfg;
+
+	for (i = 0; i < nshards; i++) {
+		ret = pthread_key_create(&self->shards[i].key, release_reader);
+		if (ret) {
+			while (i--)
+				pthread_key_delete(self->shards[i].key);
+			free(self);
+			return -ret;
+		}
+
+		pthread_mutex_init(&self->shards[i].wlock, NULL);
+	}
+
+	pthread_mutex_init(&self->lock, NULL);
+	self->nshards = nshards;
+
+	/* before the connections, which are traced into it */
+	if (self->cfg.slow_log) {
+		self->slow_log = fopen(self->cfg.slow_log, "a");
+		if (!self->slow_log) {
+			ret = -errno;
+			goto out;
+		}
+		setvbuf(self->slow_log, NULL, _IOLBF, 0);
+	}
+
+	for (i = 0; i < nshards; i++) {
+		struct xdb_shard *shard = &self->shards[i];
+
+		shard->dbpath = xdb_shard_path(dir, i, nshards);
+		if (!shard->dbpath) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = xdb_names_init(&shard->names);
+		if (ret)
+			goto out;
+
+		if (self->cfg.memdb) {
+			ret = open_memdb(self, shard, i);
+			if (ret)
+				goto out;
+		} else {
+			shard->writer = open_conn(self, shard,
+						  SQLITE_OPEN_READWRITE |
+						  SQLITE_OPEN_CREATE);
+			if (!shard->writer) {
+				ret = -EIO;
+				goto out;
+			}
+		}
+
+		ret = db_initialize(shard->writer);
+		if (ret)
+			goto out;
+	}
+
+	if (self->cfg.value_cache) {
+		ret = xdb_cache_init(&self->cache, self->cfg.value_cache << 10);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; self->cfg.group_commit && i < nshards; i++) {
+		ret = xdb_wq_init(&self->shards[i].wq, self, i,
+				  self->cfg.commit_delay,
+				  self->cfg.commit_batch);
+		if (ret)
+			goto out;
+	}
+
+	if (self->cfg.memdb) {
+		ret = xdb_snap_init(&self->snap, self, self->cfg.snapshot);
+		if (ret)
+			goto out;
+	}
+
+	*xdb = self;
+
+	return 0;
+
+out:
+	sql_exit(self);
+	return ret;
+}
+
+static void sql_exit(struct xdb *xdb)
+{
+	int i;
+	struct xdb_conn *c, *next;
+
+	/* drains the queues through the writers */
+	for (i = 0; i < xdb->nshards; i++)
+		if (xdb->shards[i].wq)
+			xdb_wq_exit(xdb->shards[i].wq);
+
+	/* then the memdbs are written back, before they are closed */
+	if (xdb->snap)
+		xdb_snap_exit(xdb->snap);
+
+	for (i = 0; i < xdb->nshards; i++)
+		pthread_key_delete(xdb->shards[i].key);
+
+	for (c = xdb->conns; c; c = next) {
+		next = c->next;
+		close_conn(c);
+	}
+
+	for (i = 0; i < xdb->nshards; i++) {
+		if (xdb->shards[i].dbpath)
+			free((void *) xdb->shards[i].dbpath);
+		if (xdb->shards[i].memdb)
+			free((void *) xdb->shards[i].memdb);
+		if (xdb->shards[i].names)
+			xdb_names_exit(xdb->shards[i].names);
+		pthread_mutex_destroy(&xdb->shards[i].wlock);
+	}
+
+	if (xdb->cache)
+		xdb_cache_exit(xdb->cache);
+
+	if (xdb->slow_log)
+		fclose(xdb->slow_log);
+
+	pthread_mutex_destroy(&xdb->lock);
+	free(xdb);
+}
+
+/* the status of the connections of @shard, as of their last samples */
+void xdb_status(struct xdb *xdb, int shard, struct xdb_status *st)
+{
+	struct xdb_conn *c;
+
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&xdb->lock);
+	for (c = xdb->conns; c; c = c->next) {
+		if (c->shard != &xdb->shards[shard])
+			continue;
+
+		st->conns++;
+		st->cache_used += get_counter(&c->status.cache_used);
+		st->cache_hits += get_counter(&c->status.cache_hits);
+		st->cache_misses += get_counter(&c->status.cache_misses);
+		st->cache_writes += get_counter(&c->status.cache_writes);
+		st->schema_used += get_counter(&c->status.schema_used);
+		st->stmt_used += get_counter(&c->status.stmt_used);
+	}
+	pthread_mutex_unlock(&xdb->lock);
+}
+
+static int sql_getxattr(struct xdb *xdb, ino_t ino,
+			const char *name, char *value, size_t size)
+{
+	ssize_t ret = 0;
+	int pending = 0;
+	uint64_t seq = 0;
+	struct xdb_wq *wq = get_shard(xdb, ino)->wq;
+
+	if (xdb->cache &&
+	    xdb_cache_lookup(xdb->cache, ino, name, value, size, &ret, &seq))
+		return ret;
+
+	if (wq) {
+		ret = xdb_wq_getxattr(wq, ino, name, value, size, &pending);
+		if (pending)
+			return ret;
+	}
+
+	ret = xdb_db_getxattr(xdb, ino, name, value, size);
+
+	/* a size probe tells nothing about the value */
+	if (xdb->cache && (ret == -ENODATA || (size && ret >= 0)))
+		xdb_cache_insert(xdb->cache, ino, name, value,
+				 ret == -ENODATA ? -1 : ret, seq);
+
+	return ret;
+}
+
+static int sql_setxattr(struct xdb *xdb, ino_t ino, const char *name,
+			const char *value, size_t size, int flags)
+{
+	int ret = 0;
+	struct xdb_shard *shard = get_shard(xdb, ino);
+	struct xdb_conn *c;
+
+	if (shard->wq)
+		ret = xdb_wq_setxattr(shard->wq, ino, name, value, size, flags);
+	else {
+		c = get_writer(shard);
+		ret = do_setxattr(c, ino, name, value, size, flags);
+		put_writer(shard);
+	}
+
+	if (xdb->cache)
+		xdb_cache_invalidate(xdb->cache, ino, name);
+
+	return ret;
+}
+
+static int sql_removexattr(struct xdb *xdb, ino_t ino, const char *name)
+{
+	int ret = 0;
+	struct xdb_shard *shard = get_shard(xdb, ino);
+	struct xdb_conn *c;
+
+	if (shard->wq)
+		ret = xdb_wq_removexattr(shard->wq, ino, name);
+	else {
+		c = get_writer(shard);
+		ret = do_removexattr(c, ino, name);
+		put_writer(shard);
+	}
+
+	if (xdb->cache)
+		xdb_cache_invalidate(xdb->cache, ino, name);
+
+	return ret;
+}
+
+static int sql_listxattr(struct xdb *xdb, ino_t ino, char *list, size_t size)
+{
+	ssize_t ret = 0;
+	uint64_t seq = 0;
+	char *names = NULL;
+	struct xdb_shard *shard = get_shard(xdb, ino);
+	struct xdb_conn *c;
+
+	if (xdb->cache &&
+	    xdb_cache_lookup_list(xdb->cache, ino, list, size, &ret, &seq))
+		goto out;
+
+	c = get_reader(xdb, shard);
+	if (!c) {
+		ret = -EIO;
+		goto out;
+	}
+
+	/* the list comes from the database, so commit what is queued first */
+	if (shard->wq)
+		xdb_wq_flush(shard->wq, ino);
+
+	ret = do_listxattr(c, ino, &names);
+	if (ret < 0)
+		goto out;
+
+	if (xdb->cache)
+		xdb_cache_insert_list(xdb->cache, ino, names, ret, seq);
+
+	if (size) {
+		if (size < (size_t) ret)
+			ret = -ERANGE;
+		else if (ret)
+			memcpy(list, names, ret);
+	}
+out:
+	free(names);
+	return ret;
+}
+
+/**
+ * removes every xattr of an inode whose base file is gone. queued mutations of
+ * the inode are committed first, so none of them brings a row back later. most
+ * files have no xattrs, and those cost a read instead of a write transaction.
+ */
+static int sql_purge(struct xdb *xdb, ino_t ino)
+{
+	int ret = 0;
+	ssize_t len = 0;
+	char *names = NULL;
+	char *name;
+	struct xdb_shard *shard = get_shard(xdb, ino);
+	struct xdb_conn *c = get_reader(xdb, shard);
+
+	if (!c)
+		return -EIO;
+
+	if (shard->wq)
+		xdb_wq_flush(shard->wq, ino);
+
+	len = do_listxattr(c, ino, &names);
+	if (len <= 0)
+		return len;
+
+	c = get_writer(shard);
+	ret = do_purge(c, ino);
+	put_writer(shard);
+
+	/* like setxattr, after the database, so no reader caches an old row */
+	for (name = names; xdb->cache && name < &names[len];
+	     name += strlen(name) + 1)
+		xdb_cache_invalidate(xdb->cache, ino, name);
+
+	free(names);
+
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * fills @inos with up to @count inodes that have xattrs, in ascending order
+ * from the first one above @after. returns the number of inodes. with shards,
+ * the first @count of each shard are merged.
+ */
+static int sql_scan_inodes(struct xdb *xdb, ino_t after, ino_t *inos,
+			int count)
+{
+	int i;
+	int ret = 0;
+	int n = 0;
+	ino_t *all = NULL;
+	struct xdb_conn *c;
+
+	if (xdb->nshards == 1) {
+		c = get_reader(xdb, &xdb->shards[0]);
+		return c ? do_scan_ino(c, after, inos, count) : -EIO;
+	}
+
+	all = malloc(sizeof(*all) * count * xdb->nshards);
+	if (!all)
+		return -ENOMEM;
+
+	for (i = 0; i < xdb->nshards; i++) {
+		c = get_reader(xdb, &xdb->shards[i]);
+		if (!c) {
+			ret = -EIO;
+			goto out;
+		}
+
+		ret = do_scan_ino(c, after, &all[n], count);
+		if (ret < 0)
+			goto out;
+
+		n += ret;
+	}
+
+	qsort(all, n, sizeof(*all), cmp_ino);
+
+	ret = n < count ? n : count;
+	memcpy(inos, all, sizeof(*all) * ret);
+out:
+	free(all);
+	return ret;
+}
+
+/**
+ * the reverse index of the namespace (see xdb_dentry_sqlstr). a name can only
+ * point to one inode, and an inode has a name for each of its links.
+ */
+
+static int sql_dentry_add(struct xdb *xdb, ino_t parent, const char *name,
+			ino_t ino)
+{
+	int ret;
+	struct xdb_conn *c = get_writer(&xdb->shards[0]);
+
+	ret = do_dentry(c, ADD_DENTRY, parent, name, ino);
+	put_writer(&xdb->shards[0]);
+
+	return ret;
+}
+
+static int sql_dentry_remove(struct xdb *xdb, ino_t parent, const char *name)
+{
+	int ret;
+	struct xdb_conn *c = get_writer(&xdb->shards[0]);
+
+	ret = do_dentry(c, REMOVE_DENTRY, parent, name, 0);
+	put_writer(&xdb->shards[0]);
+
+	return ret;
+}
+
+static int sql_dentry_lookup(struct xdb *xdb, ino_t ino, ino_t *parent,
+			char *name, size_t size)
+{
+	int ret = 0;
+	sqlite3_stmt *stmt = NULL;
+	struct xdb_conn *c = get_reader(xdb, &xdb->shards[0]);
+
+	if (c)
+		stmt = get_stmt(c, LOOKUP_DENTRY);
+	if (!stmt)
+		return -EIO;
+
+	trace_key(c, ino, NULL);
+	if (sqlite3_bind_int64(stmt, 1, ino)) {
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = step(c, stmt);
+	if (ret != SQLITE_ROW) {
+		ret = ret == SQLITE_DONE ? -ENOENT : -EIO;
+		goto out;
+	}
+
+	*parent = sqlite3_column_int64(stmt, 0);
+	if ((size_t) sqlite3_column_bytes(stmt, 1) >= size) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+
+	strcpy(name, (const char *) sqlite3_column_text(stmt, 1));
+	ret = 0;
+out:
+	put_stmt(stmt);
+	return ret;
+}
+
+/**
+ * the inodes with the xattr @name, through idx_xattr_kid: with any value if
+ * @value is NULL, or a value equal to (or with @prefix, starting with) the
+ * @len bytes of @value. a value kept out of line is read only when its stored
+ * size can match. what is queued for group commit is committed first. returns
+ * the number of inodes in *@inos, which the caller should free.
+ */
+static int sql_query(struct xdb *xdb, const char *name, const char *value,
+		size_t len, int prefix, ino_t **inos)
+{
+	int i;
+	int ret = 0;
+	int count = 0;
+	int size = 0;
+	struct xdb_conn *c;
+
+	*inos = NULL;
+
+	for (i = 0; i < xdb->nshards; i++) {
+		c = get_reader(xdb, &xdb->shards[i]);
+		if (!c) {
+			ret = -EIO;
+			break;
+		}
+
+		if (xdb->shards[i].wq)
+			xdb_wq_flush_all(xdb->shards[i].wq);
+
+		ret = do_query(c, name, value, len, prefix, inos, &count,
+			       &size);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		free(*inos);
+		*inos = NULL;
+	}
+	else
+		ret = count;
+
+	return ret;
+}
+
+/**
+ * direct access to the database, for the group commit queue (xattrfs-wq.c):
+ * these never look at the queue. xdb_tx_begin() holds the writer connection
+ * until xdb_tx_end(), and everything in between is one transaction.
+ */
+
+int xdb_db_getxattr(struct xdb *xdb, ino_t ino,
+			const char *name, char *value, size_t size)
+{
+	struct xdb_conn *c = get_reader(xdb, get_shard(xdb, ino));
+
+	if (!c)
+		return -EIO;
+
+	return size ? do_real_getxattr(c, ino, name, value, size)
+		    : do_len_getxattr(c, ino, name);
+}
+
+int xdb_tx_begin(struct xdb *xdb, int shard)
+{
+	uint64_t t = xattrfs_metrics_begin(XM_XDB_TX);
+	struct xdb_conn *c = get_writer(&xdb->shards[shard]);
+	int ret;
+
+	ret = tx_begin(c);
+	if (ret) {
+		put_writer(&xdb->shards[shard]);
+		xattrfs_metrics_end(XM_XDB_TX, t, -EIO);
+		return -EIO;
+	}
+
+	c->tx_start = t;
+
+	return 0;
+}
+
+int xdb_tx_setxattr(struct xdb *xdb, ino_t ino, const char *name,
+			const char *value, size_t size, int flags)
+{
+	return do_setxattr(get_shard(xdb, ino)->writer, ino, name, value, size,
+			   flags);
+}
+
+int xdb_tx_removexattr(struct xdb *xdb, ino_t ino, const char *name)
+{
+	return do_removexattr(get_shard(xdb, ino)->writer, ino, name);
+}
+
+int xdb_tx_end(struct xdb *xdb, int shard, int commit)
+{
+	int ret;
+	struct xdb_conn *c = xdb->shards[shard].writer;
+
+	if (commit) {
+		while ((ret = tx_end(c)) == SQLITE_BUSY)
+			xattrfs_metrics_busy();
+
+		if (ret)
+			tx_abort(c);
+	}
+	else
+		ret = tx_abort(c);
+
+	/* the names it added are gone with it */
+	if (ret || !commit)
+		xdb_names_clear(xdb->shards[shard].names);
+
+	/* a rolled back transaction is a failed one */
+	xattrfs_metrics_end(XM_XDB_TX, c->tx_start,
+			    ret || !commit ? -EIO : 0);
+
+	put_writer(&xdb->shards[shard]);
+
+	return ret ? -EIO : 0;
+}
+
+static const struct xdb_backend sqlite_backend = {
+	.name		= "sqlite",
+	.init		= sql_init,
+	.exit		= sql_exit,
+	.getxattr	= sql_getxattr,
+	.setxattr	= sql_setxattr,
+	.removexattr	= sql_removexattr,
+	.listxattr	= sql_listxattr,
+	.purge		= sql_purge,
+	.scan_inodes	= sql_scan_inodes,
+	.dentry_add	= sql_dentry_add,
+	.dentry_remove	= sql_dentry_remove,
+	.dentry_lookup	= sql_dentry_lookup,
+	.query		= sql_query,
+};
+
+static const struct xdb_backend *xdb_backends[] = {
+	&sqlite_backend,
+	&xdb_kv_backend,
+	NULL
+};
+
+const struct xdb_backend *xdb_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; xdb_backends[i]; i++)
+		if (0 == strcmp(name, xdb_backends[i]->name))
+			return xdb_backends[i];
+
+	return NULL;
+}
+
+int xdb_init(struct xdb **xdb, const char *dir,
+		const struct xdb_config *cfg)
+{
+	int ret;
+	struct xdb_config defaults;
+	const struct xdb_backend *be;
+
+	if (!cfg) {
+		xdb_config_init(&defaults, NULL);
+		cfg = &defaults;
+	}
+
+	be = xdb_backend(cfg->backend);
+	if (!be)
+		return -EINVAL;
+
+	ret = be->init(xdb, dir, cfg);
+	if (ret)
+		return ret;
+
+	(*xdb)->be = be;
+
+	return 0;
+}
+
+void xdb_exit(struct xdb *xdb)
+{
+	if (xdb)
+		xdb->be->exit(xdb);
+}
+
+/**
+ * every call is timed (see xattrfs-metrics.c) here, whatever the backend.
+ */
+#define METERED(op, name, proto, args)				\
+int xdb_##name proto						\
+{								\
+	uint64_t t = xattrfs_metrics_begin(op);			\
+	int ret = xdb->be->name args;				\
+								\
+	xattrfs_metrics_end(op, t, ret);			\
+	return ret;						\
+}
+
+METERED(XM_XDB_GETXATTR, getxattr,
+	(struct xdb *xdb, ino_t ino, const char *name, char *value,
+	 size_t size),
+	(xdb, ino, name, value, size))
+
+METERED(XM_XDB_SETXATTR, setxattr,
+	(struct xdb *xdb, ino_t ino, const char *name, const char *value,
+	 size_t size, int flags),
+	(xdb, ino, name, value, size, flags))
+
+METERED(XM_XDB_REMOVEXATTR, removexattr,
+	(struct xdb *xdb, ino_t ino, const char *name),
+	(xdb, ino, name))
+
+METERED(XM_XDB_LISTXATTR, listxattr,
+	(struct xdb *xdb, ino_t ino, char *list, size_t size),
+	(xdb, ino, list, size))
+
+METERED(XM_XDB_PURGE, purge,
+	(struct xdb *xdb, ino_t ino),
+	(xdb, ino))
+
+METERED(XM_XDB_SCAN, scan_inodes,
+	(struct xdb *xdb, ino_t after, ino_t *inos, int count),
+	(xdb, after, inos, count))
+
+METERED(XM_XDB_DENTRY_ADD, dentry_add,
+	(struct xdb *xdb, ino_t parent, const char *name, ino_t ino),
+	(xdb, parent, name, ino))
+
+METERED(XM_XDB_DENTRY_REMOVE, dentry_remove,
+	(struct xdb *xdb, ino_t parent, const char *name),
+	(xdb, parent, name))
+
+METERED(XM_XDB_DENTRY_LOOKUP, dentry_lookup,
+	(struct xdb *xdb, ino_t ino, ino_t *parent, char *name, size_t size),
+	(xdb, ino, parent, name, size))
+
+METERED(XM_XDB_QUERY, query,
+	(struct xdb *xdb, const char *name, const char *value, size_t len,
+	 int prefix, ino_t **inos),
+	(xdb, name, value, len, prefix, inos))
@@ -0,0 +1,774 @@
+/* Copyright (C) 2015	 - Hyogi Sim <simh@ornl.gov>
+ *
+ * Please refer to COPYING for the license.
+ * ---------------------------------------------------------------------------
+ * xattrfs-xport: streams the xattrs of a base directory out of its database,
+ * and loads such a stream back in large transactions. the file system should
+ * not be mounted; import refuses to run on a mounted one.
+ *
+ * the xattrs are keyed by inode number (for the same base directory, e.g. a
+ * backup), or with -p, by path relative to the base directory (for a copy of
+ * the tree on another file system, where the inodes differ).
+ *
+ * stream format, all integers little-endian:
+ *
+ *	header	"XFSX", version (1 byte), key ('i' or 'p'), 2 bytes of zero
+ *	block	payload length (u32), crc32 of the payload (u32), payload
+ *	...
+ *	end	a block of length 0 (and crc 0)
+ *
+ * a payload is a sequence of files, which never span two blocks:
+ *
+ *	file	key, xattr.., 0
+ *	key	inode number (varint), or path length (varint) and path
+ *	xattr	name length (varint, > 0), name, value length (varint), value
+ *
+ * a block is checked before any of it is loaded.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include "xattrfs.h"
+
+#define XPORT_MAGIC		"XFSX"
+#define XPORT_VERSION		1
+#define XPORT_BLOCK		(1 << 20)	/* flushed at this payload size */
+#define XPORT_MAX_BLOCK		(64 << 20)
+#define XPORT_BATCH		100000		/* xattrs per transaction */
+#define XPORT_CACHE		65536		/* KiB of page cache, for import */
+#define XPORT_SCAN		1024		/* inodes per scan */
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s export [-p] <basedir> [<file>]\n"
+	       "       %s import [-b N] [-n N] <basedir> [<file>]\n\n"
+	       "Streams the xattrs of <basedir> to <file> (stdout), or loads\n"
+	       "them from <file> (stdin).\n\n"
+	       "  -p    key the xattrs by path instead of inode number\n"
+	       "  -b N  xattrs per transaction (%d)\n"
+	       "  -n N  shards of a new database (1)\n\n"
+	       "Unmount the file system first.\n",
+	       prog, prog, XPORT_BATCH);
+}
+
+/**
+ * crc32 (ieee 802.3), as in zlib
+ */
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32(const unsigned char *buf, size_t len)
+{
+	uint32_t c = 0xffffffff;
+
+	while (len--)
+		c = crc_table[(c ^ *buf++) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffff;
+}
+
+static inline void put_u32(unsigned char *buf, uint32_t val)
+{
+	buf[0] = val;
+	buf[1] = val >> 8;
+	buf[2] = val >> 16;
+	buf[3] = val >> 24;
+}
+
+static inline uint32_t get_u32(const unsigned char *buf)
+{
+	return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+/**
+ * the stream, a block at a time
+ */
+
+struct stream {
+	FILE *fp;
+	int key;			/* 'i' or 'p' */
+	unsigned char *buf;
+	size_t len;			/* of the payload */
+	size_t size;			/* of buf */
+	size_t pos;			/* of the reader */
+	uint64_t files;
+	uint64_t xattrs;
+};
+
+static int reserve(struct stream *s, size_t len)
+{
+	size_t size = s->size ? s->size : XPORT_BLOCK;
+	unsigned char *buf;
+
+	if (s->len + len <= s->size)
+		return 0;
+
+	while (size < s->len + len)
+		size <<= 1;
+
+	if (size > XPORT_MAX_BLOCK)
+		return -E2BIG;
+
+	buf = realloc(s->buf, size);
+	if (!buf)
+		return -ENOMEM;
+
+	s->buf = buf;
+	s->size = size;
+
+	return 0;
+}
+
+static int put_varint(struct stream *s, uint64_t val)
+{
+	int ret = reserve(s, 10);
+
+	if (ret)
+		return ret;
+
+	while (val >= 0x80) {
+		s->buf[s->len++] = val | 0x80;
+		val >>= 7;
+	}
+	s->buf[s->len++] = val;
+
+	return 0;
+}
+
+static int put_bytes(struct stream *s, const void *data, size_t len)
+{
+	int ret = put_varint(s, len);
+
+	if (ret == 0)
+		ret = reserve(s, len);
+	if (ret)
+		return ret;
+
+	memcpy(&s->buf[s->len], data, len);
+	s->len += len;
+
+	return 0;
+}
+
+static int flush_block(struct stream *s)
+{
+	unsigned char hdr[8];
+
+	put_u32(hdr, s->len);
+	put_u32(&hdr[4], s->len ? crc32(s->buf, s->len) : 0);
+
+	if (fwrite(hdr, sizeof(hdr), 1, s->fp) != 1 ||
+	    (s->len && fwrite(s->buf, s->len, 1, s->fp) != 1))
+		return -EIO;
+
+	s->len = 0;
+
+	return 0;
+}
+
+/* returns 1 for a block, 0 at the end of the stream */
+static int read_block(struct stream *s)
+{
+	int ret;
+	unsigned char hdr[8];
+	size_t len;
+
+	if (fread(hdr, sizeof(hdr), 1, s->fp) != 1) {
+		fputs("truncated stream\n", stderr);
+		return -EIO;
+	}
+
+	len = get_u32(hdr);
+	if (len == 0)
+		return 0;
+
+	if (len > XPORT_MAX_BLOCK) {
+		fputs("corrupted stream: block too large\n", stderr);
+		return -EIO;
+	}
+
+	s->len = 0;
+	ret = reserve(s, len);
+	if (ret)
+		return ret;
+
+	if (fread(s->buf, len, 1, s->fp) != 1) {
+		fputs("truncated stream\n", stderr);
+		return -EIO;
+	}
+
+	if (crc32(s->buf, len) != get_u32(&hdr[4])) {
+		fputs("corrupted stream: checksum mismatch\n", stderr);
+		return -EIO;
+	}
+
+	s->len = len;
+	s->pos = 0;
+
+	return 1;
+}
+
+static int get_varint(struct stream *s, uint64_t *val)
+{
+	int shift;
+	unsigned char c;
+
+	*val = 0;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (s->pos == s->len)
+			return -EIO;
+
+		c = s->buf[s->pos++];
+		*val |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -EIO;
+}
+
+static int get_bytes(struct stream *s, const unsigned char **data,
+			size_t *len)
+{
+	uint64_t n;
+
+	if (get_varint(s, &n) || n > s->len - s->pos)
+		return -EIO;
+
+	*data = &s->buf[s->pos];
+	*len = n;
+	s->pos += n;
+
+	return 0;
+}
+
+/**
+ * export
+ */
+
+static struct {
+	struct xdb *xdb;
+	struct stream *s;
+	size_t baselen;
+	char *list;
+	size_t listsize;
+	char *value;
+	size_t valuesize;
+	int err;
+} ex;
+
+static int grow(char **buf, size_t *size, size_t len)
+{
+	char *tmp;
+
+	if (len <= *size)
+		return 0;
+
+	tmp = realloc(*buf, len);
+	if (!tmp)
+		return -ENOMEM;
+
+	*buf = tmp;
+	*size = len;
+
+	return 0;
+}
+
+/* the xattrs of one file, keyed by @ino or @path */
+static int export_file(ino_t ino, const char *path)
+{
+	int ret;
+	ssize_t len, vlen;
+	size_t mark = ex.s->len;
+	uint64_t xattrs = 0;
+	char *name;
+
+	do {
+		len = xdb_listxattr(ex.xdb, ino, NULL, 0);
+		if (len <= 0)
+			return len;
+
+		ret = grow(&ex.list, &ex.listsize, len);
+		if (ret)
+			return ret;
+
+		len = xdb_listxattr(ex.xdb, ino, ex.list, ex.listsize);
+	} while (len == -ERANGE);
+
+	if (len <= 0)
+		return len;
+
+	ret = path ? put_bytes(ex.s, path, strlen(path))
+		   : put_varint(ex.s, ino);
+	if (ret)
+		return ret;
+
+	for (name = ex.list; name < &ex.list[len]; name += strlen(name) + 1) {
+		do {
+			vlen = xdb_getxattr(ex.xdb, ino, name, NULL, 0);
+			if (vlen < 0)
+				break;
+
+			ret = grow(&ex.value, &ex.valuesize, vlen ? vlen : 1);
+			if (ret)
+				return ret;
+
+			vlen = xdb_getxattr(ex.xdb, ino, name, ex.value,
+					    ex.valuesize);
+		} while (vlen == -ERANGE);
+
+		if (vlen == -ENODATA)
+			continue;	/* removed in between */
+		if (vlen < 0)
+			return vlen;
+
+		ret = put_bytes(ex.s, name, strlen(name));
+		if (ret == 0)
+			ret = put_bytes(ex.s, ex.value, vlen);
+		if (ret)
+			return ret;
+
+		xattrs++;
+	}
+
+	if (xattrs == 0) {
+		ex.s->len = mark;
+		return 0;
+	}
+
+	ret = put_varint(ex.s, 0);
+	if (ret)
+		return ret;
+
+	ex.s->files++;
+	ex.s->xattrs += xattrs;
+
+	return ex.s->len >= XPORT_BLOCK ? flush_block(ex.s) : 0;
+}
+
+static int export_path(const char *fpath, const struct stat *sb, int flag,
+			struct FTW *ftw)
+{
+	const char *path = &fpath[ex.baselen];
+
+	if (flag == FTW_NS || flag == FTW_DNR)
+		return 0;
+
+	while (*path == '/')
+		path++;
+
+	ex.err = export_file(sb->st_ino, path);
+
+	return ex.err ? 1 : 0;
+}
+
+static int export_inodes(void)
+{
+	int i, n;
+	int ret = 0;
+	ino_t after = 0;
+	ino_t inos[XPORT_SCAN];
+
+	while ((n = xdb_scan_inodes(ex.xdb, after, inos, XPORT_SCAN)) > 0) {
+		for (i = 0; i < n; i++) {
+			ret = export_file(inos[i], NULL);
+			if (ret)
+				return ret;
+		}
+
+		after = inos[n - 1];
+	}
+
+	return n;
+}
+
+static int do_export(const char *dir, struct xdb_config *cfg,
+			struct stream *s)
+{
+	int ret;
+	unsigned char hdr[8] = XPORT_MAGIC;
+
+	ret = xdb_init(&ex.xdb, dir, cfg);
+	if (ret) {
+		fprintf(stderr, "%s: cannot open the xattr database: %s\n",
+			dir, strerror(-ret));
+		return ret;
+	}
+
+	ex.s = s;
+	ex.baselen = strlen(dir);
+
+	hdr[4] = XPORT_VERSION;
+	hdr[5] = s->key;
+
+	if (fwrite(hdr, sizeof(hdr), 1, s->fp) != 1) {
+		ret = -EIO;
+		goto out;
+	}
+
+	if (s->key == 'p') {
+		ret = nftw(dir, export_path, 64, FTW_PHYS | FTW_MOUNT);
+		if (ret > 0)
+			ret = ex.err;
+		else if (ret < 0)
+			ret = -errno;
+	}
+	else
+		ret = export_inodes();
+
+	if (ret == 0)
+		ret = flush_block(s);
+	if (ret == 0)
+		ret = flush_block(s);	/* the end block */
+	if (ret == 0 && fflush(s->fp))
+		ret = -EIO;
+
+out:
+	free(ex.list);
+	free(ex.value);
+	xdb_exit(ex.xdb);
+	return ret;
+}
+
+/**
+ * import: the secondary index is dropped while loading, and built again at
+ * the end in one pass.
+ */
+
+static int exec_shards(const char *dir, int nshards, const char *sql)
+{
+	int i;
+	int ret = 0;
+	char *path, *err = NULL;
+	sqlite3 *db;
+
+	for (i = 0; i < nshards && ret == 0; i++) {
+		path = xdb_shard_path(dir, i, nshards);
+		if (!path)
+			return -ENOMEM;
+
+		if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL) ||
+		    sqlite3_exec(db, sql, NULL, NULL, &err)) {
+			fprintf(stderr, "%s: %s\n", path,
+				err ? err : sqlite3_errmsg(db));
+			ret = -EIO;
+		}
+
+		sqlite3_free(err);
+		sqlite3_close(db);
+		free(path);
+	}
+
+	return ret;
+}
+
+static int tx_all(struct xdb *xdb, int begin, int commit)
+{
+	int i;
+	int ret = 0;
+
+	for (i = 0; i < xdb->nshards; i++) {
+		if (begin)
+			ret = xdb_tx_begin(xdb, i);
+		else if (xdb_tx_end(xdb, i, commit))
+			ret = -EIO;
+
+		if (begin && ret) {
+			while (i--)
+				xdb_tx_end(xdb, i, 0);
+			return ret;
+		}
+	}
+
+	return ret;
+}
+
+static int load_block(struct xdb *xdb, struct stream *s, const char *dir,
+			long batch, uint64_t *pending, uint64_t *skipped)
+{
+	int ret;
+	uint64_t ino;
+	size_t len, vlen;
+	const unsigned char *key, *name, *value;
+	char buf[PATH_MAX];
+	char xname[XATTR_NAME_MAX + 1];
+	struct stat sb;
+
+	while (s->pos < s->len) {
+		if (s->key == 'p') {
+			if (get_bytes(s, &key, &len))
+				goto corrupted;
+			if (snprintf(buf, sizeof(buf), "%s/%.*s", dir,
+				     (int) len, key) >= (int) sizeof(buf))
+				goto corrupted;
+
+			/* the file is not in this tree */
+			ino = lstat(buf, &sb) ? 0 : sb.st_ino;
+		}
+		else if (get_varint(s, &ino))
+			goto corrupted;
+
+		if (ino)
+			s->files++;
+
+		for (;;) {
+			if (get_bytes(s, &name, &len))
+				goto corrupted;
+			if (len == 0)
+				break;
+			if (len > XATTR_NAME_MAX || get_bytes(s, &value, &vlen))
+				goto corrupted;
+
+			if (ino == 0) {
+				(*skipped)++;
+				continue;
+			}
+
+			memcpy(xname, name, len);
+			xname[len] = '\0';
+
+			ret = xdb_tx_setxattr(xdb, ino, xname,
+					      (const char *) value, vlen, 0);
+			if (ret) {
+				fprintf(stderr, "inode %llu, %s: %s\n",
+					_llu(ino), xname, strerror(-ret));
+				return ret;
+			}
+
+			s->xattrs++;
+			if (++(*pending) < (uint64_t) batch)
+				continue;
+
+			ret = tx_all(xdb, 0, 1);
+			if (ret == 0)
+				ret = tx_all(xdb, 1, 0);
+			if (ret)
+				return ret;
+
+			*pending = 0;
+		}
+	}
+
+	return 0;
+
+corrupted:
+	fputs("corrupted stream: bad record\n", stderr);
+	return -EIO;
+}
+
+static int do_import(const char *dir, struct xdb_config *cfg,
+			struct stream *s, long batch)
+{
+	int ret;
+	int intx = 0;
+	uint64_t pending = 0;
+	uint64_t skipped = 0;
+	unsigned char hdr[8];
+	struct xdb *xdb;
+
+	if (fread(hdr, sizeof(hdr), 1, s->fp) != 1 ||
+	    memcmp(hdr, XPORT_MAGIC, 4)) {
+		fputs("not an xattrfs-xport stream\n", stderr);
+		return -EINVAL;
+	}
+
+	if (hdr[4] != XPORT_VERSION || (hdr[5] != 'i' && hdr[5] != 'p')) {
+		fprintf(stderr, "unsupported stream version %d\n", hdr[4]);
+		return -EINVAL;
+	}
+
+	s->key = hdr[5];
+
+	/* creates the database if needed */
+	ret = xdb_init(&xdb, dir, cfg);
+	if (ret) {
+		fprintf(stderr, "%s: cannot open the xattr database: %s\n",
+			dir, strerror(-ret));
+		return ret;
+	}
+	xdb_exit(xdb);
+
+	/* also fails while the file system is still mounted */
+	ret = exec_shards(dir, cfg->shards, "PRAGMA journal_mode=DELETE;"
+					    "DROP INDEX IF EXISTS idx_xattr_kid");
+	if (ret)
+		return ret;
+
+	ret = xdb_init(&xdb, dir, cfg);
+	if (ret)
+		goto out_index;
+
+	ret = tx_all(xdb, 1, 0);
+	if (ret)
+		goto out;
+
+	intx = 1;
+
+	while ((ret = read_block(s)) > 0) {
+		ret = load_block(xdb, s, dir, batch, &pending, &skipped);
+		if (ret)
+			break;
+	}
+
+	if (ret == 0)
+		ret = tx_all(xdb, 0, 1);
+	else {
+		tx_all(xdb, 0, 0);
+		fprintf(stderr, "%llu xattrs were imported before the error\n",
+			_llu(s->xattrs - pending));
+	}
+
+	intx = 0;
+
+	if (skipped)
+		fprintf(stderr, "%llu xattrs of files not found in %s were "
+				"skipped\n", _llu(skipped), dir);
+out:
+	if (intx)
+		tx_all(xdb, 0, 0);
+	xdb_exit(xdb);
+out_index:
+	if (exec_shards(dir, cfg->shards, "CREATE INDEX IF NOT EXISTS "
+					  "idx_xattr_kid ON xdb_xattr(kid)"))
+		ret = ret ? ret : -EIO;
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int op;
+	int ret;
+	int import;
+	int nshards = 0;
+	long batch = XPORT_BATCH;
+	char *dir;
+	const char *file = NULL;
+	struct xdb_config cfg;
+	struct stream s = { .key = 'i' };
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (0 == strcmp(argv[1], "export"))
+		import = 0;
+	else if (0 == strcmp(argv[1], "import"))
+		import = 1;
+	else {
+		usage(argv[0]);
+		return strcmp(argv[1], "-h") ? 1 : 0;
+	}
+
+	optind = 2;
+	while ((op = getopt(argc, argv, "pb:n:h")) != -1) {
+		switch (op) {
+		case 'p':
+			s.key = 'p';
+			break;
+		case 'b':
+			batch = atol(optarg);
+			break;
+		case 'n':
+			nshards = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return op == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind == argc || argc - optind > 2 || batch <= 0 ||
+	    nshards < 0 || nshards > XDB_MAX_SHARDS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	dir = realpath(argv[optind], NULL);
+	if (!dir) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (optind + 1 < argc)
+		file = argv[optind + 1];
+
+	/* no fsync until the end, the load can be run again */
+	xdb_config_init(&cfg, "fast");
+	cfg.value_cache = 0;
+	cfg.cache_size = XPORT_CACHE;
+
+	ret = xdb_shard_probe(dir);
+	if (ret < 0) {
+		fprintf(stderr, "%s: both a single and a sharded xattr "
+				"database found\n", dir);
+		goto out;
+	}
+	if (ret == 0 && !import) {
+		fprintf(stderr, "%s: no xattr database found\n", dir);
+		ret = -ENOENT;
+		goto out;
+	}
+	if (ret && nshards && ret != nshards) {
+		fprintf(stderr, "%s: the xattr database has %d shards\n",
+			dir, ret);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	cfg.shards = ret ? ret : nshards ? nshards : 1;
+
+	if (file) {
+		s.fp = fopen(file, import ? "r" : "w");
+		if (!s.fp) {
+			perror(file);
+			ret = -errno;
+			goto out;
+		}
+	}
+	else
+		s.fp = import ? stdin : stdout;
+
+	crc32_init();
+
+	ret = import ? do_import(dir, &cfg, &s, batch)
+		     : do_export(dir, &cfg, &s);
+
+	if (file && fclose(s.fp) && ret == 0)
+		ret = -EIO;
+
+	if (ret == 0)
+		fprintf(stderr, "%s: %llu xattrs of %llu files %s\n", dir,
+			_llu(s.xattrs), _llu(s.files),
+			import ? "imported" : "exported");
+out:
+	free(s.buf);
+	free(dir);
+	return ret ? 1 : 0;
+}
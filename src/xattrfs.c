@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
@@ -32,13 +33,118 @@ static void usage(void)
 	printf("Usage: %s [OPTIONS].. b:<basedir> <mountpoint>\n\n"
 	       "options:\n"
 	       "  -d, --debug           Enable debug mode\n"
-	       "  -h, --help            This help message\n\n",
+	       "  -h, --help            This help message\n"
+	       "  -o lowlevel           Use the inode-based FUSE API\n"
+	       "  -o splice             Move file data with splice(2)\n"
+	       "  -o attr_timeout=SEC   kernel cache timeout of attributes (1.0)\n"
+	       "  -o entry_timeout=SEC  kernel cache timeout of names (1.0)\n"
+	       "  -o kernel_cache       Keep file data cached while unchanged\n"
+	       "  -o tiered             Keep small xattrs as native xattrs\n"
+	       "  -o query              List files by xattr in .xattrfs/query\n\n"
+	       "xattr database options:\n"
+	       "  -o backend=NAME       sqlite (default) or kv\n"
+	       "  -o durability=TIER    strict (default), balanced or fast\n"
+	       "  -o journal=MODE       journal mode (wal, delete, truncate, ..)\n"
+	       "  -o sync=LEVEL         sync level (off, normal, full, extra)\n"
+	       "  -o cache_size=KB      page cache size of each connection\n"
+	       "  -o mmap_size=BYTES    memory-mapped I/O size\n"
+	       "  -o checkpoint=PAGES   WAL auto-checkpoint (0: at unmount)\n"
+	       "  -o group_commit       Commit xattr changes in the background\n"
+	       "  -o commit_delay=MSEC  Max. delay of a group commit (10)\n"
+	       "  -o commit_batch=N     Max. changes in a group commit (256)\n"
+	       "  -o value_cache=KB     xattr value cache size (16384, 0: off)\n"
+	       "  -o shards=N           xattr database files (as found, or 1)\n"
+	       "  -o blob_threshold=B   values kept out of line (512, 0: off)\n"
+	       "  -o layout=NAME        rows (default) or packed, when created\n"
+	       "  -o slow_log=FILE      Log slow SQL statements to FILE\n"
+	       "  -o slow_ms=MSEC       Threshold of the slow query log (100)\n"
+	       "  -o memdb              Keep the xattr database in memory\n"
+	       "  -o snapshot=SEC       memdb snapshot interval (60, 0: unmount)\n"
+	       "  -o path_cache=N       path to inode cache entries (65536)\n"
+	       "  -o path_cache_ttl=SEC path to inode cache timeout (10)\n"
+	       "  -o gc_interval=SEC    orphaned xattr sweep interval (0: off)\n"
+	       "  -o gc_batch=N         inodes per sweep step (256)\n\n",
 	       PACKAGE_NAME);
 }
 
+static struct xattrfs_options {
+	int lowlevel;
+	int splice;
+	double attr_timeout;
+	double entry_timeout;
+	int kernel_cache;
+	int tiered;
+	int query;
+	char *backend;
+	char *durability;
+	char *journal;
+	char *sync;
+	long cache_size;
+	long long mmap_size;
+	int checkpoint;
+	int group_commit;
+	int commit_delay;
+	int commit_batch;
+	long value_cache;
+	int shards;
+	long blob_threshold;
+	char *layout;
+	char *slow_log;
+	long slow_ms;
+	int memdb;
+	int snapshot;
+	long path_cache;
+	int path_cache_ttl;
+	int gc_interval;
+	int gc_batch;
+} options = {
+	.attr_timeout = 1.0,
+	.entry_timeout = 1.0,
+	.checkpoint = -1,
+	.commit_delay = -1,
+	.value_cache = -1,
+	.blob_threshold = -1,
+	.slow_ms = -1,
+	.snapshot = -1,
+	.path_cache = 65536,
+	.path_cache_ttl = 10,
+	.gc_batch = 256,
+};
+
+#define XATTRFS_OPT(t, p, v)	{ t, offsetof(struct xattrfs_options, p), v }
+
 enum { OPTKEY_DEBUG = 0, OPTKEY_HELP, OPTKEY_BASEDIR };
 
 static struct fuse_opt xattrfs_opts[] = {
+	XATTRFS_OPT("lowlevel", lowlevel, 1),
+	XATTRFS_OPT("splice", splice, 1),
+	XATTRFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+	XATTRFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+	XATTRFS_OPT("kernel_cache", kernel_cache, 1),
+	XATTRFS_OPT("tiered", tiered, 1),
+	XATTRFS_OPT("query", query, 1),
+	XATTRFS_OPT("backend=%s", backend, 0),
+	XATTRFS_OPT("durability=%s", durability, 0),
+	XATTRFS_OPT("journal=%s", journal, 0),
+	XATTRFS_OPT("sync=%s", sync, 0),
+	XATTRFS_OPT("cache_size=%li", cache_size, 0),
+	XATTRFS_OPT("mmap_size=%lli", mmap_size, 0),
+	XATTRFS_OPT("checkpoint=%i", checkpoint, 0),
+	XATTRFS_OPT("group_commit", group_commit, 1),
+	XATTRFS_OPT("commit_delay=%i", commit_delay, 0),
+	XATTRFS_OPT("commit_batch=%i", commit_batch, 0),
+	XATTRFS_OPT("value_cache=%li", value_cache, 0),
+	XATTRFS_OPT("shards=%i", shards, 0),
+	XATTRFS_OPT("blob_threshold=%li", blob_threshold, 0),
+	XATTRFS_OPT("layout=%s", layout, 0),
+	XATTRFS_OPT("slow_log=%s", slow_log, 0),
+	XATTRFS_OPT("slow_ms=%li", slow_ms, 0),
+	XATTRFS_OPT("memdb", memdb, 1),
+	XATTRFS_OPT("snapshot=%i", snapshot, 0),
+	XATTRFS_OPT("path_cache=%li", path_cache, 0),
+	XATTRFS_OPT("path_cache_ttl=%i", path_cache_ttl, 0),
+	XATTRFS_OPT("gc_interval=%i", gc_interval, 0),
+	XATTRFS_OPT("gc_batch=%i", gc_batch, 0),
 	FUSE_OPT_KEY("-d", OPTKEY_DEBUG),
 	FUSE_OPT_KEY("--debug", OPTKEY_DEBUG),
 	FUSE_OPT_KEY("-h", OPTKEY_HELP),
@@ -75,6 +181,8 @@ static int xattrfs_process_opt(void *data, const char *arg, int key,
 	case OPTKEY_HELP:
 		usage();
 		exit(1);
+	case FUSE_OPT_KEY_OPT:		/* -o options for fuse */
+		return 1;
 	default:
 		if (arg[0] == 'b' && arg[1] == ':') {
 			fsroot = get_real_path(&arg[2]);	/* basedir */
@@ -91,13 +199,140 @@ static int xattrfs_process_opt(void *data, const char *arg, int key,
 	return 0;
 }
 
+static int get_xdb_config(struct xdb_config *cfg)
+{
+	int nshards;
+
+	if (xdb_config_init(cfg, options.durability)) {
+		fprintf(stderr, "unknown durability tier: %s\n",
+				options.durability);
+		return -1;
+	}
+
+	if (options.backend)
+		cfg->backend = options.backend;
+	if (options.journal)
+		cfg->journal = options.journal;
+	if (options.sync)
+		cfg->sync = options.sync;
+
+	cfg->cache_size = options.cache_size;
+	cfg->mmap_size = options.mmap_size;
+	cfg->checkpoint = options.checkpoint;
+	cfg->group_commit = options.group_commit;
+	if (options.commit_delay >= 0)
+		cfg->commit_delay = options.commit_delay;
+	if (options.commit_batch)
+		cfg->commit_batch = options.commit_batch;
+	if (options.value_cache >= 0)
+		cfg->value_cache = options.value_cache;
+	else if (0 == strcmp(cfg->backend, "kv"))
+		cfg->value_cache = 0;
+	if (options.shards)
+		cfg->shards = options.shards;
+	if (options.blob_threshold >= 0)
+		cfg->blob_threshold = options.blob_threshold;
+	cfg->layout = options.layout;
+	cfg->slow_log = options.slow_log;
+	if (options.slow_ms >= 0)
+		cfg->slow_ms = options.slow_ms;
+	cfg->memdb = options.memdb;
+	if (options.snapshot >= 0)
+		cfg->snapshot = options.snapshot;
+
+	/* fuse runs in / once it is in the background */
+	if (cfg->slow_log && cfg->slow_log[0] != '/') {
+		fputs("the slow query log should be an absolute path.\n",
+		      stderr);
+		return -1;
+	}
+
+	if (xdb_config_check(cfg)) {
+		fputs("invalid xattr database options.\n", stderr);
+		return -1;
+	}
+
+	/* the kv log is one file, whatever sqlite databases are there */
+	if (0 == strcmp(cfg->backend, "kv"))
+		return 0;
+
+	/* inodes are routed by the number of shards, which is fixed */
+	nshards = xdb_shard_probe(fsroot);
+	if (nshards < 0) {
+		fputs("both a single and a sharded xattr database found.\n",
+		      stderr);
+		return -1;
+	}
+
+	if (nshards && !options.shards)
+		cfg->shards = nshards;
+	else if (nshards && nshards != cfg->shards) {
+		fprintf(stderr, "the xattr database has %d shards, "
+				"use xattrfs-reshard to change it.\n",
+				nshards);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * the database is opened again by the init of the file system, where an error
+ * can only unmount it. a database of a newer version, or of another layout
+ * than the one asked for, is refused here, before it is mounted.
+ */
+static int check_xdb(const struct xdb_config *cfg)
+{
+	int ret;
+	struct xdb *xdb;
+
+	ret = xdb_init(&xdb, fsroot, cfg);
+	if (ret) {
+		fprintf(stderr, "failed to open the xattr database: %s\n",
+				strerror(-ret));
+		return ret;
+	}
+
+	xdb_exit(xdb);
+
+	return 0;
+}
+
+/* the path api leaves kernel caching to libfuse, which has the same options.
+ * like in the low-level mode, kernel_cache only keeps the pages of a file that
+ * has not changed since they were cached (auto_cache of libfuse).
+ */
+static int add_cache_opts(struct fuse_args *args)
+{
+	char buf[64];
+
+	sprintf(buf, "-oattr_timeout=%g", options.attr_timeout);
+	if (fuse_opt_add_arg(args, buf))
+		return -1;
+
+	sprintf(buf, "-oentry_timeout=%g", options.entry_timeout);
+	if (fuse_opt_add_arg(args, buf))
+		return -1;
+
+	if (options.kernel_cache && fuse_opt_add_arg(args, "-oauto_cache"))
+		return -1;
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	struct xattrfs_ctx *ctx;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-	if (fuse_opt_parse(&args, NULL, xattrfs_opts, xattrfs_process_opt) < 0)
+	if (fuse_opt_parse(&args, &options, xattrfs_opts,
+			   xattrfs_process_opt) < 0)
+		return EINVAL;
+
+	if (options.attr_timeout < 0 || options.entry_timeout < 0) {
+		fputs("invalid kernel cache timeouts.\n", stderr);
 		return EINVAL;
+	}
 
 #ifdef FUSE_CAP_BIG_WRITES
 	if (fuse_opt_add_arg(&args, "-obig_writes")) {
@@ -105,11 +340,17 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 #endif
-	if (fuse_opt_add_arg(&args, "-ouse_ino")) {
+	/* the low-level api always reports the inode numbers */
+	if (!options.lowlevel && fuse_opt_add_arg(&args, "-ouse_ino")) {
 		fputs("failed to set an inode option (-ouse_ino).\n", stderr);
 		exit(1);
 	}
 
+	if (!options.lowlevel && add_cache_opts(&args)) {
+		fputs("failed to set the kernel cache options.\n", stderr);
+		exit(1);
+	}
+
 	if (!fsroot) {
 		fputs("base directory was not given, exiting..\n", stderr);
 		return EINVAL;
@@ -129,6 +370,43 @@ int main(int argc, char **argv)
 	ctx->mntpnt = mntpnt;
 	ctx->fsroot = fsroot;
 	ctx->debug = debug;
+	ctx->splice = options.splice;
+	ctx->attr_timeout = options.attr_timeout;
+	ctx->entry_timeout = options.entry_timeout;
+	ctx->kernel_cache = options.kernel_cache;
+	ctx->tiered = options.tiered;
+	ctx->query = options.query;
+
+	/* the low-level api does not maintain the names of the inodes */
+	if (options.query && options.lowlevel) {
+		fputs("-o query is not supported with -o lowlevel.\n", stderr);
+		return EINVAL;
+	}
+
+	if (get_xdb_config(&ctx->xdbcfg))
+		return EINVAL;
+
+	if (options.path_cache < 0 || options.path_cache_ttl < 0) {
+		fputs("invalid path cache options.\n", stderr);
+		return EINVAL;
+	}
+
+	ctx->pcache_size = options.path_cache;
+	ctx->pcache_ttl = options.path_cache_ttl;
+
+	if (options.gc_interval < 0 || options.gc_batch <= 0) {
+		fputs("invalid garbage collection options.\n", stderr);
+		return EINVAL;
+	}
+
+	ctx->gc_interval = options.gc_interval;
+	ctx->gc_batch = options.gc_batch;
+
+	if (check_xdb(&ctx->xdbcfg))
+		return EINVAL;
+
+	if (options.lowlevel)
+		return xattrfs_ll_main(&args, ctx);
 
 	return fuse_main(args.argc, args.argv, &xattrfs_fops, ctx);
 }
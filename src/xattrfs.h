@@ -3,23 +3,185 @@
 
 #include <config.h>
 #include <fuse.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <sqlite3.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 /**
  * xdb interface, implemented at xattrfs-xdb.c
  */
 
 #define XDB_FILE		".xattr.db"
+#define XDB_SHARD_FILE		".xattr-%d.db"	/* with more than one shard */
+#define XDB_MAX_SHARDS		64
+#define KV_FILE			".xattr.kv"	/* of the kv backend */
 
-struct xdb {
+/**
+ * SQLite tuning, set from the mount options (see xattrfs.c). durability tiers
+ * are presets of journal and sync, and the other fields override them.
+ */
+struct xdb_config {
+	const char *backend;	/* sqlite or kv */
+	const char *journal;	/* journal_mode: wal, delete, truncate, .. */
+	const char *sync;	/* synchronous: off, normal, full, extra */
+	long cache_size;	/* page cache per connection, in KiB */
+	long long mmap_size;	/* memory-mapped I/O, in bytes */
+	int checkpoint;		/* wal_autocheckpoint, in pages */
+	int group_commit;	/* queue mutations for the writer thread */
+	int commit_delay;	/* max. msec a queued mutation waits */
+	int commit_batch;	/* max. mutations in one transaction */
+	long value_cache;	/* xattr value cache, in KiB (0: disabled,
+				   as it must be with kv) */
+	int shards;		/* database files, each with its own writer */
+	long blob_threshold;	/* larger values out of line (0: never) */
+	const char *layout;	/* rows or packed, for a new database (NULL:
+				   as the database has it, or rows) */
+	const char *slow_log;	/* file of the slow statements, or NULL */
+	long slow_ms;		/* the threshold of the slow query log */
+	int memdb;		/* keep the shards in memory */
+	int snapshot;		/* sec between snapshots of a memdb (0: at
+				   unmount only) */
+};
+
+int xdb_config_init(struct xdb_config *cfg, const char *tier);
+
+int xdb_config_check(const struct xdb_config *cfg);
+
+struct xdb_conn;
+struct xdb_wq;
+struct xdb_cache;
+struct xdb_snap;
+struct xdb_names;
+struct xdb_kv;
+struct xdb;
+
+/**
+ * a storage backend of the xdb interface, picked by xdb_config.backend. the
+ * sqlite one (xattrfs-xdb.c) has everything below xdb_init(); the kv one
+ * (xattrfs-kv.c) has none of the shards, the group commit, the value cache
+ * or the direct access. the calls are timed before they reach the backend.
+ */
+struct xdb_backend {
+	const char *name;
+	int (*init)(struct xdb **xdb, const char *dir,
+		    const struct xdb_config *cfg);
+	void (*exit)(struct xdb *xdb);
+	int (*getxattr)(struct xdb *xdb, ino_t ino, const char *name,
+			char *value, size_t size);
+	int (*setxattr)(struct xdb *xdb, ino_t ino, const char *name,
+			const char *value, size_t size, int flags);
+	int (*removexattr)(struct xdb *xdb, ino_t ino, const char *name);
+	int (*listxattr)(struct xdb *xdb, ino_t ino, char *list, size_t size);
+	int (*purge)(struct xdb *xdb, ino_t ino);
+	int (*scan_inodes)(struct xdb *xdb, ino_t after, ino_t *inos,
+			   int count);
+	int (*dentry_add)(struct xdb *xdb, ino_t parent, const char *name,
+			  ino_t ino);
+	int (*dentry_remove)(struct xdb *xdb, ino_t parent, const char *name);
+	int (*dentry_lookup)(struct xdb *xdb, ino_t ino, ino_t *parent,
+			     char *name, size_t size);
+	int (*query)(struct xdb *xdb, const char *name, const char *value,
+		     size_t len, int prefix, ino_t **inos);
+};
+
+extern const struct xdb_backend xdb_kv_backend;
+
+const struct xdb_backend *xdb_backend(const char *name);
+
+/**
+ * the xattrs of an inode live in one of the shards, picked by xdb_shard_of().
+ * each shard is a database file with its own writer, readers and group commit
+ * queue, so writes to different shards commit in parallel.
+ */
+struct xdb_shard {
 	const char *dbpath;
-	sqlite3 *conn;
+	const char *memdb;		/* uri of the memdb, or NULL */
+	struct xdb_conn *writer;	/* the only connection that writes */
+	pthread_mutex_t wlock;		/* serializes the writer */
+	pthread_key_t key;		/* per-thread reader connection */
+	struct xdb_conn *idle;		/* readers left by exited threads */
+	struct xdb_wq *wq;		/* group commit queue, or NULL */
+	struct xdb_names *names;	/* name ids of the shard */
 };
 
-int xdb_init(struct xdb **xdb, const char *dir);
+struct xdb {
+	const struct xdb_backend *be;
+	struct xdb_kv *kv;		/* the kv backend, or NULL */
+	pthread_mutex_t lock;		/* protects conns and idle */
+	struct xdb_conn *conns;		/* every open connection */
+	struct xdb_config cfg;
+	struct xdb_cache *cache;	/* value cache, or NULL */
+	FILE *slow_log;			/* slow query log, or NULL */
+	struct xdb_snap *snap;		/* memdb snapshots, or NULL */
+	int layout;			/* XDB_LAYOUT_*, of every shard */
+	int nshards;
+	struct xdb_shard shards[];
+};
+
+/* inode numbers are mostly sequential, so spread them with a fibonacci hash */
+static inline int xdb_shard_of(ino_t ino, int nshards)
+{
+	return (int) ((((uint64_t) ino * 0x9e3779b97f4a7c15ULL) >> 32) %
+		      nshards);
+}
+
+int xdb_init(struct xdb **xdb, const char *dir,
+		const struct xdb_config *cfg);
 
 void xdb_exit(struct xdb *xdb);
 
+char *xdb_shard_path(const char *dir, int shard, int nshards);
+
+int xdb_shard_probe(const char *dir);
+
+/**
+ * the layouts of the xattrs in a database, which is picked when it is made:
+ * a row per xattr (xdb_xattr), or a packed record per inode (xdb_packed).
+ */
+enum {
+	XDB_LAYOUT_ROWS = 0,
+	XDB_LAYOUT_PACKED,
+};
+
+/**
+ * brings a database made by an older version to the current schema, or makes
+ * an empty one with @layout.
+ */
+int xdb_schema_upgrade(sqlite3 *db, int layout);
+
+int xdb_schema_layout(sqlite3 *db);
+
+/**
+ * sqlite3_db_status() of the connections of a shard, summed. each connection
+ * is sampled by the thread using it, so the numbers lag a little.
+ */
+struct xdb_status {
+	int conns;
+	uint64_t cache_used;		/* bytes of the page caches */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_writes;
+	uint64_t schema_used;		/* bytes */
+	uint64_t stmt_used;		/* bytes of the prepared statements */
+};
+
+void xdb_status(struct xdb *xdb, int shard, struct xdb_status *st);
+
+/* the log and the index of the kv backend */
+struct xdb_kv_stats {
+	uint64_t keys;			/* live xattrs and dentries */
+	uint64_t log_bytes;
+	uint64_t dead_bytes;		/* of overwritten or removed records */
+	uint64_t compactions;
+};
+
+void xdb_kv_stats(struct xdb *xdb, struct xdb_kv_stats *st);
+
 /**
  * all functions are working with inode number (stat.st_ino).
  */
@@ -34,19 +196,433 @@ int xdb_removexattr(struct xdb *xdb, ino_t ino, const char *name);
 
 int xdb_listxattr(struct xdb *xdb, ino_t ino, char *list, size_t size);
 
+int xdb_purge(struct xdb *xdb, ino_t ino);
+
+int xdb_scan_inodes(struct xdb *xdb, ino_t after, ino_t *inos, int count);
+
+int xdb_query(struct xdb *xdb, const char *name, const char *value,
+		size_t len, int prefix, ino_t **inos);
+
+/**
+ * the reverse index of the namespace, for the query directory: the name of
+ * each inode in its parent directory.
+ */
+
+int xdb_dentry_add(struct xdb *xdb, ino_t parent, const char *name, ino_t ino);
+
+int xdb_dentry_remove(struct xdb *xdb, ino_t parent, const char *name);
+
+int xdb_dentry_lookup(struct xdb *xdb, ino_t ino, ino_t *parent,
+			char *name, size_t size);
+
+/**
+ * direct database access, bypassing the group commit queue. xdb_tx_begin()
+ * holds the writer connection of a shard in a transaction until xdb_tx_end(),
+ * and xdb_tx_*xattr() in between only take inodes of that shard.
+ */
+
+int xdb_db_getxattr(struct xdb *xdb, ino_t ino,
+			const char *name, char *value, size_t size);
+
+int xdb_tx_begin(struct xdb *xdb, int shard);
+
+int xdb_tx_setxattr(struct xdb *xdb, ino_t ino, const char *name,
+			const char *value, size_t size, int flags);
+
+int xdb_tx_removexattr(struct xdb *xdb, ino_t ino, const char *name);
+
+int xdb_tx_end(struct xdb *xdb, int shard, int commit);
+
+/**
+ * group commit queue, implemented at xattrfs-wq.c. mutations are queued and
+ * acknowledged at once, and a writer thread applies them in batches. reads
+ * through xdb_getxattr() and xdb_listxattr() see the queued mutations. each
+ * shard has its own queue and writer thread.
+ */
+
+int xdb_wq_init(struct xdb_wq **wq, struct xdb *xdb, int shard, int delay,
+		int batch);
+
+void xdb_wq_exit(struct xdb_wq *wq);
+
+int xdb_wq_getxattr(struct xdb_wq *wq, ino_t ino, const char *name,
+			char *value, size_t size, int *pending);
+
+int xdb_wq_setxattr(struct xdb_wq *wq, ino_t ino, const char *name,
+			const char *value, size_t size, int flags);
+
+int xdb_wq_removexattr(struct xdb_wq *wq, ino_t ino, const char *name);
+
+void xdb_wq_flush(struct xdb_wq *wq, ino_t ino);
+
+void xdb_wq_flush_all(struct xdb_wq *wq);
+
+/**
+ * name map, implemented at xattrfs-names.c: the ids of the xattr names of a
+ * shard in xdb_name, by full name ("user.foo"). a lookup returns 0 if the name
+ * is not in the map, which does not mean it is not in the database.
+ */
+
+int xdb_names_init(struct xdb_names **names);
+
+void xdb_names_exit(struct xdb_names *names);
+
+int64_t xdb_names_lookup(struct xdb_names *names, const char *name);
+
+void xdb_names_insert(struct xdb_names *names, const char *name, int64_t id);
+
+void xdb_names_clear(struct xdb_names *names);
+
+/**
+ * packed records, implemented at xattrfs-packed.c: the entries of the xattrs
+ * of an inode in the packed layout. an entry has the name without the
+ * namespace, and its value at voff in the record, or the bid of the value if
+ * it is out of line.
+ */
+
+struct xdb_packed_entry {
+	size_t off;			/* in the record */
+	size_t len;
+	int nid;
+	int blob;
+	const char *name;		/* not terminated */
+	size_t namelen;
+	size_t size;			/* of the value */
+	size_t voff;
+};
+
+size_t xdb_packed_len(size_t namelen, size_t size, int blob);
+
+size_t xdb_packed_put(unsigned char *p, int nid, const char *name,
+			size_t namelen, const void *value, size_t size,
+			int blob, int64_t bid);
+
+int xdb_packed_next(const unsigned char *rec, size_t len, size_t *pos,
+			struct xdb_packed_entry *e);
+
+int xdb_packed_find(const unsigned char *rec, size_t len, int nid,
+			const char *name, struct xdb_packed_entry *e);
+
+int64_t xdb_packed_bid(const unsigned char *rec,
+			const struct xdb_packed_entry *e);
+
+void xdb_packed_set_bid(unsigned char *rec, const struct xdb_packed_entry *e,
+			int64_t bid);
+
+int xdb_packed_register(sqlite3 *db);
+
+/**
+ * snapshots of the in-memory database, implemented at xattrfs-snap.c. the
+ * memdb of a shard is loaded from its file by xdb_snap_load(), and written
+ * back to it periodically and by xdb_snap_exit().
+ */
+
+int xdb_snap_load(struct xdb_shard *shard);
+
+int xdb_snap_init(struct xdb_snap **snap, struct xdb *xdb, int interval);
+
+int xdb_snap_exit(struct xdb_snap *snap);
+
+/**
+ * xattr value cache, implemented at xattrfs-cache.c. xdb_getxattr() and
+ * xdb_listxattr() look here first, and a miss returns a sequence number to
+ * pass to the following insert. a negative size caches "no such attribute".
+ */
+
+struct xdb_cache_stats {
+	uint64_t hits;
+	uint64_t neg_hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t entries;
+	uint64_t bytes;
+	uint64_t limit;
+};
+
+int xdb_cache_init(struct xdb_cache **cache, size_t limit);
+
+void xdb_cache_exit(struct xdb_cache *cache);
+
+int xdb_cache_lookup(struct xdb_cache *cache, ino_t ino, const char *name,
+			char *value, size_t size, ssize_t *ret, uint64_t *seq);
+
+void xdb_cache_insert(struct xdb_cache *cache, ino_t ino, const char *name,
+			const char *value, ssize_t size, uint64_t seq);
+
+void xdb_cache_invalidate(struct xdb_cache *cache, ino_t ino,
+			const char *name);
+
+int xdb_cache_lookup_list(struct xdb_cache *cache, ino_t ino,
+			char *list, size_t size, ssize_t *ret, uint64_t *seq);
+
+void xdb_cache_insert_list(struct xdb_cache *cache, ino_t ino,
+			const char *list, size_t size, uint64_t seq);
+
+/**
+ * for the values read along with another one: xdb_cache_gen() before reading,
+ * and the values are only cached if nothing was invalidated since then.
+ */
+uint64_t xdb_cache_gen(struct xdb_cache *cache);
+
+void xdb_cache_prefill(struct xdb_cache *cache, ino_t ino, const char *name,
+			const char *value, size_t size, uint64_t gen);
+
+void xdb_cache_stats(struct xdb_cache *cache, struct xdb_cache_stats *stats);
+
+/**
+ * operation metrics, implemented at xattrfs-metrics.c. an operation is timed
+ * between xattrfs_metrics_begin() and xattrfs_metrics_end(), and
+ * xattrfs_metrics_busy() counts a SQLITE_BUSY retry of the xdb operation in
+ * progress on the calling thread.
+ */
+
+enum {
+	/* fuse operations, in the order of struct fuse_operations */
+	XM_GETATTR = 0,
+	XM_READLINK,
+	XM_MKNOD,
+	XM_MKDIR,
+	XM_UNLINK,
+	XM_RMDIR,
+	XM_SYMLINK,
+	XM_RENAME,
+	XM_LINK,
+	XM_CHMOD,
+	XM_CHOWN,
+	XM_TRUNCATE,
+	XM_UTIME,
+	XM_OPEN,
+	XM_READ,
+	XM_WRITE,
+	XM_STATFS,
+	XM_FLUSH,
+	XM_RELEASE,
+	XM_FSYNC,
+	XM_SETXATTR,
+	XM_GETXATTR,
+	XM_LISTXATTR,
+	XM_REMOVEXATTR,
+	XM_OPENDIR,
+	XM_READDIR,
+	XM_RELEASEDIR,
+	XM_FSYNCDIR,
+	XM_ACCESS,
+	XM_FTRUNCATE,
+	XM_FGETATTR,
+	XM_UTIMENS,
+	XM_READ_BUF,
+	XM_WRITE_BUF,
+
+	/* xdb interface */
+	XM_XDB_GETXATTR,
+	XM_XDB_SETXATTR,
+	XM_XDB_REMOVEXATTR,
+	XM_XDB_LISTXATTR,
+	XM_XDB_PURGE,
+	XM_XDB_SCAN,
+	XM_XDB_QUERY,
+	XM_XDB_DENTRY_ADD,
+	XM_XDB_DENTRY_REMOVE,
+	XM_XDB_DENTRY_LOOKUP,
+	XM_XDB_TX,
+
+	N_XM
+};
+
+#define XM_XDB_FIRST		XM_XDB_GETXATTR
+
+uint64_t xattrfs_metrics_begin(int op);
+
+void xattrfs_metrics_end(int op, uint64_t start, int ret);
+
+void xattrfs_metrics_busy(void);
+
+void xattrfs_metrics_reset(void);
+
+int xattrfs_metrics_show(FILE *fp);
+
 /**
  * fuse implementation at xattrfs-fuse.c
  */
 
+struct xattrfs_pcache;
+struct xattrfs_gc;
+
 struct xattrfs_ctx {
 	int debug;
 	const char *mntpnt;
 	const char *fsroot;
 	struct xdb *xdb;
+	struct xdb_config xdbcfg;
+	unsigned long pcache_size;	/* entries in the path cache */
+	int pcache_ttl;			/* sec */
+	struct xattrfs_pcache *pcache;	/* path cache, or NULL */
+	int splice;			/* move file data with splice(2) */
+	double attr_timeout;		/* sec the kernel caches attributes */
+	double entry_timeout;		/* sec the kernel caches names */
+	int kernel_cache;		/* keep the page cache across opens */
+	int gc_interval;		/* sec between sweeps (0: disabled) */
+	int gc_batch;			/* entries per sweep step */
+	struct xattrfs_gc *gc;		/* orphan sweeper, or NULL */
+	int tiered;			/* native xattrs, database overflow */
+	int query;			/* index names for the query directory */
 };
 
 extern struct fuse_operations xattrfs_fops;
 
+/**
+ * the type (and inode number) of a directory entry, for filling readdir. most
+ * file systems give the type in d_type, and the others need a stat.
+ */
+static inline void xattrfs_dirent_stat(DIR *dp, struct dirent *de,
+					struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	if (de->d_type == DT_UNKNOWN &&
+	    0 == fstatat(dirfd(dp), de->d_name, st, AT_SYMLINK_NOFOLLOW))
+		return;
+
+	st->st_ino = de->d_ino;
+	st->st_mode = DTTOIF(de->d_type);
+}
+
+static inline void xattrfs_want_splice(struct xattrfs_ctx *ctx,
+					struct fuse_conn_info *conn)
+{
+#ifdef FUSE_CAP_SPLICE_READ
+	unsigned int splice = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+				FUSE_CAP_SPLICE_MOVE;
+
+	if (ctx->splice)
+		conn->want |= conn->capable & splice;
+#endif
+}
+
+/**
+ * orphan sweeper, implemented at xattrfs-gc.c. rename, link and setxattr
+ * should touch the inode, so that a sweep in progress does not purge it.
+ */
+
+int xattrfs_gc_init(struct xattrfs_gc **gc, struct xattrfs_ctx *ctx,
+			int interval, int batch);
+
+void xattrfs_gc_exit(struct xattrfs_gc *gc);
+
+void xattrfs_gc_touch(struct xattrfs_gc *gc, ino_t ino);
+
+void xattrfs_gc_stats(struct xattrfs_gc *gc, uint64_t *rounds,
+			uint64_t *purged);
+
+static inline void xattrfs_touch(struct xattrfs_ctx *ctx, ino_t ino)
+{
+	if (ctx->gc)
+		xattrfs_gc_touch(ctx->gc, ino);
+}
+
+/* the xattrs of a base file go with its last link (@sb is from before) */
+static inline void xattrfs_purge_unlinked(struct xattrfs_ctx *ctx,
+					const struct stat *sb)
+{
+	if (ctx->xdb && (S_ISDIR(sb->st_mode) || sb->st_nlink <= 1))
+		xdb_purge(ctx->xdb, sb->st_ino);
+}
+
+/**
+ * native xattrs with the database as overflow, implemented at xattrfs-tier.c.
+ * @path is the base file, or with @follow, a /proc/self/fd link to it.
+ */
+
+int xattrfs_tier_getxattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, const char *name,
+			char *value, size_t size);
+
+int xattrfs_tier_setxattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, const char *name,
+			const char *value, size_t size, int flags);
+
+int xattrfs_tier_removexattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, const char *name);
+
+int xattrfs_tier_listxattr(struct xattrfs_ctx *ctx, const char *path,
+			int follow, ino_t ino, char *list, size_t size);
+
+/**
+ * path to inode cache, implemented at xattrfs-pcache.c
+ */
+
+int xattrfs_pcache_init(struct xattrfs_pcache **pc, unsigned long size,
+			int ttl);
+
+void xattrfs_pcache_exit(struct xattrfs_pcache *pc);
+
+uint64_t xattrfs_pcache_seq(struct xattrfs_pcache *pc, const char *path);
+
+int xattrfs_pcache_lookup(struct xattrfs_pcache *pc, const char *path,
+			ino_t *ino, uint64_t *seq);
+
+void xattrfs_pcache_insert(struct xattrfs_pcache *pc, const char *path,
+			ino_t ino, uint64_t seq);
+
+void xattrfs_pcache_invalidate(struct xattrfs_pcache *pc, const char *path);
+
+void xattrfs_pcache_invalidate_all(struct xattrfs_pcache *pc);
+
+/**
+ * control namespace, implemented at xattrfs-ctl.c
+ */
+
+#define XATTRFS_CTL_DIR		"/.xattrfs"
+
+/* inode numbers of the control nodes, counting down from the top */
+#define XATTRFS_CTL_INO(n)	((ino_t) ~0ULL - (n))
+#define XATTRFS_CTL_NODES	256
+
+static inline int xattrfs_is_ctl_ino(ino_t ino)
+{
+	return ino > XATTRFS_CTL_INO(XATTRFS_CTL_NODES);
+}
+
+static inline int xattrfs_is_ctl(const char *path)
+{
+	size_t len = sizeof(XATTRFS_CTL_DIR) - 1;
+
+	return path && 0 == strncmp(path, XATTRFS_CTL_DIR, len) &&
+		(path[len] == '\0' || path[len] == '/');
+}
+
+int xattrfs_ctl_getattr(struct xattrfs_ctx *ctx, const char *path,
+			struct stat *stbuf);
+
+int xattrfs_ctl_access(struct xattrfs_ctx *ctx, const char *path, int mask);
+
+int xattrfs_ctl_readdir(struct xattrfs_ctx *ctx, const char *path,
+			void *buf, fuse_fill_dir_t filler);
+
+int xattrfs_ctl_open(struct xattrfs_ctx *ctx, const char *path,
+			struct fuse_file_info *fi);
+
+int xattrfs_ctl_read(const char *path, char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi);
+
+int xattrfs_ctl_write(struct xattrfs_ctx *ctx, size_t size,
+			struct fuse_file_info *fi);
+
+int xattrfs_ctl_truncate(struct xattrfs_ctx *ctx, const char *path);
+
+int xattrfs_ctl_release(const char *path, struct fuse_file_info *fi);
+
+int xattrfs_ctl_readlink(struct xattrfs_ctx *ctx, const char *path,
+			char *link, size_t size);
+
+int xattrfs_ctl_path(ino_t ino, char *buf, size_t size);
+
+/**
+ * low-level fuse implementation, at xattrfs-ll.c (-o lowlevel)
+ */
+
+int xattrfs_ll_main(struct fuse_args *args, struct xattrfs_ctx *ctx);
+
 #define _llu(x)			((unsigned long long) (x))
 
 #endif /* _XATTRFS_H_ */